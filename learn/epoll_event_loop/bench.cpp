@@ -0,0 +1,278 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+#include "cluster.h"
+#include "protocol.h"
+
+// Pipelined SET/GET benchmark.
+//
+// Keeps up to `pipeline` requests in flight on an AsyncClient, a new request
+// is sent as soon as one completes, from its callback. In cluster mode the
+// slot map is fetched with CLUSTER SLOTS, each request goes to the owner of
+// its key and the map is refreshed on MOVED. The main thread then sends the
+// requests, it owns the map.
+
+namespace {
+
+using Args = std::vector<std::string>;
+using Clock = std::chrono::steady_clock;
+
+// A request is given up after this many redirects
+constexpr int k_max_redirects = 16;
+
+struct BenchConfig {
+  std::string host = "127.0.0.1";
+  int port = 9001;
+  size_t requests = 100000;
+  size_t pipeline = 16;
+  size_t keyspace = 10000;
+  size_t dataSize = 16;
+  bool get = false;
+  bool cluster = false;
+};
+
+// Connections to the nodes and the slot -> node map
+class Nodes {
+public:
+  // Return the connection to "host:port", nullptr on error
+  AsyncClient *get(const std::string &addr) {
+    auto it = _clients.find(addr);
+    if (it != _clients.end()) {
+      return it->second.get();
+    }
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+      return nullptr;
+    }
+    auto client = std::make_unique<AsyncClient>();
+    if (!client->connect(addr.substr(0, colon), atoi(&addr[colon + 1]))) {
+      return nullptr;
+    }
+    return (_clients[addr] = std::move(client)).get();
+  }
+
+  // Load the slot map from `addr`
+  bool loadSlots(const std::string &addr) {
+    AsyncClient *client = get(addr);
+    if (!client) {
+      return false;
+    }
+    Protocol::Value reply = client->send({"cluster", "slots"}).get();
+    if (reply.type != SER_ARR) {
+      return false;
+    }
+    slots.assign(k_cluster_slots, addr);
+    for (const auto &range : reply.elems) {
+      if (range.elems.size() != 3) {
+        return false;
+      }
+      for (int64_t i = range.elems[0].num; i <= range.elems[1].num; ++i) {
+        slots[i] = range.elems[2].str;
+      }
+    }
+    return true;
+  }
+
+  std::vector<std::string> slots;
+
+private:
+  std::map<std::string, std::unique_ptr<AsyncClient>> _clients;
+};
+
+// Split "MOVED <slot> <addr>" / "ASK <slot> <addr>"
+bool parseRedirect(const std::string &err, std::string &kind, int &slot,
+                   std::string &addr) {
+  std::istringstream in(err);
+  return (bool)(in >> kind >> slot >> addr);
+}
+
+bool isRedirect(const std::string &err) {
+  return err.compare(0, 6, "MOVED ") == 0 || err.compare(0, 4, "ASK ") == 0 ||
+         err.compare(0, 8, "TRYAGAIN") == 0;
+}
+
+bool parseArgs(int argc, char **argv, BenchConfig &config) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "-n" && hasValue && std::stoul(argv[i + 1]) > 0) {
+      config.requests = std::stoul(argv[++i]);
+    } else if (arg == "-P" && hasValue) {
+      config.pipeline = std::max(1ul, std::stoul(argv[++i]));
+    } else if (arg == "-r" && hasValue) {
+      config.keyspace = std::max(1ul, std::stoul(argv[++i]));
+    } else if (arg == "-d" && hasValue) {
+      config.dataSize = std::stoul(argv[++i]);
+    } else if (arg == "-t" && hasValue) {
+      config.get = std::string(argv[++i]) == "get";
+    } else if (arg == "--host" && hasValue) {
+      config.host = argv[++i];
+    } else if (arg == "--port" && hasValue) {
+      config.port = std::stoi(argv[++i]);
+    } else if (arg == "--cluster") {
+      config.cluster = true;
+    } else {
+      std::cout << "Usage: " << argv[0]
+                << " [-n requests] [-P pipeline] [-r keyspace] [-d size]"
+                   " [-t set|get] [--host host] [--port port] [--cluster]"
+                << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  BenchConfig config;
+  if (!parseArgs(argc, argv, config)) {
+    return 1;
+  }
+  std::string seed = config.host + ":" + std::to_string(config.port);
+  Nodes nodes;
+  if (config.cluster ? !nodes.loadSlots(seed) : !nodes.get(seed)) {
+    std::cout << "Error connecting to " << seed << std::endl;
+    return 1;
+  }
+
+  size_t n = config.requests;
+  std::mt19937_64 rng(42);
+  std::vector<std::string> keys(n);
+  for (auto &key : keys) {
+    key = "key:" + std::to_string(rng() % config.keyspace);
+  }
+  std::string value(config.dataSize, 'x');
+  std::vector<Clock::time_point> starts(n);
+  std::vector<double> latencies(n);
+  std::vector<int> tries(n, 0);
+  std::atomic<size_t> errors{0};
+  size_t redirects = 0;
+
+  // Shared with the I/O threads
+  std::mutex mu;
+  std::condition_variable cv;
+  size_t sent = 0;
+  size_t inflight = 0;
+  // Redirected requests, retried by the main thread so that ASKING and the
+  // command are sent back to back
+  std::vector<std::pair<size_t, std::string>> redirected;
+
+  std::function<void(size_t, const std::string &, bool)> issue;
+  auto onReply = [&](size_t id, Protocol::Value &reply) {
+    if (config.cluster && reply.isErr() && isRedirect(reply.str)) {
+      std::lock_guard<std::mutex> lock(mu);
+      redirected.emplace_back(id, std::move(reply.str));
+      cv.notify_one();
+      return;
+    }
+    std::chrono::duration<double, std::micro> latency =
+        Clock::now() - starts[id];
+    latencies[id] = latency.count();
+    errors += reply.isErr();
+    std::unique_lock<std::mutex> lock(mu);
+    if (!config.cluster && sent < n) {
+      // Sent with the other requests of the read, the main thread isn't
+      // woken up for each reply
+      size_t next = sent++;
+      lock.unlock();
+      starts[next] = Clock::now();
+      issue(next, seed, false);
+      return;
+    }
+    --inflight;
+    cv.notify_one();
+  };
+  issue = [&](size_t id, const std::string &addr, bool asking) {
+    AsyncClient *client = nodes.get(addr);
+    if (!client) {
+      std::cout << "Error connecting to " << addr << std::endl;
+      exit(1);
+    }
+    if (asking) {
+      client->send({"asking"}, [](Protocol::Value &) {});
+    }
+    Args cmd = config.get ? Args{"get", keys[id]}
+                          : Args{"set", keys[id], value};
+    client->send(cmd,
+                 [&, id](Protocol::Value &reply) { onReply(id, reply); });
+  };
+  auto owner = [&](size_t id) {
+    return config.cluster ? nodes.slots[Cluster::keyHashSlot(keys[id])]
+                          : seed;
+  };
+
+  auto start = Clock::now();
+  std::unique_lock<std::mutex> lock(mu);
+  while (sent < n || inflight > 0) {
+    cv.wait(lock, [&]() {
+      return !redirected.empty() || (sent < n && inflight < config.pipeline) ||
+             (sent == n && inflight == 0);
+    });
+    auto retries = std::move(redirected);
+    redirected.clear();
+    size_t room = sent < n ? std::min(n - sent, config.pipeline - inflight) : 0;
+    size_t first = sent;
+    sent += room;
+    inflight += room;
+    lock.unlock();
+
+    for (auto &[id, err] : retries) {
+      std::string kind, addr;
+      int slot = 0;
+      if (++tries[id] > k_max_redirects) {
+        kind = "";
+      } else if (err.compare(0, 8, "TRYAGAIN") == 0) {
+        kind = "TRYAGAIN";
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      } else if (!parseRedirect(err, kind, slot, addr)) {
+        kind = "";
+      } else if (kind == "MOVED") {
+        nodes.slots[slot] = addr;
+      }
+      if (kind.empty()) {
+        ++errors;
+        std::lock_guard<std::mutex> guard(mu);
+        --inflight;
+        continue;
+      }
+      ++redirects;
+      issue(id, kind == "ASK" ? addr : owner(id), kind == "ASK");
+    }
+    for (size_t id = first; id < first + room; ++id) {
+      starts[id] = Clock::now();
+      issue(id, owner(id), false);
+    }
+    lock.lock();
+  }
+  lock.unlock();
+  std::chrono::duration<double> elapsed = Clock::now() - start;
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies[std::min(latencies.size() - 1,
+                              (size_t)(p * latencies.size()))];
+  };
+  std::cout << (config.get ? "GET" : "SET") << ": " << n << " requests in "
+            << elapsed.count() << " s, " << (size_t)(n / elapsed.count())
+            << " ops/sec" << std::endl;
+  std::cout << "latency us: p50=" << percentile(0.50)
+            << " p99=" << percentile(0.99) << " p99.9=" << percentile(0.999)
+            << " max=" << latencies.back() << std::endl;
+  std::cout << "redirects: " << redirects << ", errors: " << errors
+            << std::endl;
+  return errors == 0 ? 0 : 1;
+}
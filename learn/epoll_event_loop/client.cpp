@@ -1,43 +1,71 @@
-#include <cstring>
 #include <iostream>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
 
-#include <iostream>
+#include "client.h"
 
-int main() {
-  int fd = socket(AF_INET, SOCK_STREAM, 0); // SOCK_STREAM for TCP
-  if (fd < 0) {
-    std::cout << "Error creating socket" << std::endl;
-    return 1;
+namespace {
+
+void printValue(const Protocol::Value &value, const std::string &indent) {
+  switch (value.type) {
+  case SER_NIL:
+    std::cout << indent << "(nil)" << std::endl;
+    break;
+  case SER_ERR:
+    std::cout << indent << "(err) " << value.str << std::endl;
+    break;
+  case SER_STR:
+    std::cout << indent << value.str << std::endl;
+    break;
+  case SER_INT:
+    std::cout << indent << "(int) " << value.num << std::endl;
+    break;
+  case SER_ARR:
+  case SER_PUSH:
+    std::cout << indent << (value.type == SER_ARR ? "(arr)" : "(push)")
+              << " len=" << value.elems.size() << std::endl;
+    for (const auto &elem : value.elems) {
+      printValue(elem, indent + "  ");
+    }
+    break;
   }
+}
+
+} // namespace
 
-  sockaddr_in addr;
-  addr.sin_family = AF_INET;   // IPv4
-  addr.sin_port = ntohs(9001); // Port 8080
-  addr.sin_addr.s_addr = ntohl(0);
-  int rc = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
-  if (rc < 0) {
-    std::cout << "Error connecting to server " << rc << std::endl;
+int main(int argc, char **argv) {
+  std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+  int port = argc > 2 ? atoi(argv[2]) : 9001;
+  Client client;
+  if (!client.connect(host, port)) {
+    std::cout << "Error connecting to server" << std::endl;
     return 1;
   }
+  // Pushes received before a reply are printed first
+  client.setPushHandler(
+      [](const Protocol::Value &push) { printValue(push, ""); });
 
   while (true) {
-    char message[260];
     std::string inputString;
-    std::cout << "Enter a message: ";
-    std::getline(std::cin, inputString);
-    int size = inputString.length();
-    memcpy(&message[0], &size, 4);
-    memcpy(&message[4], inputString.c_str(), inputString.length());
+    std::cout << "Enter a command: ";
+    if (!std::getline(std::cin, inputString)) {
+      break;
+    }
+    std::vector<std::string> cmd;
+    std::istringstream words(inputString);
+    for (std::string word; words >> word;) {
+      cmd.push_back(word);
+    }
+    if (cmd.empty()) {
+      continue;
+    }
 
-    write(fd, message, sizeof(message));
-    char rbuf[260];
-    ssize_t n = read(fd, rbuf, sizeof(rbuf) - 1);
-    ssize_t len = 0;
-    memcpy(&len, &rbuf[0], 4);
-    printf("Server says: %.*s\n", (int)len, &rbuf[4]);
+    Protocol::Value reply;
+    if (!client.call(cmd, reply)) {
+      std::cout << "Error talking to server" << std::endl;
+      return 1;
+    }
+    printValue(reply, "");
   }
 }
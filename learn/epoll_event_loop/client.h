@@ -0,0 +1,703 @@
+#pragma once
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "protocol.h"
+
+// Connected socket with TCP_NODELAY, -1 on error
+inline int connectTcp(const std::string &host, int port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  const char *ip = host == "localhost" ? "127.0.0.1" : host.c_str();
+  if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (::connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+// Blocking client for the epoll server.
+//
+// call() sends one command and waits for its reply. Push frames, e.g.
+// pub/sub messages or cache invalidations, can arrive before any reply; they
+// are handed to the push handler as they are read. pollPushes() reads the
+// pushes already received without blocking.
+class Client {
+public:
+  using Args = std::vector<std::string>;
+  using PushHandler = std::function<void(const Protocol::Value &)>;
+
+  Client() = default;
+  ~Client() { disconnect(); }
+  Client(const Client &) = delete;
+  Client &operator=(const Client &) = delete;
+
+  bool connect(const std::string &host, int port) {
+    disconnect();
+    _fd = connectTcp(host, port);
+    return _fd >= 0;
+  }
+
+  void disconnect() {
+    if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+    }
+    _rbuf.clear();
+  }
+
+  bool connected() const { return _fd >= 0; }
+
+  void setPushHandler(PushHandler handler) { _onPush = std::move(handler); }
+
+  // Send `cmd` and wait for its reply, false if the connection failed
+  bool call(const Args &cmd, Protocol::Value &reply) {
+    std::string out;
+    Protocol::encodeRequest(cmd, out);
+    if (!writeAll(out.data(), out.size())) {
+      return false;
+    }
+    while (true) {
+      if (!readFrame(true, reply)) {
+        return false;
+      }
+      if (!reply.isPush()) {
+        return true;
+      }
+      if (_onPush) {
+        _onPush(reply);
+      }
+    }
+  }
+
+  // Handle the pushes received so far, false if the connection failed
+  bool pollPushes() {
+    Protocol::Value push;
+    while (readFrame(false, push)) {
+      if (_onPush) {
+        _onPush(push);
+      }
+    }
+    return connected();
+  }
+
+private:
+  bool writeAll(const char *buf, size_t n) {
+    while (n > 0) {
+      ssize_t rv = write(_fd, buf, n);
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        disconnect();
+        return false;
+      }
+      n -= (size_t)rv;
+      buf += rv;
+    }
+    return true;
+  }
+
+  // Decode the next frame, reading more if `block`. False if no complete
+  // frame is available or the connection failed.
+  bool readFrame(bool block, Protocol::Value &out) {
+    while (connected()) {
+      if (_rbuf.size() >= k_header_size) {
+        uint32_t len = Protocol::readU32(_rbuf.data());
+        if (len > k_max_msg) {
+          disconnect();
+          return false;
+        }
+        if (_rbuf.size() >= k_header_size + len) {
+          out = Protocol::Value();
+          size_t rv =
+              Protocol::decodeValue(&_rbuf[k_header_size], len, out);
+          _rbuf.erase(0, k_header_size + len);
+          if (rv != len) {
+            disconnect();
+            return false;
+          }
+          return true;
+        }
+      }
+      char buf[64 * 1024];
+      ssize_t rv = recv(_fd, buf, sizeof(buf), block ? 0 : MSG_DONTWAIT);
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return false;
+      }
+      if (rv <= 0) {
+        disconnect();
+        return false;
+      }
+      _rbuf.append(buf, (size_t)rv);
+    }
+    return false;
+  }
+
+private:
+  int _fd = -1;
+  std::string _rbuf;
+  PushHandler _onPush;
+};
+
+// Local cache of string values kept coherent by server side tracking.
+//
+// The client enables tracking on its connection, the server then pushes an
+// invalidation when a key it read changes. A hit is served from memory after
+// draining the pushes already received, with no round trip. Replies and
+// invalidations share the connection so an invalidation for a key can't be
+// overtaken by an older value of it. In broadcast mode only the keys under
+// the prefixes are cached. At most `capacity` keys are cached, least
+// recently used first out.
+class NearCache {
+public:
+  NearCache(Client &client, size_t capacity)
+      : _client(client), _capacity(capacity) {}
+
+  // Enable tracking, `prefixes` selects broadcast mode
+  bool enable(const std::vector<std::string> &prefixes = {}) {
+    _client.setPushHandler(
+        [this](const Protocol::Value &push) { onPush(push); });
+    Client::Args cmd = {"client", "tracking", "on"};
+    if (!prefixes.empty()) {
+      cmd.push_back("bcast");
+      for (const auto &prefix : prefixes) {
+        cmd.push_back("prefix");
+        cmd.push_back(prefix);
+      }
+    }
+    Protocol::Value reply;
+    if (!_client.call(cmd, reply) || reply.isErr()) {
+      return false;
+    }
+    _prefixes = prefixes;
+    return true;
+  }
+
+  // GET through the cache, false if the connection failed
+  bool get(const std::string &key, Protocol::Value &out) {
+    if (!_client.pollPushes()) {
+      clear();
+      return false;
+    }
+    auto it = _entries.find(key);
+    if (it != _entries.end()) {
+      ++_hits;
+      _lru.splice(_lru.begin(), _lru, it->second.lru);
+      out = it->second.value;
+      return true;
+    }
+    ++_misses;
+    if (!_client.call({"get", key}, out)) {
+      clear();
+      return false;
+    }
+    if (!out.isErr() && cacheable(key)) {
+      insert(key, out);
+    }
+    return true;
+  }
+
+  void clear() {
+    _entries.clear();
+    _lru.clear();
+  }
+
+  size_t size() const { return _entries.size(); }
+  uint64_t hits() const { return _hits; }
+  uint64_t misses() const { return _misses; }
+  uint64_t invalidations() const { return _invalidations; }
+
+private:
+  struct Entry {
+    Protocol::Value value;
+    std::list<std::string>::iterator lru;
+  };
+
+  bool cacheable(const std::string &key) const {
+    if (_prefixes.empty()) {
+      return true;
+    }
+    for (const auto &prefix : _prefixes) {
+      if (key.compare(0, prefix.size(), prefix) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void insert(const std::string &key, const Protocol::Value &value) {
+    if (_capacity == 0) {
+      return;
+    }
+    if (_entries.size() >= _capacity) {
+      _entries.erase(_lru.back());
+      _lru.pop_back();
+    }
+    _lru.push_front(key);
+    _entries[key] = Entry{value, _lru.begin()};
+  }
+
+  void erase(const std::string &key) {
+    auto it = _entries.find(key);
+    if (it != _entries.end()) {
+      _lru.erase(it->second.lru);
+      _entries.erase(it);
+    }
+  }
+
+  // [invalidate, [key...]] or [invalidate, nil]
+  void onPush(const Protocol::Value &push) {
+    if (push.elems.size() != 2 || push.elems[0].str != "invalidate") {
+      return;
+    }
+    ++_invalidations;
+    if (push.elems[1].type == SER_NIL) {
+      clear();
+      return;
+    }
+    for (const auto &key : push.elems[1].elems) {
+      erase(key.str);
+    }
+  }
+
+private:
+  Client &_client;
+  size_t _capacity;
+  // Broadcast mode prefixes, empty in the default mode
+  std::vector<std::string> _prefixes;
+  std::unordered_map<std::string, Entry> _entries;
+  std::list<std::string> _lru;
+  uint64_t _hits = 0;
+  uint64_t _misses = 0;
+  uint64_t _invalidations = 0;
+};
+
+// Client shared by any number of threads, without waiting for replies.
+//
+// send() queues the command and returns. Its callback runs with the reply on
+// the connection's I/O thread, so it must not block; it may send, the command
+// goes out with the others queued by the callbacks of the same read. The
+// commands queued while the I/O thread is busy go out in one write and their
+// replies are read in bulk: concurrent requests are pipelined without the
+// callers doing anything. On an idle connection the caller writes the command
+// itself rather than waking the I/O thread up. Replies come back in order, each
+// completes the oldest pending request. When the connection fails every pending
+// request completes with an error reply, and so do the requests sent until it's
+// reconnected.
+class AsyncClient {
+public:
+  using Args = std::vector<std::string>;
+  using Callback = std::function<void(Protocol::Value &)>;
+  using PushHandler = std::function<void(const Protocol::Value &)>;
+
+  AsyncClient() = default;
+  ~AsyncClient() { disconnect(); }
+  AsyncClient(const AsyncClient &) = delete;
+  AsyncClient &operator=(const AsyncClient &) = delete;
+
+  // Not to be called by two threads at once, other threads may be sending
+  bool connect(const std::string &host, int port) {
+    disconnect();
+    int fd = connectTcp(host, port);
+    if (fd < 0) {
+      return false;
+    }
+    int wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) {
+      close(fd);
+      return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    {
+      std::lock_guard<std::mutex> lock(_mu);
+      _fd = fd;
+      _wakeFd = wakeFd;
+      _open = true;
+      _stopping = false;
+      _ioWriting = false;
+    }
+    _thread = std::thread([this]() { run(); });
+    return true;
+  }
+
+  void disconnect() {
+    if (!_thread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_mu);
+      _stopping = true;
+      wakeUp();
+    }
+    _thread.join();
+    std::lock_guard<std::mutex> lock(_mu);
+    close(_fd);
+    close(_wakeFd);
+    _fd = _wakeFd = -1;
+  }
+
+  bool connected() const {
+    std::lock_guard<std::mutex> lock(_mu);
+    return _open;
+  }
+
+  // Called on the I/O thread, set it before connect()
+  void setPushHandler(PushHandler handler) { _onPush = std::move(handler); }
+
+  void send(const Args &cmd, Callback cb) {
+    std::unique_lock<std::mutex> lock(_mu);
+    if (!_open) {
+      lock.unlock();
+      Protocol::Value err = errorValue("connection closed");
+      cb(err);
+      return;
+    }
+    bool idle = _out.empty() && _pending.empty() && !_ioWriting;
+    Protocol::encodeRequest(cmd, _out);
+    _pending.push_back(std::move(cb));
+    if (t_ioClient == this) {
+      // From a callback, written once the replies read are handled
+      return;
+    }
+    if (idle && writeOut()) {
+      // The I/O thread polls for the reply
+      return;
+    }
+    // The I/O thread takes everything queued when it wakes up
+    if (!_wakePending) {
+      _wakePending = true;
+      wakeUp();
+    }
+  }
+
+  std::future<Protocol::Value> send(const Args &cmd) {
+    auto promise = std::make_shared<std::promise<Protocol::Value>>();
+    std::future<Protocol::Value> future = promise->get_future();
+    send(cmd, [promise](Protocol::Value &reply) {
+      promise->set_value(std::move(reply));
+    });
+    return future;
+  }
+
+  // The reply is an array with the values, nil for a missing key
+  void mget(const std::vector<std::string> &keys, Callback cb) {
+    Args cmd{"mget"};
+    cmd.insert(cmd.end(), keys.begin(), keys.end());
+    send(cmd, std::move(cb));
+  }
+
+  void mset(const std::vector<std::pair<std::string, std::string>> &pairs,
+            Callback cb) {
+    Args cmd{"mset"};
+    for (const auto &[key, value] : pairs) {
+      cmd.push_back(key);
+      cmd.push_back(value);
+    }
+    send(cmd, std::move(cb));
+  }
+
+  std::future<Protocol::Value> mget(const std::vector<std::string> &keys) {
+    auto promise = std::make_shared<std::promise<Protocol::Value>>();
+    std::future<Protocol::Value> future = promise->get_future();
+    mget(keys, [promise](Protocol::Value &reply) {
+      promise->set_value(std::move(reply));
+    });
+    return future;
+  }
+
+  std::future<Protocol::Value>
+  mset(const std::vector<std::pair<std::string, std::string>> &pairs) {
+    auto promise = std::make_shared<std::promise<Protocol::Value>>();
+    std::future<Protocol::Value> future = promise->get_future();
+    mset(pairs, [promise](Protocol::Value &reply) {
+      promise->set_value(std::move(reply));
+    });
+    return future;
+  }
+
+private:
+  static Protocol::Value errorValue(const std::string &msg) {
+    Protocol::Value err;
+    err.type = SER_ERR;
+    err.str = msg;
+    return err;
+  }
+
+  // With _mu held and nothing written before _out: write what the socket
+  // takes without blocking, true if it took everything. A failure is left to
+  // the I/O thread.
+  bool writeOut() {
+    size_t sent = 0;
+    while (sent < _out.size()) {
+      ssize_t rv = ::send(_fd, _out.data() + sent, _out.size() - sent,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        break;
+      }
+      sent += (size_t)rv;
+    }
+    _out.erase(0, sent);
+    return _out.empty();
+  }
+
+  // With _mu held, the fds are closed under it
+  void wakeUp() {
+    uint64_t one = 1;
+    ssize_t rv = write(_wakeFd, &one, sizeof(one));
+    (void)rv;
+  }
+
+  void run() {
+    t_ioClient = this;
+    std::string wbuf;
+    size_t wbufSent = 0;
+    std::string rbuf;
+    std::vector<Protocol::Value> replies;
+    std::vector<Callback> completed;
+    std::string error;
+    while (error.empty()) {
+      {
+        std::lock_guard<std::mutex> lock(_mu);
+        if (_stopping) {
+          error = "connection closed";
+          break;
+        }
+        if (wbuf.empty()) {
+          wbuf.swap(_out);
+        } else {
+          wbuf.append(_out);
+        }
+        _out.clear();
+        _wakePending = false;
+        // Senders queue behind it until it's written
+        _ioWriting = !wbuf.empty();
+      }
+
+      // Write before polling, the socket is usually writable
+      while (wbufSent < wbuf.size()) {
+        ssize_t rv = ::send(_fd, wbuf.data() + wbufSent,
+                            wbuf.size() - wbufSent, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR) {
+          continue;
+        }
+        if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          break;
+        }
+        if (rv <= 0) {
+          error = "connection lost";
+          break;
+        }
+        wbufSent += (size_t)rv;
+      }
+      if (!error.empty()) {
+        break;
+      }
+      if (_ioWriting && wbufSent == wbuf.size()) {
+        wbuf.clear();
+        wbufSent = 0;
+        std::lock_guard<std::mutex> lock(_mu);
+        _ioWriting = false;
+        if (!_out.empty()) {
+          // Queued while we wrote
+          continue;
+        }
+      }
+
+      pollfd fds[2] = {
+          {_fd, (short)(POLLIN | (wbuf.empty() ? 0 : POLLOUT)), 0},
+          {_wakeFd, POLLIN, 0},
+      };
+      if (poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) {
+          error = "connection lost";
+        }
+        continue;
+      }
+      if (fds[1].revents & POLLIN) {
+        uint64_t n = 0;
+        ssize_t rv = read(_wakeFd, &n, sizeof(n));
+        (void)rv;
+      }
+      if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP))) {
+        continue;
+      }
+
+      char buf[64 * 1024];
+      ssize_t rv = recv(_fd, buf, sizeof(buf), 0);
+      if (rv < 0 && (errno == EINTR || errno == EAGAIN)) {
+        continue;
+      }
+      if (rv <= 0) {
+        error = "connection lost";
+        break;
+      }
+      rbuf.append(buf, (size_t)rv);
+      size_t pos = 0;
+      while (rbuf.size() - pos >= k_header_size) {
+        uint32_t len = Protocol::readU32(&rbuf[pos]);
+        if (len > k_max_msg) {
+          error = "reply too large";
+          break;
+        }
+        if (rbuf.size() - pos < k_header_size + len) {
+          break;
+        }
+        Protocol::Value value;
+        if (Protocol::decodeValue(&rbuf[pos + k_header_size], len, value) !=
+            len) {
+          error = "malformed reply";
+          break;
+        }
+        pos += k_header_size + len;
+        if (value.isPush()) {
+          if (_onPush) {
+            _onPush(value);
+          }
+        } else {
+          replies.push_back(std::move(value));
+        }
+      }
+      rbuf.erase(0, pos);
+
+      // One lock for all the replies of the read
+      {
+        std::lock_guard<std::mutex> lock(_mu);
+        if (replies.size() > _pending.size()) {
+          error = "unexpected reply";
+          replies.resize(_pending.size());
+        }
+        for (size_t i = 0; i < replies.size(); ++i) {
+          completed.push_back(std::move(_pending.front()));
+          _pending.pop_front();
+        }
+      }
+      for (size_t i = 0; i < replies.size(); ++i) {
+        completed[i](replies[i]);
+      }
+      replies.clear();
+      completed.clear();
+    }
+
+    std::deque<Callback> pending;
+    {
+      std::lock_guard<std::mutex> lock(_mu);
+      _open = false;
+      _out.clear();
+      pending.swap(_pending);
+    }
+    for (auto &cb : pending) {
+      Protocol::Value err = errorValue(error);
+      cb(err);
+    }
+  }
+
+private:
+  // Only changed by connect() and disconnect() while no I/O thread runs
+  int _fd = -1;
+  int _wakeFd = -1;
+  std::thread _thread;
+  PushHandler _onPush;
+
+  mutable std::mutex _mu;
+  bool _open = false;
+  bool _stopping = false;
+  // Encoded requests not yet taken by the I/O thread
+  std::string _out;
+  bool _wakePending = false;
+  // The I/O thread has output to write, it must go out before _out
+  bool _ioWriting = false;
+
+  // The client whose I/O thread this is, if any
+  static inline thread_local const AsyncClient *t_ioClient = nullptr;
+  // Callbacks of the requests sent, oldest first
+  std::deque<Callback> _pending;
+};
+
+// Connections shared by the threads of an application.
+//
+// Each thread is given one of the connections on its first call, round
+// robin, and keeps it: the requests of a thread stay in order, and are
+// pipelined with those of the other threads on the same connection. A
+// connection that failed is reopened by the next get().
+class ClientPool {
+public:
+  ClientPool(const std::string &host, int port, size_t size)
+      : _host(host), _port(port), _size(std::max<size_t>(size, 1)),
+        _clients(std::make_unique<AsyncClient[]>(_size)),
+        _locks(std::make_unique<std::mutex[]>(_size)) {}
+
+  // The connection of the calling thread, nullptr if it can't be opened
+  AsyncClient *get() {
+    thread_local std::unordered_map<uint64_t, size_t> assigned;
+    auto it = assigned.find(_id);
+    if (it == assigned.end()) {
+      it = assigned.emplace(_id, _next++ % _size).first;
+    }
+    size_t i = it->second;
+    std::lock_guard<std::mutex> lock(_locks[i]);
+    if (!_clients[i].connected() && !_clients[i].connect(_host, _port)) {
+      return nullptr;
+    }
+    return &_clients[i];
+  }
+
+  size_t size() const { return _size; }
+
+private:
+  // Ids rather than addresses identify pools in the threads' maps, a new
+  // pool may reuse the address of a destroyed one
+  static uint64_t nextId() {
+    static std::atomic<uint64_t> id{0};
+    return ++id;
+  }
+
+private:
+  std::string _host;
+  int _port;
+  size_t _size;
+  std::unique_ptr<AsyncClient[]> _clients;
+  // Serialize reconnections of each connection
+  std::unique_ptr<std::mutex[]> _locks;
+  std::atomic<size_t> _next{0};
+  uint64_t _id = nextId();
+};
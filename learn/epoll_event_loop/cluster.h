@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Hash slots shared by the server and the cluster-aware clients.
+//
+// The keyspace is split in k_cluster_slots slots, a key belongs to slot
+// CRC16(key) mod k_cluster_slots. If the key contains a non-empty "{...}"
+// section only that part is hashed, so related keys can be forced into the
+// same slot.
+
+constexpr int k_cluster_slots = 16384;
+
+namespace Cluster {
+
+// CRC16-CCITT (XMODEM), polynomial 0x1021
+constexpr std::array<uint16_t, 256> makeCrc16Table() {
+  std::array<uint16_t, 256> table{};
+  for (int i = 0; i < 256; ++i) {
+    uint16_t crc = (uint16_t)(i << 8);
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021)
+                           : (uint16_t)(crc << 1);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+inline uint16_t crc16(const char *data, size_t size) {
+  static constexpr std::array<uint16_t, 256> k_table = makeCrc16Table();
+  uint16_t crc = 0;
+  for (size_t i = 0; i < size; ++i) {
+    crc = (uint16_t)((crc << 8) ^ k_table[((crc >> 8) ^ (uint8_t)data[i])]);
+  }
+  return crc;
+}
+
+inline int keyHashSlot(const std::string &key) {
+  size_t start = key.find('{');
+  if (start != std::string::npos) {
+    size_t end = key.find('}', start + 1);
+    if (end != std::string::npos && end != start + 1) {
+      return crc16(&key[start + 1], end - start - 1) & (k_cluster_slots - 1);
+    }
+  }
+  return crc16(key.data(), key.size()) & (k_cluster_slots - 1);
+}
+
+} // namespace Cluster
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <coroutine>
+#include <cassert>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Minimal coroutines for the event loop.
+//
+// A Task is a coroutine started suspended and resumed by its owner, which
+// destroys it once done or while it's suspended. A coroutine waits by
+// awaiting Suspend{slot}: its handle is stored in `slot` and the event loop
+// resumes it from there. Nothing is scheduled behind the loop's back, so a
+// task only runs when resumed and until its next suspension.
+//
+// A task may also be awaited by another one: `co_await task` runs it until
+// its first suspension, and the awaiting task goes on once it ends. Steps
+// of a request can so wait on their own, e.g. for values read from disk,
+// and the loop resumes the innermost one.
+//
+// Frames come from a pool per thread instead of the heap: a connection's
+// frame is allocated when it's accepted and reused by the next one. A task
+// must be destroyed on the thread that created it, reset() checks.
+namespace Coro {
+
+// Free lists of blocks by size class, refilled a chunk at a time. Not
+// thread-safe, each thread has its own (local()).
+class FramePool {
+public:
+  static constexpr size_t k_granularity = 64;
+  static constexpr size_t k_max_size = 4096;
+  static constexpr size_t k_blocks_per_chunk = 32;
+
+  ~FramePool() {
+    for (char *chunk : _chunks) {
+      ::operator delete(chunk);
+    }
+  }
+
+  static FramePool &local() {
+    thread_local FramePool pool;
+    return pool;
+  }
+
+  void *allocate(size_t size) {
+    if (size > k_max_size) {
+      return ::operator new(size);
+    }
+    size_t c = sizeClass(size);
+    if (!_free[c]) {
+      refill(c);
+    }
+    Block *block = _free[c];
+    _free[c] = block->next;
+    return block;
+  }
+
+  void deallocate(void *p, size_t size) {
+    if (size > k_max_size) {
+      ::operator delete(p);
+      return;
+    }
+    size_t c = sizeClass(size);
+    Block *block = static_cast<Block *>(p);
+    block->next = _free[c];
+    _free[c] = block;
+  }
+
+  // Bytes taken from the heap
+  size_t reserved() const { return _reserved; }
+
+private:
+  struct Block {
+    Block *next;
+  };
+  static constexpr size_t k_classes = k_max_size / k_granularity;
+
+  static size_t sizeClass(size_t size) {
+    return (size + k_granularity - 1) / k_granularity - 1;
+  }
+
+  void refill(size_t c) {
+    size_t blockSize = (c + 1) * k_granularity;
+    char *chunk =
+        static_cast<char *>(::operator new(blockSize * k_blocks_per_chunk));
+    _chunks.push_back(chunk);
+    _reserved += blockSize * k_blocks_per_chunk;
+    for (size_t i = k_blocks_per_chunk; i-- > 0;) {
+      Block *block = reinterpret_cast<Block *>(chunk + i * blockSize);
+      block->next = _free[c];
+      _free[c] = block;
+    }
+  }
+
+  Block *_free[k_classes] = {};
+  std::vector<char *> _chunks;
+  size_t _reserved = 0;
+};
+
+class Task {
+public:
+  struct promise_type {
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    // Kept until the owner destroys it, done() tells it ended. The task
+    // awaiting it, if any, goes on.
+    auto final_suspend() noexcept {
+      struct Final {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+          std::coroutine_handle<> next = handle.promise().continuation;
+          return next ? next : std::noop_coroutine();
+        }
+        void await_resume() const noexcept {}
+      };
+      return Final{};
+    }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    // Task awaiting this one
+    std::coroutine_handle<> continuation;
+
+    static void *operator new(size_t size) {
+      return FramePool::local().allocate(size);
+    }
+    static void operator delete(void *p, size_t size) {
+      FramePool::local().deallocate(p, size);
+    }
+  };
+
+  Task() = default;
+  Task(Task &&other) noexcept
+      : _handle(std::exchange(other._handle, nullptr)), _pool(other._pool) {}
+  Task &operator=(Task &&other) noexcept {
+    if (this != &other) {
+      reset();
+      _handle = std::exchange(other._handle, nullptr);
+      _pool = other._pool;
+    }
+    return *this;
+  }
+  Task(const Task &) = delete;
+  Task &operator=(const Task &) = delete;
+  ~Task() { reset(); }
+
+  std::coroutine_handle<> handle() const { return _handle; }
+  // Start the task, the caller is resumed once it ends
+  auto operator co_await() noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+
+      bool await_ready() const noexcept { return handle.done(); }
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+      }
+      void await_resume() const noexcept {}
+    };
+    return Awaiter{_handle};
+  }
+  bool done() const { return !_handle || _handle.done(); }
+  // Must not be running
+  void reset() {
+    if (_handle) {
+      // The frame goes back to this thread's pool
+      assert(_pool == &FramePool::local() && "task destroyed off its thread");
+      std::exchange(_handle, nullptr).destroy();
+    }
+  }
+
+private:
+  explicit Task(std::coroutine_handle<promise_type> handle)
+      : _handle(handle), _pool(&FramePool::local()) {}
+
+  std::coroutine_handle<promise_type> _handle;
+  // Pool the frame came from
+  FramePool *_pool = nullptr;
+};
+
+// Suspend, leaving the handle to resume in `slot`
+struct Suspend {
+  std::coroutine_handle<> &slot;
+
+  bool await_ready() const noexcept { return false; }
+  void await_suspend(std::coroutine_handle<> handle) noexcept {
+    slot = handle;
+  }
+  void await_resume() const noexcept {}
+};
+
+} // namespace Coro
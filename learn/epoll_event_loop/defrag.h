@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <malloc.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+
+// Picks the allocations worth moving during a defragmentation pass.
+//
+// malloc can't tell how full the page of an allocation is, so a pass first
+// takes a census: every allocation it will visit is counted, in usable
+// bytes, against its page. The pass then visits them again and moves those
+// on pages less than `sparseRatio` used. A copy is kept if it landed on a
+// page that isn't sparse, or on one the census found empty: the pass fills
+// such pages.
+//
+// The holes malloc hands back first are mostly on other sparse pages, so
+// early copies are often not kept and the caller makes another while
+// retry() agrees. A copy not kept must stay allocated, or the next
+// allocation of that size gets the same hole back: such copies are
+// disposed of and only freed by release(), once the moves are over. They
+// take no new memory, only holes. The copies then use up the holes and go
+// on to fresh pages, which they fill one after the other. The allocations
+// given up on meanwhile are moved by another walk. The originals moved are
+// freed at flush(), after each step, not during it for the same reason.
+//
+// Allocations of a page or more are left alone, they mostly own their
+// pages. Counts go stale as the keyspace changes during the pass, which
+// only makes a move less useful.
+class Defragmenter {
+public:
+  explicit Defragmenter(double sparseRatio)
+      : _pageSize((size_t)sysconf(_SC_PAGESIZE)),
+        _sparseBytes((size_t)((double)_pageSize * sparseRatio)) {}
+  Defragmenter(const Defragmenter &) = delete;
+  Defragmenter &operator=(const Defragmenter &) = delete;
+
+  // Start a pass, with the census, over a heap of `heapBytes`. The counts
+  // are sized for it, growing them would stall a step.
+  void start(size_t heapBytes) {
+    _pages.reserve(2 * heapBytes / _pageSize);
+    _census = true;
+  }
+  // After a walk over the allocations, whether to walk them again: once
+  // the census is taken, then while some were given up on
+  bool nextWalk() {
+    if (_census) {
+      _census = false;
+      _walks = 0;
+    } else if (_unmoved == 0 || ++_walks >= k_max_walks) {
+      return false;
+    }
+    _unmoved = 0;
+    return true;
+  }
+
+  // Whether the allocation at `p` should be moved. During the census it's
+  // counted instead, and isn't.
+  bool shouldMove(const void *p) {
+    _copies = 0;
+    size_t size = malloc_usable_size(const_cast<void *>(p));
+    if (size >= _pageSize) {
+      return false;
+    }
+    if (_census) {
+      _pages[page(p)].bytes += size;
+      return false;
+    }
+    auto it = _pages.find(page(p));
+    return it != _pages.end() && !it->second.filling &&
+           it->second.bytes < _sparseBytes;
+  }
+
+  // Whether the copy at `to` of the allocation at `from` is kept, the
+  // counts follow it if so. All the pages of the copy must receive it: one
+  // reaching into a sparse page would keep that page from being freed.
+  bool keep(const void *from, const void *to) {
+    size_t size = malloc_usable_size(const_cast<void *>(to));
+    uintptr_t first = page(to);
+    uintptr_t last = page((const char *)to + size - 1);
+    Page *dst = receiving(first);
+    if (first == page(from) || !dst || (last != first && !receiving(last))) {
+      ++_rejected;
+      _reject = to;
+      return false;
+    }
+    Page &src = _pages[page(from)];
+    src.bytes -= std::min(src.bytes,
+                          malloc_usable_size(const_cast<void *>(from)));
+    dst->bytes += size;
+    ++_moved;
+    return true;
+  }
+
+  // Whether to make another copy after keep() turned one down
+  bool retry() {
+    if (++_copies < k_max_copies) {
+      return true;
+    }
+    ++_unmoved;
+    return false;
+  }
+
+  // Free `p`, an original moved or the copy keep() just turned down, at
+  // flush() or after finish()
+  template <typename T> void dispose(std::unique_ptr<T> p) {
+    binFor(p.get()).add(std::move(p));
+  }
+  void dispose(std::string s) { binFor(s.data()).add(std::move(s)); }
+  // Free the originals moved by the step, after each step
+  void flush() { _originals.release(SIZE_MAX); }
+  // Once the moves are over, free up to `n` of the copies not kept, then
+  // drop the counts. True when all is freed and the pass is over.
+  bool release(size_t n) {
+    if (!_rejects.release(n)) {
+      return false;
+    }
+    for (auto it = _pages.begin(); it != _pages.end() && n > 0; --n) {
+      it = _pages.erase(it);
+    }
+    return _pages.empty();
+  }
+
+  uint64_t moved() const { return _moved; }
+  uint64_t rejected() const { return _rejected; }
+
+private:
+  // Copies made for one allocation at most
+  static constexpr int k_max_copies = 32;
+  // Walks for the moves
+  static constexpr int k_max_walks = 4;
+
+  // Allocations waiting to be freed
+  class Disposed {
+  public:
+    Disposed() = default;
+    Disposed(const Disposed &) = delete;
+    Disposed &operator=(const Disposed &) = delete;
+    ~Disposed() { release(SIZE_MAX); }
+
+    template <typename T> void add(std::unique_ptr<T> p) {
+      _ptrs.push_back({p.release(), [](void *q) { delete (T *)q; }});
+    }
+    void add(std::string s) { _strings.push_back(std::move(s)); }
+    // Free up to `n` of them, true when none is left
+    bool release(size_t n) {
+      for (; n > 0 && !_ptrs.empty(); --n) {
+        _ptrs.back().second(_ptrs.back().first);
+        _ptrs.pop_back();
+      }
+      for (; n > 0 && !_strings.empty(); --n) {
+        _strings.pop_back();
+      }
+      return _ptrs.empty() && _strings.empty();
+    }
+
+  private:
+    // Each with its deleter. Deques grow without moving what they hold.
+    std::deque<std::pair<void *, void (*)(void *)>> _ptrs;
+    std::deque<std::string> _strings;
+  };
+
+  struct Page {
+    // Of the allocations counted on the page
+    size_t bytes = 0;
+    // Receiving copies
+    bool filling = false;
+  };
+  using PageMap = std::unordered_map<uintptr_t, Page>;
+
+  uintptr_t page(const void *p) const { return (uintptr_t)p / _pageSize; }
+  // The page if copies may go there: one the census found empty, which is
+  // filled from then on, or one that isn't sparse
+  Page *receiving(uintptr_t p) {
+    auto it = _pages.find(p);
+    if (it == _pages.end()) {
+      Page &fresh = _pages[p];
+      fresh.filling = true;
+      return &fresh;
+    }
+    Page &counted = it->second;
+    return counted.filling || counted.bytes >= _sparseBytes ? &counted
+                                                             : nullptr;
+  }
+  Disposed &binFor(const void *p) {
+    if (p == _reject) {
+      _reject = nullptr;
+      return _rejects;
+    }
+    return _originals;
+  }
+
+  size_t _pageSize;
+  size_t _sparseBytes;
+  bool _census = false;
+  PageMap _pages;
+  Disposed _originals;
+  Disposed _rejects;
+  // The copy last turned down by keep()
+  const void *_reject = nullptr;
+  int _copies = 0;
+  uint64_t _unmoved = 0;
+  int _walks = 0;
+  uint64_t _moved = 0;
+  uint64_t _rejected = 0;
+};
+
+// Move a string to a new allocation of just its size if `defrag` agrees
+inline void defragString(Defragmenter &defrag, std::string &s) {
+  if (s.capacity() <= std::string().capacity() ||
+      !defrag.shouldMove(s.data())) {
+    return;
+  }
+  bool kept = false;
+  do {
+    std::string copy(s);
+    kept = defrag.keep(s.data(), copy.data());
+    if (kept) {
+      s.swap(copy);
+    }
+    defrag.dispose(std::move(copy));
+  } while (!kept && defrag.retry());
+}
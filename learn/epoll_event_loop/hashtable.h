@@ -0,0 +1,402 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <malloc.h>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Chained hash table with power of two buckets and incremental rehashing.
+//
+// Growing or shrinking allocates a second table and every following
+// operation moves a few buckets over, so no single call pays for the whole
+// rehash. While rehashing, lookups check both tables.
+//
+// scan() iterates with a stateless cursor by incrementing the reversed bits
+// of the bucket index. A bucket of a table of size 2^n maps to the buckets
+// sharing its low n bits in any other power of two table, so with this order
+// every entry present during the whole scan is returned at least once even
+// when the table is resized between calls.
+//
+// defrag() walks the buckets in the same order and moves entries to newly
+// allocated nodes, so a long lived table doesn't pin sparsely used
+// allocator pages. The links to a moved node are fixed up in place.
+template <typename K, typename V, typename Hash = std::hash<K>> class Dict {
+public:
+  Dict() = default;
+  ~Dict() { clear(); }
+  Dict(const Dict &) = delete;
+  Dict &operator=(const Dict &) = delete;
+  Dict(Dict &&other) noexcept { swap(other); }
+  Dict &operator=(Dict &&other) noexcept {
+    if (this != &other) {
+      clear();
+      swap(other);
+    }
+    return *this;
+  }
+
+  size_t size() const { return _ht[0].size + _ht[1].size; }
+  bool empty() const { return size() == 0; }
+  bool isRehashing() const { return _rehashIdx >= 0; }
+  // Number of buckets, both tables while rehashing
+  size_t buckets() const { return _ht[0].slots.size() + _ht[1].slots.size(); }
+  // Usable bytes of the buckets and the nodes, without what the keys and
+  // values allocate themselves
+  size_t allocatedBytes() const;
+
+  V *find(const K &key);
+  // Return the value of `key`, inserting a default constructed one if it
+  // doesn't exist. The flag tells whether it was inserted.
+  std::pair<V *, bool> findOrInsert(const K &key);
+  // Remove `key`, moving its value to `out` if not null
+  bool erase(const K &key, V *out = nullptr);
+  void clear();
+  void swap(Dict &other) noexcept;
+
+  // Visit the buckets at `cursor`, calling fn(key, value) for each entry.
+  // Return the next cursor, 0 when the iteration is complete.
+  template <typename F> uint64_t scan(uint64_t cursor, F &&fn);
+  template <typename F> void forEach(F &&fn);
+  // Like scan(), but first moves the node of each entry to a new one, with
+  // a copy of its key, if policy.shouldMove(node) and then
+  // policy.keep(node, copy), making copies while policy.retry(). The nodes
+  // left over, the original or the copies, go to policy.dispose(). See
+  // Defragmenter. Pointers to the values of these buckets are invalidated.
+  template <typename P, typename F>
+  uint64_t defrag(uint64_t cursor, P &policy, F &&fn);
+
+  // Move up to `n` buckets to the new table, return false when done
+  bool rehashStep(size_t n);
+
+private:
+  struct Node {
+    K key;
+    V value;
+    size_t hcode;
+    Node *next;
+  };
+  struct Table {
+    std::vector<Node *> slots;
+    size_t mask = 0;
+    size_t size = 0;
+  };
+
+  static constexpr size_t k_initial_size = 4;
+  // Empty buckets visited per rehash step before giving up
+  static constexpr size_t k_max_empty_visits = 10;
+
+  Node **lookup(const K &key, size_t hcode, size_t *table = nullptr);
+  // The cursor iteration of scan(), calling visit(head) on each bucket
+  template <typename F> uint64_t scanBuckets(uint64_t cursor, F &&visit);
+  void expandIfNeeded();
+  void shrinkIfNeeded();
+  void resize(size_t size);
+  static void freeTable(Table &table);
+  static uint64_t reverseBits(uint64_t v);
+
+private:
+  Table _ht[2];
+  // Next bucket of _ht[0] to move, -1 if not rehashing
+  long _rehashIdx = -1;
+  Hash _hasher;
+};
+
+template <typename K, typename V, typename Hash>
+V *Dict<K, V, Hash>::find(const K &key) {
+  if (empty()) {
+    return nullptr;
+  }
+  if (isRehashing()) {
+    rehashStep(1);
+  }
+  Node **from = lookup(key, _hasher(key));
+  return from ? &(*from)->value : nullptr;
+}
+
+template <typename K, typename V, typename Hash>
+std::pair<V *, bool> Dict<K, V, Hash>::findOrInsert(const K &key) {
+  if (isRehashing()) {
+    rehashStep(1);
+  }
+  size_t hcode = _hasher(key);
+  if (Node **from = lookup(key, hcode)) {
+    return {&(*from)->value, false};
+  }
+  expandIfNeeded();
+  // New entries always go to the new table while rehashing
+  Table &table = isRehashing() ? _ht[1] : _ht[0];
+  Node *node = new Node{key, V(), hcode, nullptr};
+  Node *&slot = table.slots[hcode & table.mask];
+  node->next = slot;
+  slot = node;
+  ++table.size;
+  return {&node->value, true};
+}
+
+template <typename K, typename V, typename Hash>
+bool Dict<K, V, Hash>::erase(const K &key, V *out) {
+  if (empty()) {
+    return false;
+  }
+  if (isRehashing()) {
+    rehashStep(1);
+  }
+  size_t table = 0;
+  Node **from = lookup(key, _hasher(key), &table);
+  if (!from) {
+    return false;
+  }
+  Node *node = *from;
+  *from = node->next;
+  --_ht[table].size;
+  if (out) {
+    *out = std::move(node->value);
+  }
+  delete node;
+  shrinkIfNeeded();
+  return true;
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::clear() {
+  freeTable(_ht[0]);
+  freeTable(_ht[1]);
+  _rehashIdx = -1;
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::swap(Dict &other) noexcept {
+  std::swap(_ht[0].slots, other._ht[0].slots);
+  std::swap(_ht[0].mask, other._ht[0].mask);
+  std::swap(_ht[0].size, other._ht[0].size);
+  std::swap(_ht[1].slots, other._ht[1].slots);
+  std::swap(_ht[1].mask, other._ht[1].mask);
+  std::swap(_ht[1].size, other._ht[1].size);
+  std::swap(_rehashIdx, other._rehashIdx);
+}
+
+template <typename K, typename V, typename Hash>
+size_t Dict<K, V, Hash>::allocatedBytes() const {
+  // The nodes all take the same size class, malloc is asked once
+  static const size_t nodeBytes = [] {
+    auto node = std::make_unique<Node>();
+    return malloc_usable_size(node.get());
+  }();
+  size_t bytes = size() * nodeBytes;
+  for (const Table &table : _ht) {
+    if (!table.slots.empty()) {
+      bytes += malloc_usable_size(const_cast<Node **>(table.slots.data()));
+    }
+  }
+  return bytes;
+}
+
+template <typename K, typename V, typename Hash>
+template <typename F>
+uint64_t Dict<K, V, Hash>::scan(uint64_t cursor, F &&fn) {
+  return scanBuckets(cursor, [&fn](Node *node) {
+    for (; node; node = node->next) {
+      fn(node->key, node->value);
+    }
+  });
+}
+
+template <typename K, typename V, typename Hash>
+template <typename P, typename F>
+uint64_t Dict<K, V, Hash>::defrag(uint64_t cursor, P &policy, F &&fn) {
+  return scanBuckets(cursor, [&](Node *&head) {
+    for (Node **link = &head; *link; link = &(*link)->next) {
+      Node *old = *link;
+      if (policy.shouldMove(old)) {
+        bool kept = false;
+        do {
+          auto node = std::make_unique<Node>(
+              Node{K(old->key), std::move(old->value), old->hcode, old->next});
+          kept = policy.keep(old, node.get());
+          if (kept) {
+            *link = node.release();
+            node.reset(old);
+          } else {
+            old->value = std::move(node->value);
+          }
+          policy.dispose(std::move(node));
+        } while (!kept && policy.retry());
+      }
+      fn((*link)->key, (*link)->value);
+    }
+  });
+}
+
+template <typename K, typename V, typename Hash>
+template <typename F>
+uint64_t Dict<K, V, Hash>::scanBuckets(uint64_t cursor, F &&visit) {
+  if (empty()) {
+    return 0;
+  }
+  if (!isRehashing()) {
+    Table &t0 = _ht[0];
+    uint64_t m0 = t0.mask;
+    visit(t0.slots[cursor & m0]);
+    // Increment the reversed cursor
+    cursor |= ~m0;
+    cursor = reverseBits(cursor);
+    ++cursor;
+    return reverseBits(cursor);
+  }
+
+  // Visit the bucket of the smaller table, then all the buckets of the
+  // larger table it expands to
+  Table *t0 = &_ht[0];
+  Table *t1 = &_ht[1];
+  if (t0->slots.size() > t1->slots.size()) {
+    std::swap(t0, t1);
+  }
+  uint64_t m0 = t0->mask;
+  uint64_t m1 = t1->mask;
+  visit(t0->slots[cursor & m0]);
+  do {
+    visit(t1->slots[cursor & m1]);
+    cursor |= ~m1;
+    cursor = reverseBits(cursor);
+    ++cursor;
+    cursor = reverseBits(cursor);
+  } while (cursor & (m0 ^ m1));
+  return cursor;
+}
+
+template <typename K, typename V, typename Hash>
+template <typename F>
+void Dict<K, V, Hash>::forEach(F &&fn) {
+  for (Table &table : _ht) {
+    for (Node *node : table.slots) {
+      for (; node; node = node->next) {
+        fn(node->key, node->value);
+      }
+    }
+  }
+}
+
+template <typename K, typename V, typename Hash>
+bool Dict<K, V, Hash>::rehashStep(size_t n) {
+  if (!isRehashing()) {
+    return false;
+  }
+  size_t emptyVisits = n * k_max_empty_visits;
+  while (n-- && _ht[0].size > 0) {
+    while (_ht[0].slots[_rehashIdx] == nullptr) {
+      ++_rehashIdx;
+      if (--emptyVisits == 0) {
+        return true;
+      }
+    }
+    Node *node = _ht[0].slots[_rehashIdx];
+    while (node) {
+      Node *next = node->next;
+      Node *&slot = _ht[1].slots[node->hcode & _ht[1].mask];
+      node->next = slot;
+      slot = node;
+      --_ht[0].size;
+      ++_ht[1].size;
+      node = next;
+    }
+    _ht[0].slots[_rehashIdx] = nullptr;
+    ++_rehashIdx;
+  }
+  if (_ht[0].size > 0) {
+    return true;
+  }
+  // Done, the new table becomes the main one
+  _ht[0].slots.swap(_ht[1].slots);
+  _ht[0].mask = _ht[1].mask;
+  _ht[0].size = _ht[1].size;
+  _ht[1] = Table();
+  _rehashIdx = -1;
+  return false;
+}
+
+template <typename K, typename V, typename Hash>
+typename Dict<K, V, Hash>::Node **
+Dict<K, V, Hash>::lookup(const K &key, size_t hcode, size_t *table) {
+  for (size_t i = 0; i < 2; ++i) {
+    if (_ht[i].slots.empty()) {
+      continue;
+    }
+    for (Node **from = &_ht[i].slots[hcode & _ht[i].mask]; *from;
+         from = &(*from)->next) {
+      if ((*from)->hcode == hcode && (*from)->key == key) {
+        if (table) {
+          *table = i;
+        }
+        return from;
+      }
+    }
+    if (!isRehashing()) {
+      break;
+    }
+  }
+  return nullptr;
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::expandIfNeeded() {
+  if (isRehashing()) {
+    return;
+  }
+  if (_ht[0].slots.empty()) {
+    _ht[0].slots.assign(k_initial_size, nullptr);
+    _ht[0].mask = k_initial_size - 1;
+    return;
+  }
+  if (_ht[0].size >= _ht[0].slots.size()) {
+    resize(_ht[0].slots.size() * 2);
+  }
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::shrinkIfNeeded() {
+  if (isRehashing() || _ht[0].slots.size() <= k_initial_size) {
+    return;
+  }
+  // Shrink below 10% fill
+  if (_ht[0].size * 10 < _ht[0].slots.size()) {
+    size_t size = k_initial_size;
+    while (size < _ht[0].size) {
+      size *= 2;
+    }
+    resize(size);
+  }
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::resize(size_t size) {
+  _ht[1].slots.assign(size, nullptr);
+  _ht[1].mask = size - 1;
+  _ht[1].size = 0;
+  _rehashIdx = 0;
+}
+
+template <typename K, typename V, typename Hash>
+void Dict<K, V, Hash>::freeTable(Table &table) {
+  for (Node *node : table.slots) {
+    while (node) {
+      Node *next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+  table = Table();
+}
+
+template <typename K, typename V, typename Hash>
+uint64_t Dict<K, V, Hash>::reverseBits(uint64_t v) {
+  v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+  v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+  v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+  v = ((v >> 16) & 0x0000FFFF0000FFFFULL) |
+      ((v & 0x0000FFFF0000FFFFULL) << 16);
+  return (v >> 32) | (v << 32);
+}
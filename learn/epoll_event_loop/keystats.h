@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Estimate of the most accessed keys, cheap enough to stay always on.
+//
+// One access in about `sampleRate` is counted: the others only decrement a
+// countdown. Sampled keys go to a count-min sketch, `depth` rows of counters
+// indexed by different hashes of the key, whose minimum over the rows
+// overestimates the key's count by the collisions only. Keys whose estimate
+// is among the `k` largest are kept in a min-heap, so a new key only has to
+// beat the root to get in. decay() halves every count so the ranking
+// follows the current load rather than the whole uptime.
+class HotKeys {
+public:
+  HotKeys(size_t k, uint32_t sampleRate)
+      : _k(k), _sampleRate(std::max<uint32_t>(sampleRate, 1)),
+        _sketch(k_depth * k_width, 0) {}
+
+  void record(const std::string &key) {
+    if (--_countdown > 0) {
+      return;
+    }
+    // Randomize the interval so periodic access patterns don't alias
+    _rng ^= _rng << 13;
+    _rng ^= _rng >> 7;
+    _rng ^= _rng << 17;
+    _countdown = 1 + (uint32_t)(_rng % (2 * _sampleRate - 1));
+    offer(key, add(key));
+  }
+
+  void decay() {
+    for (auto &counter : _sketch) {
+      counter >>= 1;
+    }
+    for (auto &item : _heap) {
+      item.count >>= 1;
+    }
+  }
+
+  // Up to `n` keys, hottest first, with their estimated number of accesses
+  // since the counts last decayed
+  std::vector<std::pair<std::string, uint64_t>> top(size_t n) const {
+    std::vector<std::pair<std::string, uint64_t>> out;
+    for (const auto &item : _heap) {
+      out.emplace_back(item.key, (uint64_t)item.count * _sampleRate);
+    }
+    std::sort(out.begin(), out.end(), [](const auto &a, const auto &b) {
+      return a.second > b.second;
+    });
+    if (out.size() > n) {
+      out.resize(n);
+    }
+    return out;
+  }
+
+private:
+  static constexpr size_t k_depth = 4;
+  static constexpr size_t k_width = 4096;
+
+  struct Item {
+    std::string key;
+    uint32_t count;
+  };
+
+  // Count one access, return the new estimate
+  uint32_t add(const std::string &key) {
+    uint64_t h1 = std::hash<std::string>()(key);
+    uint64_t h2 = (h1 >> 32) | 1;
+    uint32_t estimate = UINT32_MAX;
+    for (size_t i = 0; i < k_depth; ++i) {
+      size_t column = (h1 + i * h2) & (k_width - 1);
+      uint32_t &counter = _sketch[i * k_width + column];
+      if (counter < UINT32_MAX) {
+        ++counter;
+      }
+      estimate = std::min(estimate, counter);
+    }
+    return estimate;
+  }
+
+  void offer(const std::string &key, uint32_t estimate) {
+    auto it = _pos.find(key);
+    if (it != _pos.end()) {
+      // Counts only grow between decays, the item can only move down
+      _heap[it->second].count = estimate;
+      siftDown(it->second);
+      return;
+    }
+    if (_heap.size() < _k) {
+      _heap.push_back({key, estimate});
+      _pos[key] = _heap.size() - 1;
+      siftUp(_heap.size() - 1);
+      return;
+    }
+    if (_k == 0 || estimate <= _heap[0].count) {
+      return;
+    }
+    _pos.erase(_heap[0].key);
+    _heap[0] = {key, estimate};
+    _pos[key] = 0;
+    siftDown(0);
+  }
+
+  void swapItems(size_t a, size_t b) {
+    std::swap(_heap[a], _heap[b]);
+    _pos[_heap[a].key] = a;
+    _pos[_heap[b].key] = b;
+  }
+
+  void siftUp(size_t i) {
+    while (i > 0 && _heap[i].count < _heap[(i - 1) / 2].count) {
+      swapItems(i, (i - 1) / 2);
+      i = (i - 1) / 2;
+    }
+  }
+
+  void siftDown(size_t i) {
+    while (true) {
+      size_t smallest = i;
+      for (size_t child = 2 * i + 1; child <= 2 * i + 2; ++child) {
+        if (child < _heap.size() &&
+            _heap[child].count < _heap[smallest].count) {
+          smallest = child;
+        }
+      }
+      if (smallest == i) {
+        return;
+      }
+      swapItems(i, smallest);
+      i = smallest;
+    }
+  }
+
+private:
+  size_t _k;
+  uint32_t _sampleRate;
+  uint32_t _countdown = 1;
+  uint64_t _rng = 0x9E3779B97F4A7C15ULL;
+  std::vector<uint32_t> _sketch;
+  // Min-heap on count, and the position of each key in it
+  std::vector<Item> _heap;
+  std::unordered_map<std::string, size_t> _pos;
+};
+
+// The `n` largest items offered, by size.
+template <typename T> class TopN {
+public:
+  explicit TopN(size_t n) : _n(n) {}
+
+  void offer(uint64_t size, const T &item) {
+    if (_heap.size() < _n) {
+      _heap.emplace_back(size, item);
+      std::push_heap(_heap.begin(), _heap.end(), Greater());
+    } else if (_n > 0 && size > _heap.front().first) {
+      std::pop_heap(_heap.begin(), _heap.end(), Greater());
+      _heap.back() = {size, item};
+      std::push_heap(_heap.begin(), _heap.end(), Greater());
+    }
+  }
+
+  // Largest first
+  std::vector<std::pair<uint64_t, T>> sorted() const {
+    auto out = _heap;
+    std::sort(out.begin(), out.end(),
+              [](const auto &a, const auto &b) { return a.first > b.first; });
+    return out;
+  }
+
+  void clear() { _heap.clear(); }
+
+private:
+  struct Greater {
+    bool operator()(const std::pair<uint64_t, T> &a,
+                    const std::pair<uint64_t, T> &b) const {
+      return a.first > b.first;
+    }
+  };
+
+  size_t _n;
+  // Min-heap on size
+  std::vector<std::pair<uint64_t, T>> _heap;
+};
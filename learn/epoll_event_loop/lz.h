@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// Small LZ77 codec in the spirit of LZ4, fast rather than tight.
+//
+// The compressed form is a sequence of [token][literal length...][literals]
+// [u16 offset][match length...]. The token holds the literal length and the
+// match length minus 4 in its two nibbles, 15 means more length bytes follow
+// (255 for more still). The last sequence has literals only. Matches are
+// found through a hash of the next 4 bytes, no attempt is made to find the
+// longest one.
+//
+// A blob is [u32 raw size][compressed], what the server stores.
+namespace Lz {
+
+constexpr int k_hash_bits = 14;
+constexpr size_t k_min_match = 4;
+constexpr size_t k_max_offset = 65535;
+// The end of the input is left to literals, so a match never runs past it
+constexpr size_t k_last_literals = 5;
+constexpr size_t k_match_limit = 12;
+
+inline uint32_t read32(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline void putLength(std::string &out, size_t len) {
+  for (; len >= 255; len -= 255) {
+    out.push_back((char)255);
+  }
+  out.push_back((char)len);
+}
+
+inline void putSequence(std::string &out, const char *literals, size_t litLen,
+                        size_t offset, size_t matchLen) {
+  size_t ml = matchLen >= k_min_match ? matchLen - k_min_match : 0;
+  out.push_back((char)((std::min<size_t>(litLen, 15) << 4) |
+                       std::min<size_t>(ml, 15)));
+  if (litLen >= 15) {
+    putLength(out, litLen - 15);
+  }
+  out.append(literals, litLen);
+  if (matchLen == 0) {
+    return;
+  }
+  out.push_back((char)(offset & 0xff));
+  out.push_back((char)(offset >> 8));
+  if (ml >= 15) {
+    putLength(out, ml - 15);
+  }
+}
+
+// Append the compressed form of `in` to `out`, false if it would take more
+// than `limit` bytes
+inline bool compress(const char *in, size_t n, std::string &out,
+                     size_t limit) {
+  // Positions of the last occurrences of 4 byte sequences. Left over from
+  // earlier inputs, an entry is still a position before the current one and
+  // is checked against the data, so the table is never cleared.
+  thread_local uint32_t table[1 << k_hash_bits];
+  size_t start = out.size();
+  size_t anchor = 0;
+  size_t ip = 0;
+  size_t misses = 0;
+  size_t end = n < k_match_limit ? 0 : n - k_match_limit;
+  while (ip < end) {
+    uint32_t seq = read32(in + ip);
+    uint32_t h = (seq * 2654435761u) >> (32 - k_hash_bits);
+    size_t ref = table[h];
+    table[h] = (uint32_t)ip;
+    if (ref >= ip || ip - ref > k_max_offset || read32(in + ref) != seq) {
+      // Skip faster through data that doesn't compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+    size_t len = k_min_match;
+    while (ip + len < n - k_last_literals && in[ref + len] == in[ip + len]) {
+      ++len;
+    }
+    putSequence(out, in + anchor, ip - anchor, ip - ref, len);
+    if (out.size() - start > limit) {
+      out.resize(start);
+      return false;
+    }
+    ip += len;
+    anchor = ip;
+  }
+  putSequence(out, in + anchor, n - anchor, 0, 0);
+  if (out.size() - start > limit) {
+    out.resize(start);
+    return false;
+  }
+  return true;
+}
+
+// Decompress exactly `rawLen` bytes to `out`, false on malformed input
+inline bool decompress(const char *in, size_t n, char *out, size_t rawLen) {
+  size_t ip = 0;
+  size_t op = 0;
+  auto getLength = [&](size_t &len) {
+    uint8_t b = 255;
+    while (b == 255) {
+      if (ip >= n) {
+        return false;
+      }
+      b = (uint8_t)in[ip++];
+      len += b;
+    }
+    return true;
+  };
+  while (ip < n) {
+    uint8_t token = (uint8_t)in[ip++];
+    size_t litLen = token >> 4;
+    if (litLen == 15 && !getLength(litLen)) {
+      return false;
+    }
+    if (litLen > n - ip || litLen > rawLen - op) {
+      return false;
+    }
+    memcpy(out + op, in + ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if (ip == n) {
+      break;
+    }
+    if (n - ip < 2) {
+      return false;
+    }
+    size_t offset = (uint8_t)in[ip] | ((size_t)(uint8_t)in[ip + 1] << 8);
+    ip += 2;
+    size_t matchLen = token & 15;
+    if (matchLen == 15 && !getLength(matchLen)) {
+      return false;
+    }
+    matchLen += k_min_match;
+    if (offset == 0 || offset > op || matchLen > rawLen - op) {
+      return false;
+    }
+    const char *match = out + op - offset;
+    if (offset >= matchLen) {
+      memcpy(out + op, match, matchLen);
+    } else {
+      // Overlapping, the match repeats the bytes it's producing
+      for (size_t i = 0; i < matchLen; ++i) {
+        out[op + i] = match[i];
+      }
+    }
+    op += matchLen;
+  }
+  return op == rawLen;
+}
+
+// Store `in` as a blob in `out` if it takes at most `limit` bytes
+inline bool compressBlob(const std::string &in, std::string &out,
+                         size_t limit) {
+  uint32_t rawLen = (uint32_t)in.size();
+  out.assign((const char *)&rawLen, 4);
+  return limit > 4 && compress(in.data(), in.size(), out, limit - 4);
+}
+
+inline size_t blobRawSize(const std::string &blob) {
+  return blob.size() < 4 ? 0 : read32(blob.data());
+}
+
+// Decompress a blob to `out`, which has room for blobRawSize() bytes
+inline bool decompressBlob(const std::string &blob, char *out) {
+  return blob.size() >= 4 &&
+         decompress(blob.data() + 4, blob.size() - 4, out, blobRawSize(blob));
+}
+
+} // namespace Lz
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Wire format shared by the server and the clients.
+//
+// Every message is framed by a 4 bytes length header.
+// Request:  [len][nstr][len1][str1]...[lenN][strN]
+// Response: [len][serialized value]
+// A serialized value starts with one tag byte (SER_*):
+//   SER_NIL
+//   SER_ERR [len][msg]
+//   SER_STR [len][bytes]
+//   SER_INT [int64]
+//   SER_ARR [n][value1]...[valueN]
+//   SER_PUSH [n][value1]...[valueN]
+// A push is an array sent without a request, e.g. a pub/sub message. It may
+// arrive between the response frames.
+
+constexpr int k_header_size = 4;
+constexpr size_t k_max_msg = 32 << 20;
+constexpr size_t k_max_args = 1 << 20;
+
+enum : uint8_t {
+  SER_NIL = 0,
+  SER_ERR = 1,
+  SER_STR = 2,
+  SER_INT = 3,
+  SER_ARR = 4,
+  SER_PUSH = 5,
+};
+
+namespace Protocol {
+
+inline void appendU32(std::string &out, uint32_t v) {
+  out.append((const char *)&v, 4);
+}
+
+inline uint32_t readU32(const char *p) {
+  uint32_t v = 0;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// Parse the body of a request (without the length header).
+inline bool parseRequest(const char *data, size_t size,
+                         std::vector<std::string> &out) {
+  if (size < 4) {
+    return false;
+  }
+  uint32_t n = readU32(data);
+  if (n > k_max_args) {
+    return false;
+  }
+  size_t pos = 4;
+  while (n--) {
+    if (pos + 4 > size) {
+      return false;
+    }
+    uint32_t len = readU32(&data[pos]);
+    if (pos + 4 + len > size) {
+      return false;
+    }
+    out.emplace_back(&data[pos + 4], len);
+    pos += 4 + len;
+  }
+  return pos == size;
+}
+
+// Append a framed request to `out`.
+inline void encodeRequest(const std::vector<std::string> &cmd,
+                          std::string &out) {
+  size_t len = 4;
+  for (const auto &s : cmd) {
+    len += 4 + s.size();
+  }
+  appendU32(out, (uint32_t)len);
+  appendU32(out, (uint32_t)cmd.size());
+  for (const auto &s : cmd) {
+    appendU32(out, (uint32_t)s.size());
+    out.append(s);
+  }
+}
+
+// Reserve room for the length header of a response, returns its position.
+inline size_t beginResponse(std::string &out) {
+  size_t pos = out.size();
+  out.append(4, '\0');
+  return pos;
+}
+
+inline void endResponse(std::string &out, size_t pos) {
+  uint32_t len = (uint32_t)(out.size() - pos - 4);
+  memcpy(&out[pos], &len, 4);
+}
+
+inline void outNil(std::string &out) { out.push_back(SER_NIL); }
+
+inline void outStr(std::string &out, const char *s, size_t size) {
+  out.push_back(SER_STR);
+  appendU32(out, (uint32_t)size);
+  out.append(s, size);
+}
+
+inline void outStr(std::string &out, const std::string &s) {
+  outStr(out, s.data(), s.size());
+}
+
+inline void outInt(std::string &out, int64_t v) {
+  out.push_back(SER_INT);
+  out.append((const char *)&v, 8);
+}
+
+inline void outErr(std::string &out, const std::string &msg) {
+  out.push_back(SER_ERR);
+  appendU32(out, (uint32_t)msg.size());
+  out.append(msg);
+}
+
+inline void outArr(std::string &out, uint32_t n) {
+  out.push_back(SER_ARR);
+  appendU32(out, n);
+}
+
+inline void outPush(std::string &out, uint32_t n) {
+  out.push_back(SER_PUSH);
+  appendU32(out, n);
+}
+
+// Decoded response, used by the clients
+struct Value {
+  uint8_t type = SER_NIL;
+  // SER_STR and SER_ERR
+  std::string str;
+  int64_t num = 0;
+  std::vector<Value> elems;
+
+  bool isErr() const { return type == SER_ERR; }
+  bool isPush() const { return type == SER_PUSH; }
+};
+
+// Decode one serialized value, returns the number of bytes consumed or 0 on
+// malformed input
+inline size_t decodeValue(const char *data, size_t size, Value &out) {
+  if (size < 1) {
+    return 0;
+  }
+  out.type = (uint8_t)data[0];
+  switch (out.type) {
+  case SER_NIL:
+    return 1;
+  case SER_ERR:
+  case SER_STR: {
+    if (size < 1 + 4) {
+      return 0;
+    }
+    uint32_t len = readU32(&data[1]);
+    if (size - 1 - 4 < len) {
+      return 0;
+    }
+    out.str.assign(&data[1 + 4], len);
+    return 1 + 4 + len;
+  }
+  case SER_INT:
+    if (size < 1 + 8) {
+      return 0;
+    }
+    memcpy(&out.num, &data[1], 8);
+    return 1 + 8;
+  case SER_ARR:
+  case SER_PUSH: {
+    if (size < 1 + 4) {
+      return 0;
+    }
+    uint32_t n = readU32(&data[1]);
+    size_t pos = 1 + 4;
+    out.elems.clear();
+    for (uint32_t i = 0; i < n; ++i) {
+      out.elems.emplace_back();
+      size_t rv = decodeValue(&data[pos], size - pos, out.elems.back());
+      if (rv == 0) {
+        return 0;
+      }
+      pos += rv;
+    }
+    return pos;
+  }
+  default:
+    return 0;
+  }
+}
+
+} // namespace Protocol
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "trie.h"
+
+// Index of the glob patterns subscribed with PSUBSCRIBE.
+//
+// Patterns are stored in a trie keyed by their literal prefix, the part
+// before the first special character. Publishing walks the trie along the
+// channel name, so only the patterns whose prefix matches the channel are
+// handed to the glob matcher instead of every subscribed pattern.
+class PatternTrie {
+public:
+  void insert(const std::string &pattern) {
+    _trie.insert(pattern.substr(0, literalPrefix(pattern)), pattern);
+  }
+
+  bool erase(const std::string &pattern) {
+    return _trie.erase(pattern.substr(0, literalPrefix(pattern)), pattern);
+  }
+
+  // Call fn(pattern) for every pattern whose literal prefix is a prefix of
+  // `channel`. The caller still has to match the rest of the pattern.
+  template <typename F> void forEachCandidate(const std::string &channel,
+                                              F &&fn) const {
+    _trie.forEachPrefixOf(channel, fn);
+  }
+
+  size_t size() const { return _trie.size(); }
+
+private:
+  static size_t literalPrefix(const std::string &pattern) {
+    size_t n = pattern.find_first_of("*?[\\");
+    return n == std::string::npos ? pattern.size() : n;
+  }
+
+  PrefixTrie<std::string> _trie;
+};
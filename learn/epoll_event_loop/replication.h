@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string>
+
+// Circular buffer holding the tail of the replication stream.
+//
+// Offsets are absolute positions in the stream since the replication id was
+// created. A replica that reconnects with an offset still covered by the
+// backlog only needs the bytes after it instead of a full snapshot.
+class ReplBacklog {
+public:
+  explicit ReplBacklog(size_t capacity) : _buf(capacity, '\0') {}
+
+  // Drop the history, the next appended byte will be at `offset`
+  void reset(uint64_t offset) {
+    _endOffset = offset;
+    _histlen = 0;
+    _idx = 0;
+  }
+
+  void append(const char *data, size_t size) {
+    _endOffset += size;
+    if (size >= _buf.size()) {
+      // Only the tail fits
+      data += size - _buf.size();
+      size = _buf.size();
+    }
+    while (size > 0) {
+      size_t chunk = std::min(size, _buf.size() - _idx);
+      std::copy(data, data + chunk, &_buf[_idx]);
+      _idx = (_idx + chunk) % _buf.size();
+      data += chunk;
+      size -= chunk;
+      _histlen = std::min(_histlen + chunk, _buf.size());
+    }
+  }
+
+  uint64_t startOffset() const { return _endOffset - _histlen; }
+  uint64_t endOffset() const { return _endOffset; }
+  bool contains(uint64_t offset) const {
+    return offset >= startOffset() && offset <= _endOffset;
+  }
+
+  // Append the history from `offset` to the end to `out`
+  void copyFrom(uint64_t offset, std::string &out) const {
+    size_t len = (size_t)(_endOffset - offset);
+    size_t start = (_idx + _buf.size() - len) % _buf.size();
+    size_t first = std::min(len, _buf.size() - start);
+    out.append(&_buf[start], first);
+    out.append(&_buf[0], len - first);
+  }
+
+private:
+  std::string _buf;
+  // Next write position in _buf
+  size_t _idx = 0;
+  // Valid bytes in _buf
+  size_t _histlen = 0;
+  uint64_t _endOffset = 0;
+};
+
+// Random 40 hex chars identifying a replication history
+inline std::string newReplId() {
+  static const char k_hex[] = "0123456789abcdef";
+  std::random_device rd;
+  std::mt19937_64 gen(((uint64_t)rd() << 32) | rd());
+  std::string id(40, '0');
+  for (auto &c : id) {
+    c = k_hex[gen() & 15];
+  }
+  return id;
+}
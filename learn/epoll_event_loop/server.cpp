@@ -1,45 +1,273 @@
 #include <cerrno>
 #include <csignal>
 #include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <arpa/inet.h>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <iostream>
+#include <malloc.h>
 #include <memory>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <ostream>
+#include <sstream>
+#include <string>
+#include <strings.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <thread>
+#include <type_traits>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cluster.h"
+#include "coro.h"
+#include "defrag.h"
+#include "hashtable.h"
+#include "keystats.h"
+#include "lz.h"
+#include "protocol.h"
+#include "pubsub.h"
+#include "replication.h"
+#include "thread_pool.h"
+#include "tier.h"
+#include "tracking.h"
+#include "upgrade.h"
 
-constexpr int k_header_size = 4;
-constexpr int k_max_msg = 256;
 constexpr int k_port = 9001;
 constexpr int k_max_events = 10;
+constexpr size_t k_read_chunk = 64 * 1024;
+constexpr size_t k_bg_threads = 2;
+// Entries that own more allocations than this are freed by the background
+// pool when deleted with UNLINK, FLUSHALL ASYNC or overwritten
+constexpr size_t k_lazy_free_threshold = 64;
+constexpr size_t k_scan_default_count = 10;
+// COUNT is a hint, larger values are lowered to this to bound the work of
+// a call
+constexpr size_t k_scan_max_count = 1000;
+// Buckets a SCAN call may visit per requested element, bounds the work done
+// when most buckets are empty or filtered out
+constexpr size_t k_scan_max_visits_factor = 10;
+// Buckets rehashed per cron run
+constexpr size_t k_idle_rehash_steps = 1000;
+constexpr int k_cron_interval_ms = 100;
+constexpr size_t k_repl_backlog_size = 16 << 20;
+// A replica whose unsent output grows past this is disconnected, it will
+// resync when it reconnects
+constexpr size_t k_replica_output_limit = 256 << 20;
+// Snapshot generation pauses while the replica has this much unsent output
+constexpr size_t k_snapshot_output_watermark = 1 << 20;
+constexpr size_t k_snapshot_buckets_per_step = 64;
+// Members per command when serializing a collection
+constexpr size_t k_snapshot_batch = 1000;
+// Reads of values in the tier a snapshot keeps in flight
+constexpr size_t k_snapshot_tier_reads = 64;
+constexpr int k_repl_reconnect_ms = 1000;
+constexpr int k_repl_ack_ms = 1000;
+// Keys moved per batch when migrating a slot
+constexpr size_t k_migrate_batch = 100;
+// A subscriber whose unsent output grows past this is disconnected
+constexpr size_t k_pubsub_output_limit = 32 << 20;
+// Buffers written by a single writev
+constexpr size_t k_max_iov = 64;
+// Keys remembered for client side caching, see --tracking-table-max-keys
+constexpr size_t k_tracking_table_max_keys = 1 << 20;
+// Keys evicted from the tracking table per event loop iteration
+constexpr size_t k_tracking_evictions_per_loop = 1000;
+// Hot keys: one key access in about this many is counted
+constexpr uint32_t k_hotkeys_sample_rate = 16;
+constexpr size_t k_hotkeys_top = 32;
+// The access counts are halved this often
+constexpr int k_hotkeys_decay_ms = 10000;
+constexpr size_t k_hotkeys_default_count = 10;
+// Big keys: largest keys kept per type, time a new scan of the keyspace is
+// started after the previous one and time spent scanning per cron run
+constexpr size_t k_bigkeys_top = 10;
+constexpr int k_bigkeys_interval_ms = 60000;
+constexpr int k_bigkeys_budget_us = 1000;
+constexpr size_t k_bigkeys_buckets_per_check = 64;
+// Tiered storage, see --tier-dir. Strings of at least --tier-min-size bytes
+// not accessed for --tier-idle-secs go to disk.
+constexpr size_t k_tier_min_size = 1024;
+constexpr uint32_t k_tier_idle_secs = 300;
+constexpr uint64_t k_tier_segment_size = 16 << 20;
+constexpr size_t k_tier_threads = 4;
+// Bytes per batch written, and batches in flight
+constexpr size_t k_tier_batch_bytes = 1 << 20;
+constexpr size_t k_tier_max_writes = 4;
+// Time spent looking for cold values per cron run
+constexpr int k_tier_budget_us = 1000;
+constexpr size_t k_tier_buckets_per_check = 64;
+// A sealed segment is compacted once its live bytes fall under this ratio
+constexpr double k_tier_compact_ratio = 0.5;
+// A compressed value is kept only if it takes at most this fraction of the
+// raw one
+constexpr double k_compress_max_ratio = 0.8;
+// Active defragmentation, see --defrag-threshold. The fragmentation is
+// checked this often and ignored while it wastes less than this many bytes.
+constexpr uint32_t k_defrag_threshold = 50;
+constexpr int k_defrag_check_ms = 1000;
+constexpr uint64_t k_defrag_ignore_bytes = 64 << 20;
+// A pass doesn't start again by itself before this long
+constexpr int k_defrag_interval_ms = 60000;
+// Time spent moving values per loop iteration, the clients are served in
+// between
+constexpr int k_defrag_budget_us = 100;
+constexpr size_t k_defrag_buckets_per_check = 16;
+constexpr size_t k_defrag_frees_per_check = 1024;
+// Collections with more elements are moved over several steps
+constexpr size_t k_defrag_big_collection = 1024;
+// Allocations on pages used less than this are moved
+constexpr double k_defrag_sparse_ratio = 0.9;
+// Memory used by the keyspace: time a new walk is started after the
+// previous one and time spent walking per cron run. Collections with more
+// elements are sized from this many.
+constexpr int k_memory_interval_ms = 1000;
+constexpr int k_memory_budget_us = 1000;
+constexpr size_t k_memory_buckets_per_check = 64;
+constexpr size_t k_memory_sampled_elements = 1024;
 
-enum class ConnectionType { REQUEST = 0, RESPOND, END };
+enum class ConnectionType { REQUEST = 0, END };
+// What resumes the coroutine of a connection: an event on its socket, or a
+// wakeup once what it waits for changed, e.g. its values were loaded
+enum class WaitFor { SOCKET = 0, WAKEUP };
 class Connection {
 public:
   int fd = -1;
+  // Unique for the lifetime of the server, unlike fds
+  uint64_t id = 0;
   ConnectionType type = ConnectionType::END;
-  // For request connection only
+  // Coroutine serving the connection, see serveConn(). Set while it's
+  // suspended, `waiting` resumes it.
+  Coro::Task handler;
+  std::coroutine_handle<> waiting;
+  WaitFor wait_for = WaitFor::SOCKET;
+
+  // Input not processed yet
   size_t rbuf_size = 0;
-  char rbuf[k_header_size + k_max_msg];
+  std::vector<char> rbuf;
 
-  // For response connection only
-  size_t wbuf_size = 0;
+  // Output not sent yet
   size_t wbuf_sent = 0;
-  char wbuf[k_header_size + k_max_msg];
+  std::string wbuf;
+  // Buffers shared with other connections, e.g. a published message. They
+  // are sent before wbuf, which only holds what was appended after them.
+  // The slots before wqueue_head were sent, they are reused once the queue
+  // empties so the steady state doesn't allocate.
+  std::vector<std::shared_ptr<const std::string>> wqueue;
+  size_t wqueue_head = 0;
+  size_t wqueue_sent = 0;
+  size_t wqueue_bytes = 0;
+  // Queued in the list of connections flushed before sleeping
+  bool pending_write = false;
+
+  // Pub/Sub, name -> position in the list of subscribers
+  std::unordered_map<std::string, size_t> channels;
+  std::unordered_map<std::string, size_t> patterns;
+
+  // Client side caching
+  bool tracking = false;
+  bool tracking_bcast = false;
+  std::vector<std::string> tracking_prefixes;
+  // Keys to invalidate, sent as one push after the current command
+  std::vector<std::string> invalidations;
+  // Everything must be invalidated, e.g. after FLUSHALL
+  bool invalidate_all = false;
+
+  // For replica connection only, i.e. a client that sent PSYNC
+  bool is_replica = false;
+  // Online once the snapshot is sent, until then the stream is held in
+  // repl_pending
+  bool repl_online = false;
+  bool snapshot_done = true;
+  uint64_t snapshot_cursor = 0;
+  // The keyspace scan is over, what is left are snapshot_keys
+  bool snapshot_scanned = false;
+  // Sets and hashes too large to serialize in one step, sent a batch of
+  // members at a time from snapshot_key_cursor
+  std::vector<std::string> snapshot_keys;
+  uint64_t snapshot_key_cursor = 0;
+  // Values of the snapshot being read from the tier
+  size_t snapshot_reads = 0;
+  std::string repl_pending;
+  uint64_t repl_ack_offset = 0;
+
+  // Set on the link a replica opened to its primary
+  bool is_primary = false;
+
+  // Cluster mode
+  // The next command may access a slot being imported
+  bool asking = false;
+  // Link of a node migrating a slot to us, may always access it
+  bool importing = false;
+  // Set on the link we opened to migrate a slot, it receives replies
+  bool is_migration = false;
+
+  // Values read from the tier that the request being run waits for,
+  // nothing else is read or run meanwhile
+  size_t pending_loads = 0;
 };
 
 using ConnectionPtr = std::shared_ptr<Connection>;
 
+struct NoValue {};
+using StringSet = Dict<std::string, NoValue>;
+using StringMap = Dict<std::string, std::string>;
+
+enum class ValueType { STRING = 0, SET, HASH };
+struct Entry {
+  ValueType type = ValueType::STRING;
+  std::string str;
+  // Allocated for their type only, a string pays for `str` alone
+  std::unique_ptr<StringSet> set;
+  std::unique_ptr<StringMap> hash;
+  // Last access, in seconds of the LRU clock
+  uint32_t atime = 0;
+  // Set when the value of a string is in the tier instead of `str`
+  std::unique_ptr<Extent> ext;
+  // The value of a string is an Lz blob, in `str` or in the tier
+  bool compressed = false;
+};
+
+using EntryPtr = std::unique_ptr<Entry>;
+using Keyspace = Dict<std::string, EntryPtr>;
+using Args = std::vector<std::string>;
+
+struct ServerConfig {
+  int port = k_port;
+  // Start as a replica of this primary when set
+  std::string primaryHost;
+  int primaryPort = 0;
+  bool cluster = false;
+  // Address other nodes and clients reach us at in cluster mode
+  std::string announceIp = "127.0.0.1";
+  size_t trackingTableMaxKeys = k_tracking_table_max_keys;
+  // Tiered storage is enabled by a directory for the segments
+  std::string tierDir;
+  size_t tierMinSize = k_tier_min_size;
+  uint32_t tierIdleSecs = k_tier_idle_secs;
+  // Strings of at least this many bytes are compressed, 0 disables it
+  size_t compressMinSize = 0;
+  // Percentage of RSS over allocated memory that starts a defragmentation
+  // pass, 0 disables it
+  uint32_t defragThreshold = k_defrag_threshold;
+  // Control socket of hot upgrades. With takeover, connect to the server
+  // listening there and take its clients over instead of binding the port.
+  std::string upgradeSocket;
+  bool takeover = false;
+};
+
 class ServerImpl;
 class Server {
 public:
-  Server(const int port = 8080);
+  Server(const ServerConfig &config);
   ~Server();
 
   bool init();
@@ -51,22 +279,493 @@ private:
   std::unique_ptr<ServerImpl> impl_;
 };
 
-int main() {
-  Server server(k_port);
-  server.init();
+namespace {
+namespace Internal {
+bool parseArgs(int argc, char **argv, ServerConfig &config);
+} // namespace Internal
+} // namespace
+
+int main(int argc, char **argv) {
+  ServerConfig config;
+  if (!Internal::parseArgs(argc, argv, config)) {
+    std::cout << "Usage: " << argv[0]
+              << " [--port port] [--replicaof host port] [--cluster]"
+                 " [--announce-ip ip] [--tracking-table-max-keys n]"
+                 " [--tier-dir dir] [--tier-min-size n] [--tier-idle-secs n]"
+                 " [--compress-min-size n] [--defrag-threshold pct]"
+                 " [--upgrade-socket path [--takeover]]"
+              << std::endl;
+    return 1;
+  }
+  // A write to a peer that went away must fail with EPIPE, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  Server server(config);
+  if (!server.init()) {
+    return 1;
+  }
   server.start();
   std::this_thread::sleep_for(std::chrono::seconds(100000000));
 }
 
 namespace {
-namespace Internal {} // namespace Internal
+namespace Internal {
+
+// Rough number of allocations owned by an entry, i.e. the cost of freeing it
+size_t freeEffort(const Entry &entry) {
+  if (entry.type == ValueType::SET) {
+    return entry.set->size();
+  }
+  if (entry.type == ValueType::HASH) {
+    return entry.hash->size();
+  }
+  return 1;
+}
+
+// Sets and hashes sent in several steps by snapshots and migrations
+bool streamed(const Entry &entry) {
+  return entry.type != ValueType::STRING &&
+         freeEffort(entry) > k_snapshot_batch;
+}
+
+bool equalsIgnoreCase(const std::string &a, const char *b) {
+  return strcasecmp(a.c_str(), b) == 0;
+}
+
+const char *typeName(ValueType type) {
+  switch (type) {
+  case ValueType::STRING:
+    return "string";
+  case ValueType::SET:
+    return "set";
+  case ValueType::HASH:
+    return "hash";
+  }
+  return "none";
+}
+
+// Match the character `c` against the element of the pattern at `p`: '?',
+// a class '[abc]' / '[^a-z]', an escape or a literal. On a match `p` moves
+// past the element.
+bool globMatchOne(const char *pattern, size_t len, size_t &p, char c) {
+  switch (pattern[p]) {
+  case '?':
+    ++p;
+    return true;
+  case '[': {
+    size_t i = p + 1;
+    bool negate = i < len && pattern[i] == '^';
+    if (negate) {
+      ++i;
+    }
+    bool match = false;
+    for (; i < len && pattern[i] != ']'; ++i) {
+      if (pattern[i] == '\\' && i + 1 < len) {
+        ++i;
+        match |= pattern[i] == c;
+      } else if (i + 2 < len && pattern[i + 1] == '-' &&
+                 pattern[i + 2] != ']') {
+        char lo = pattern[i], hi = pattern[i + 2];
+        if (lo > hi) {
+          std::swap(lo, hi);
+        }
+        match |= c >= lo && c <= hi;
+        i += 2;
+      } else {
+        match |= pattern[i] == c;
+      }
+    }
+    if (i == len || match == negate) {
+      // An unterminated class matches nothing
+      return false;
+    }
+    p = i + 1;
+    return true;
+  }
+  case '\\':
+    if (p + 1 < len) {
+      if (pattern[p + 1] != c) {
+        return false;
+      }
+      p += 2;
+      return true;
+    }
+    [[fallthrough]];
+  default:
+    if (pattern[p] != c) {
+      return false;
+    }
+    ++p;
+    return true;
+  }
+}
+
+// Glob-style matching: '*', '?', '[abc]', '[^a-z]' and '\' escapes, on
+// binary strings. Only the last '*' met is retried on a mismatch, with one
+// more character: a match of an earlier '*' can't matter once a later one
+// matched, so the cost is bounded by the product of the lengths instead of
+// growing exponentially with the number of stars.
+bool globMatch(const char *pattern, size_t patternLen, const char *str,
+               size_t strLen) {
+  size_t p = 0, s = 0;
+  // Pattern after the last '*' and where its match ends in `str`
+  size_t starP = std::string::npos, starS = 0;
+  while (s < strLen) {
+    if (p < patternLen && pattern[p] == '*') {
+      starP = ++p;
+      starS = s;
+      continue;
+    }
+    if (p < patternLen && globMatchOne(pattern, patternLen, p, str[s])) {
+      ++s;
+      continue;
+    }
+    if (starP == std::string::npos) {
+      return false;
+    }
+    p = starP;
+    s = ++starS;
+  }
+  while (p < patternLen && pattern[p] == '*') {
+    ++p;
+  }
+  return p == patternLen;
+}
+
+bool parseUInt(const std::string &s, uint64_t &out) {
+  if (s.empty() || s.size() > 20) {
+    return false;
+  }
+  char *end = nullptr;
+  errno = 0;
+  out = strtoull(s.c_str(), &end, 10);
+  return errno == 0 && *end == '\0' && s[0] != '-';
+}
+
+bool parsePort(const std::string &s, int &port) {
+  uint64_t v = 0;
+  if (!parseUInt(s, v) || v == 0 || v > 65535) {
+    return false;
+  }
+  port = (int)v;
+  return true;
+}
+
+bool parseArgs(int argc, char **argv, ServerConfig &config) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--port" && i + 1 < argc) {
+      if (!parsePort(argv[++i], config.port)) {
+        return false;
+      }
+    } else if (arg == "--replicaof" && i + 2 < argc) {
+      config.primaryHost = argv[++i];
+      if (!parsePort(argv[++i], config.primaryPort)) {
+        return false;
+      }
+    } else if (arg == "--cluster") {
+      config.cluster = true;
+    } else if (arg == "--announce-ip" && i + 1 < argc) {
+      config.announceIp = argv[++i];
+    } else if (arg == "--tracking-table-max-keys" && i + 1 < argc) {
+      uint64_t n = 0;
+      if (!parseUInt(argv[++i], n)) {
+        return false;
+      }
+      config.trackingTableMaxKeys = (size_t)n;
+    } else if (arg == "--tier-dir" && i + 1 < argc) {
+      config.tierDir = argv[++i];
+    } else if (arg == "--tier-min-size" && i + 1 < argc) {
+      uint64_t n = 0;
+      if (!parseUInt(argv[++i], n) || n == 0) {
+        return false;
+      }
+      config.tierMinSize = (size_t)n;
+    } else if (arg == "--tier-idle-secs" && i + 1 < argc) {
+      uint64_t n = 0;
+      if (!parseUInt(argv[++i], n) || n > UINT32_MAX) {
+        return false;
+      }
+      config.tierIdleSecs = (uint32_t)n;
+    } else if (arg == "--compress-min-size" && i + 1 < argc) {
+      uint64_t n = 0;
+      if (!parseUInt(argv[++i], n)) {
+        return false;
+      }
+      config.compressMinSize = (size_t)n;
+    } else if (arg == "--defrag-threshold" && i + 1 < argc) {
+      uint64_t n = 0;
+      if (!parseUInt(argv[++i], n) || n > UINT32_MAX) {
+        return false;
+      }
+      config.defragThreshold = (uint32_t)n;
+    } else if (arg == "--upgrade-socket" && i + 1 < argc) {
+      config.upgradeSocket = argv[++i];
+    } else if (arg == "--takeover") {
+      config.takeover = true;
+    } else {
+      return false;
+    }
+  }
+  return !config.takeover || !config.upgradeSocket.empty();
+}
+
+int64_t nowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t nowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::string formatRatio(double ratio) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.2f", ratio);
+  return buf;
+}
+
+// Resident set size, false if unknown
+bool residentMemory(uint64_t &rss) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) {
+    return false;
+  }
+  unsigned long long size = 0, resident = 0;
+  bool ok = fscanf(f, "%llu %llu", &size, &resident) == 2;
+  fclose(f);
+  rss = resident * (uint64_t)sysconf(_SC_PAGESIZE);
+  return ok;
+}
+
+// Usable bytes of the allocation of a string, none if held inline
+size_t stringBytes(const std::string &s) {
+  if (s.capacity() <= std::string().capacity()) {
+    return 0;
+  }
+  return malloc_usable_size(const_cast<char *>(s.data()));
+}
+
+// Usable bytes of the table and the elements of a collection. A large one
+// is sized from the elements of its first buckets.
+template <typename D> uint64_t collectionBytes(D &dict) {
+  uint64_t bytes = 0, elements = 0, cursor = 0;
+  do {
+    cursor = dict.scan(cursor, [&](const std::string &member, auto &value) {
+      ++elements;
+      bytes += stringBytes(member);
+      if constexpr (std::is_same_v<std::decay_t<decltype(value)>,
+                                   std::string>) {
+        bytes += stringBytes(value);
+      }
+    });
+  } while (cursor != 0 && elements < k_memory_sampled_elements);
+  if (cursor != 0) {
+    bytes = bytes * dict.size() / elements;
+  }
+  return bytes + dict.allocatedBytes();
+}
+
+// Usable bytes allocated for a key and its entry, the keyspace node aside
+uint64_t entryBytes(const std::string &key, Entry &entry) {
+  uint64_t bytes =
+      stringBytes(key) + malloc_usable_size(&entry) + stringBytes(entry.str);
+  if (entry.ext) {
+    bytes += malloc_usable_size(entry.ext.get());
+  }
+  if (entry.set) {
+    bytes += malloc_usable_size(entry.set.get()) + collectionBytes(*entry.set);
+  }
+  if (entry.hash) {
+    bytes +=
+        malloc_usable_size(entry.hash.get()) + collectionBytes(*entry.hash);
+  }
+  return bytes;
+}
+
+double fragRatio(uint64_t rss, uint64_t used) {
+  return used ? (double)rss / (double)used : 0;
+}
+
+// Move the object owned by `owner` to a new allocation, see defragString()
+template <typename T>
+void defragOwned(Defragmenter &defrag, std::unique_ptr<T> &owner) {
+  if (!defrag.shouldMove(owner.get())) {
+    return;
+  }
+  bool kept = false;
+  do {
+    auto copy = std::make_unique<T>(std::move(*owner));
+    kept = defrag.keep(owner.get(), copy.get());
+    if (kept) {
+      owner.swap(copy);
+    } else {
+      *owner = std::move(*copy);
+    }
+    defrag.dispose(std::move(copy));
+  } while (!kept && defrag.retry());
+}
+
+// Move the elements of a collection in the buckets at `cursor`, returns the
+// next cursor like scan()
+uint64_t defragMembers(Defragmenter &defrag, Entry &entry, uint64_t cursor) {
+  if (entry.type == ValueType::SET) {
+    return entry.set->defrag(cursor, defrag,
+                            [](const std::string &, NoValue &) {});
+  }
+  return entry.hash->defrag(
+      cursor, defrag, [&](const std::string &, std::string &value) {
+        defragString(defrag, value);
+      });
+}
+
+size_t unsentBytes(const Connection &conn) {
+  return conn.wqueue_bytes - conn.wqueue_sent + conn.wbuf.size() -
+         conn.wbuf_sent;
+}
+
+bool isSubscriber(const Connection &conn) {
+  return !conn.channels.empty() || !conn.patterns.empty();
+}
+
+// Suspend the coroutine of `conn` until woken for `reason`
+Coro::Suspend waitFor(Connection &conn, WaitFor reason) {
+  conn.wait_for = reason;
+  return {conn.waiting};
+}
+
+// Encode a push frame once, to be shared by every receiver
+std::shared_ptr<const std::string>
+makePush(std::initializer_list<const std::string *> elems) {
+  auto frame = std::make_shared<std::string>();
+  size_t header = Protocol::beginResponse(*frame);
+  Protocol::outPush(*frame, (uint32_t)elems.size());
+  for (const std::string *elem : elems) {
+    Protocol::outStr(*frame, *elem);
+  }
+  Protocol::endResponse(*frame, header);
+  return frame;
+}
+
+// Split "host:port"
+bool parseAddr(const std::string &addr, std::string &host, int &port) {
+  size_t colon = addr.rfind(':');
+  if (colon == std::string::npos || colon == 0) {
+    return false;
+  }
+  host = addr.substr(0, colon);
+  return parsePort(addr.substr(colon + 1), port);
+}
+
+bool parseSlot(const std::string &s, int &slot) {
+  uint64_t v = 0;
+  if (!parseUInt(s, v) || v >= (uint64_t)k_cluster_slots) {
+    return false;
+  }
+  slot = (int)v;
+  return true;
+}
+
+} // namespace Internal
 } // namespace
 //
 
+enum class ReplState {
+  // Not a replica
+  NONE = 0,
+  // Waiting to (re)connect to the primary
+  CONNECT,
+  // PSYNC sent, waiting for the reply
+  HANDSHAKE,
+  // Receiving the snapshot
+  LOADING,
+  // Following the replication stream
+  CONNECTED,
+};
+
+// Slot being moved to another node. Keys are sent in batches on a
+// dedicated link and deleted here once the target acknowledged them.
+struct Migration {
+  int slot = -1;
+  std::string target;
+  ConnectionPtr link;
+  // Keys of the batch in flight, writes to them get TRYAGAIN
+  std::unordered_set<std::string> inflight;
+  // Position in the keys of the slot
+  uint64_t cursor = 0;
+  // Keys of the batch in flight too large to send at once, sent a batch of
+  // members at a time from keyCursor as the link drains
+  std::vector<std::string> unsent;
+  uint64_t keyCursor = 0;
+  // Values of the batch being read from the tier
+  size_t reads = 0;
+  // Replies expected for the batch in flight
+  size_t pendingReplies = 0;
+  // Ownership handover sent, the migration ends with its reply
+  bool finishing = false;
+  uint64_t movedKeys = 0;
+};
+
+// Largest keys of each type seen by one scan of the keyspace, sized in
+// bytes for strings and in elements for sets and hashes
+struct BigKeysReport {
+  std::vector<TopN<std::string>> biggest =
+      std::vector<TopN<std::string>>(3, TopN<std::string>(k_bigkeys_top));
+  uint64_t keys = 0;
+  int64_t finishedMs = 0;
+};
+
+// Values written to the tier by one task. A compaction batch moves values
+// from another segment, each move applies only if the value is still there.
+struct TierBatch {
+  TierSegmentPtr segment;
+  uint64_t offset = 0;
+  std::string data;
+  std::vector<TierStore::Record> records;
+  TierSegmentPtr from;
+  std::vector<uint64_t> fromOffsets;
+};
+
+// What the server we take over from hands over, applied once our copy of
+// the dataset reached `offset` in its replication stream
+struct Handoff {
+  struct Client {
+    uint64_t id = 0;
+    bool importing = false;
+    // Unprocessed input and unsent output
+    std::string input;
+    std::string output;
+    // Commands restoring its subscriptions and tracking mode
+    std::vector<Args> replay;
+  };
+  bool received = false;
+  uint64_t offset = 0;
+  uint64_t nextClientId = 0;
+  // Its own primary if it was a replica
+  std::string primaryHost;
+  int primaryPort = 0;
+  // Slot ranges and slots being imported
+  std::vector<Args> cluster;
+  std::vector<Client> clients;
+  // The listening socket then one per client
+  std::vector<int> fds;
+};
+
+struct CommandSpec;
+
 // Server private implementation
 class ServerImpl {
 public:
-  ServerImpl(const int &port);
+  ServerImpl(const ServerConfig &config);
   ~ServerImpl();
 
   bool init();
@@ -79,14 +778,216 @@ private:
   bool setFDNonBlocking(const int &fd);
   bool acceptNewConn(std::unordered_map<int, ConnectionPtr> &fd2Conn,
                      const int &fd);
+  bool addToEpoll(const int &fd);
+  // Open a non-blocking outbound connection registered in the loop
+  ConnectionPtr connectTo(const std::string &host, const int &port);
+  void closeConn(ConnectionPtr conn);
+  // Write pending output until done or the socket is full, what's left is
+  // sent by the connection's coroutine
+  void flushConn(ConnectionPtr conn);
+  int pollTimeout() const;
+  void serverCron();
+  void beforeSleep();
 
-  bool connectionIO(ConnectionPtr conn);
-  bool stateRequest(ConnectionPtr conn);
-  bool stateResponse(ConnectionPtr conn);
-  bool tryFillBuffer(ConnectionPtr conn);
+  // A coroutine per connection reads, runs the requests and sends the
+  // replies, suspended whenever it has to wait
+  Coro::Task serveConn(ConnectionPtr conn);
+  void startConn(ConnectionPtr conn);
+  // Resume the coroutine of `conn` if it waits for `reason`. Called from
+  // the loop only, never from within a coroutine.
+  void wake(ConnectionPtr conn, WaitFor reason);
+  // Read into rbuf, false on EAGAIN or if the connection ended
+  bool readInput(ConnectionPtr conn);
   bool tryFlushBuffer(ConnectionPtr conn);
 
-  bool doRequest(ConnectionPtr conn);
+  // Run the complete requests in rbuf, waiting for the values they read
+  // from the tier
+  Coro::Task doRequest(ConnectionPtr conn);
+  // Parse the request at `pos` into `cmd`, left there. Replies read on the
+  // links to other servers are handled and skipped. False if there is no
+  // complete request.
+  bool nextRequest(ConnectionPtr conn, size_t &pos, Args &cmd);
+  // Execute a command without waiting, returns the command flags (k_cmd_*)
+  uint32_t doCommand(ConnectionPtr conn, Args &cmd);
+  // Look `cmd` up and check it may run here: arity, subscriber context,
+  // read-only replica, cluster slots. Errors are replied. Returns its spec,
+  // null if unknown, and sets `runnable`.
+  const CommandSpec *checkCommand(ConnectionPtr conn, Args &cmd,
+                                  bool &runnable);
+  // Run a command checkCommand() accepted
+  void runCommand(ConnectionPtr conn, const CommandSpec &spec, Args &cmd);
+  // Cluster mode: reply MOVED, ASK or TRYAGAIN and return false when the
+  // keys of `cmd` must not be served here
+  bool checkSlot(ConnectionPtr conn, const CommandSpec &spec, Args &cmd);
+
+  // Replication
+  void propagate(const char *frame, size_t size);
+  void feedSnapshot(ConnectionPtr replica);
+  void snapshotTiered(ConnectionPtr replica, const std::string &key,
+                      const Entry &entry);
+  // Append the commands recreating `key`, returns how many. A string in the
+  // tier is read with readTiered() instead.
+  size_t serializeEntry(const std::string &key, Entry &entry,
+                        std::string &out);
+  // Append one command adding about k_snapshot_batch members of the set or
+  // hash `key` from `cursor`, counted in `frames`. Returns the next cursor,
+  // 0 when every member was sent.
+  uint64_t serializeMembers(const std::string &key, Entry &entry,
+                            uint64_t cursor, std::string &out,
+                            size_t &frames);
+  void connectToPrimary();
+  void handlePsyncReply(ConnectionPtr conn, const char *data, size_t size);
+  void sendReplAck();
+
+  // Cluster
+  std::string selfAddr() const;
+  void migrateStep();
+  void migrateTiered(const std::string &key, const Entry &entry);
+  void handleMigrationReply(ConnectionPtr conn, const char *data, size_t size);
+  void endMigrationBatch();
+  void abortMigration(const std::string &reason);
+
+  // Pub/Sub
+  // Queue a buffer shared with other connections, the connection is flushed
+  // before sleeping
+  void enqueueShared(const ConnectionPtr &conn,
+                     const std::shared_ptr<const std::string> &frame);
+  void unsubscribeAll(ConnectionPtr conn);
+  // Remove the subscriber at `pos` in the subscribers of `name`
+  void removeSubscriber(const std::string &name, size_t pos, bool patterns);
+
+  // Client side caching
+  void disableTracking(ConnectionPtr conn);
+  // Tell the clients tracking `key` that it changed
+  void invalidateKey(const std::string &key);
+  void invalidateAll();
+  void queueInvalidation(uint64_t id, const std::string &key);
+  // Send the queued invalidations, one push per client
+  void sendInvalidations();
+
+  // Key statistics
+  void bigKeysStep(int64_t now);
+
+  // Active defragmentation
+  // Walk the keyspace for the time budget, adding up the bytes it uses
+  void memoryStep(int64_t now);
+  void startDefrag();
+  // Start a pass when the fragmentation calls for it
+  void defragCheck(int64_t now);
+  // Run a slice of the pass, then return the freed pages to the system
+  // from a worker once it is complete
+  void defragStep();
+  void finishDefrag();
+  // Run for the time budget, true once the pass is complete
+  bool defragSlice();
+  // Move the allocations of a value, deferring large collections
+  void defragEntry(const std::string &key, EntryPtr &entry);
+  // Move some elements of a deferred collection
+  void defragCollection();
+
+  // Tiered storage
+  void tierStep();
+  void writeTierBatch(TierBatch batch);
+  void finishTierWrite(TierBatch &batch, bool ok);
+  void compactSegment(const TierSegmentPtr &segment);
+  void relocateSegment(const TierSegmentPtr &segment, const std::string &data,
+                       bool ok);
+  // Start loading the values of the keys of `cmd` that are in the tier,
+  // false if the connection has to wait for them
+  bool loadValues(ConnectionPtr conn, const CommandSpec &spec,
+                  const Args &cmd);
+  void finishLoad(const std::string &key, const TierSegmentPtr &segment,
+                  uint64_t offset, std::string &value, bool ok);
+  void resumeConn(ConnectionPtr conn);
+
+  // Hot upgrade, see upgrade.h. The running server accepts a successor,
+  // the successor connects to it at init.
+  bool connectPredecessor();
+  bool watchFd(int fd);
+  void acceptSuccessor();
+  void dropUpgradeLink();
+  // Resume serving after a failed upgrade, `why` is logged
+  void abortUpgrade(const char *why);
+  // A message from the other process on the upgrade link
+  void upgradeIO();
+  void upgradeStep();
+  // Stop or resume reading from clients
+  void freezeClients();
+  void thawClients();
+  bool handOff();
+  bool receiveHandoff(const Args &msg);
+  void finishTakeover();
+  // Subscribe or unsubscribe `conn` to the names in `cmd`, `patterns`
+  // selects the pattern subscriptions
+  void subscribe(ConnectionPtr conn, Args &cmd, bool patterns);
+  void unsubscribe(ConnectionPtr conn, Args &cmd, bool patterns);
+
+  // Keyspace helpers
+  Entry *lookupKey(const std::string &key);
+  // Reply WRONGTYPE and return false if entry exists with another type
+  bool checkType(ConnectionPtr conn, Entry *entry, ValueType type);
+  // Return the entry of `key` creating it if needed, null on WRONGTYPE
+  Entry *lookupOrCreate(ConnectionPtr conn, const std::string &key,
+                        ValueType type);
+  // Find the value slot of `key`, inserting an empty one if missing
+  std::pair<EntryPtr *, bool> findOrInsertKey(const std::string &key);
+  // Takes the value, `value` is left with the previous one
+  void setString(const std::string &key, std::string &value);
+  // Reply with the value of a string in memory
+  void outString(std::string &out, const Entry &entry);
+  // The raw value of a string in memory. False if it can't be decompressed.
+  bool readString(const std::string &key, const Entry &entry,
+                  std::string &out);
+  // Read the raw value of a string in the tier on the pool, then call
+  // done(value, ok) on the loop. Unlike loadValues() the value stays in the
+  // tier. A value that can't be read is dropped as by finishLoad().
+  void readTiered(const std::string &key, const Entry &entry,
+                  std::function<void(std::string &, bool)> done);
+  // Add a compressed value in memory to the compress_*_bytes sizes, or
+  // remove it when it is freed, replaced or moved to the tier
+  void countCompressed(const Entry &entry, bool add);
+  bool deleteKey(const std::string &key, bool lazy);
+  void freeEntry(EntryPtr entry, bool lazy);
+  void flushAll(bool lazy);
+
+  // Commands, the reply is appended to conn->wbuf
+  void cmdGet(ConnectionPtr conn, Args &cmd);
+  void cmdSet(ConnectionPtr conn, Args &cmd);
+  void cmdMGet(ConnectionPtr conn, Args &cmd);
+  void cmdMSet(ConnectionPtr conn, Args &cmd);
+  void cmdDel(ConnectionPtr conn, Args &cmd);
+  void cmdUnlink(ConnectionPtr conn, Args &cmd);
+  void cmdSAdd(ConnectionPtr conn, Args &cmd);
+  void cmdSRem(ConnectionPtr conn, Args &cmd);
+  void cmdSCard(ConnectionPtr conn, Args &cmd);
+  void cmdSIsMember(ConnectionPtr conn, Args &cmd);
+  void cmdSMembers(ConnectionPtr conn, Args &cmd);
+  void cmdHSet(ConnectionPtr conn, Args &cmd);
+  void cmdHGet(ConnectionPtr conn, Args &cmd);
+  void cmdHDel(ConnectionPtr conn, Args &cmd);
+  void cmdHLen(ConnectionPtr conn, Args &cmd);
+  void cmdHGetAll(ConnectionPtr conn, Args &cmd);
+  void cmdType(ConnectionPtr conn, Args &cmd);
+  void cmdScan(ConnectionPtr conn, Args &cmd);
+  void cmdHScan(ConnectionPtr conn, Args &cmd);
+  void cmdSScan(ConnectionPtr conn, Args &cmd);
+  void cmdDBSize(ConnectionPtr conn, Args &cmd);
+  void cmdFlushAll(ConnectionPtr conn, Args &cmd);
+  void cmdInfo(ConnectionPtr conn, Args &cmd);
+  void cmdPSync(ConnectionPtr conn, Args &cmd);
+  void cmdReplConf(ConnectionPtr conn, Args &cmd);
+  void cmdReplicaOf(ConnectionPtr conn, Args &cmd);
+  void cmdCluster(ConnectionPtr conn, Args &cmd);
+  void cmdAsking(ConnectionPtr conn, Args &cmd);
+  void cmdSubscribe(ConnectionPtr conn, Args &cmd);
+  void cmdUnsubscribe(ConnectionPtr conn, Args &cmd);
+  void cmdPSubscribe(ConnectionPtr conn, Args &cmd);
+  void cmdPUnsubscribe(ConnectionPtr conn, Args &cmd);
+  void cmdPublish(ConnectionPtr conn, Args &cmd);
+  void cmdClient(ConnectionPtr conn, Args &cmd);
+  void cmdHotKeys(ConnectionPtr conn, Args &cmd);
+  void cmdBigKeys(ConnectionPtr conn, Args &cmd);
+  void cmdDefrag(ConnectionPtr conn, Args &cmd);
 
 private:
   int _port;
@@ -94,11 +995,190 @@ private:
   int _ePollFD;
   std::unordered_map<int, ConnectionPtr> _fd2Conn;
   epoll_event _events[k_max_events];
+  Keyspace _db;
 
   bool _stopped = false;
   std::thread _executor;
+  // Results of the pools' tasks, it outlives them
+  CompletionQueue _completions;
+  ThreadPool _bgPool;
+  size_t _lazyFreed = 0;
+  int64_t _lastCron = 0;
+
+  // Replication, every server has a stream and a backlog so that replicas
+  // can be chained or a replica promoted
+  std::string _replId;
+  ReplBacklog _backlog;
+  std::vector<ConnectionPtr> _replicas;
+  ReplState _replState = ReplState::NONE;
+  std::string _primaryHost;
+  int _primaryPort = 0;
+  ConnectionPtr _primaryConn;
+  int64_t _lastReconnect = 0;
+  int64_t _lastAck = 0;
+  // Replication id and offset announced by FULLRESYNC, adopted once the
+  // snapshot is fully loaded
+  std::string _syncReplId;
+  uint64_t _syncOffset = 0;
+
+  // Cluster mode, slot ownership is assigned by the operator with CLUSTER
+  // ADDSLOTS / SETSLOT and changed by migrations
+  bool _cluster = false;
+  std::string _announceIp;
+  // Address of the owner of each slot, empty if unassigned
+  std::vector<std::string> _slotOwner;
+  // Keys of each slot, used to migrate a slot
+  std::vector<StringSet> _slotKeys;
+  // Slot -> address of the node migrating it to us
+  std::unordered_map<int, std::string> _importing;
+  Migration _migration;
+
+  // Channel or pattern -> subscribers, kept dense so publishing walks a
+  // contiguous array
+  std::unordered_map<std::string, std::vector<ConnectionPtr>> _channels;
+  std::unordered_map<std::string, std::vector<ConnectionPtr>> _patterns;
+  PatternTrie _patternTrie;
+  // Connections with output queued outside of their own requests
+  std::vector<ConnectionPtr> _pendingWrites;
+  uint64_t _slowSubscribers = 0;
+
+  uint64_t _nextClientId = 1;
+  // Clients with tracking enabled, by id
+  std::unordered_map<uint64_t, ConnectionPtr> _trackingClients;
+  TrackingTable _tracking;
+  // Clients with invalidations queued
+  std::vector<ConnectionPtr> _invalidated;
+  uint64_t _trackingEvictions = 0;
+
+  // Sampled on every key access by a command
+  HotKeys _hotKeys;
+  int64_t _lastHotKeysDecay = 0;
+  // The report of the last complete scan, and the one in progress
+  BigKeysReport _bigKeys;
+  BigKeysReport _bigKeysScan;
+  bool _bigKeysScanning = false;
+  uint64_t _bigKeysCursor = 0;
+  int64_t _nextBigKeysScan = 0;
+
+  // Tiered storage, workers read and write the segments and post the
+  // results back to the loop
+  std::string _tierDir;
+  TierStore _tier;
+  size_t _tierMinSize;
+  uint32_t _tierIdleSecs;
+  ThreadPool _tierPool;
+  // Seconds, for the access times of the entries
+  uint32_t _lruClock = 0;
+  uint64_t _tierCursor = 0;
+  size_t _tierWrites = 0;
+  // Key being loaded -> connections waiting for it
+  std::unordered_map<std::string, std::vector<ConnectionPtr>> _tierLoads;
+  TierSegmentPtr _tierCompacting;
+  uint64_t _tierDemoted = 0;
+  uint64_t _tierLoaded = 0;
+  uint64_t _tierLoadErrors = 0;
+  uint64_t _tierCompactions = 0;
+  // Values read for snapshots and migrations
+  uint64_t _tierCopyReads = 0;
+
+  // Value compression, CPU time in ns
+  size_t _compressMinSize;
+  uint64_t _compressed = 0;
+  uint64_t _compressSkipped = 0;
+  // Sizes of the compressed values in memory, see countCompressed()
+  uint64_t _compressRawBytes = 0;
+  uint64_t _compressStoredBytes = 0;
+  uint64_t _compressNs = 0;
+  uint64_t _decompressed = 0;
+  uint64_t _decompressNs = 0;
+
+  // Active defragmentation, a census then the moves in short steps
+  // following a cursor over the keyspace
+  uint32_t _defragThreshold;
+  Defragmenter _defrag;
+  bool _defragRunning = false;
+  // Pass complete, malloc_trim() running on _bgPool
+  bool _defragTrimming = false;
+  bool _defragScanned = false;
+  uint64_t _defragCursor = 0;
+  // Large collections met by the pass, moved bucket by bucket
+  std::vector<std::string> _defragKeys;
+  uint64_t _defragKeyCursor = 0;
+  int64_t _nextDefragCheck = 0;
+  uint64_t _defragRuns = 0;
+  double _defragRatioBefore = 0;
+  double _defragRatioAfter = 0;
+  // Bytes used by the keyspace as of the last complete walk, the
+  // allocations the passes move. Counting every allocation instead would
+  // tax them all, and mallinfo2() holds the arena locks while it walks
+  // every free chunk, tens of ms on a fragmented heap.
+  uint64_t _usedMemory = 0;
+  uint64_t _memoryWalkBytes = 0;
+  bool _memoryWalking = false;
+  uint64_t _memoryCursor = 0;
+  int64_t _nextMemoryWalk = 0;
+
+  // Hot upgrade. The running server listens on _upgradeFd, either side
+  // talks to the other on _upgradeLink.
+  std::string _upgradePath;
+  bool _takeover;
+  int _upgradeFd = -1;
+  int _upgradeLink = -1;
+  // Running side: clients aren't read, the handoff waits for the tier
+  // loads in flight
+  bool _upgradeFrozen = false;
+  bool _handoffPending = false;
+  // Handed off, waiting for "done" from the successor until the deadline
+  bool _handedOff = false;
+  int64_t _handoffDeadline = 0;
+  // Taking over: "ready" sent once in sync, then the handoff
+  bool _upgradeReady = false;
+  Handoff _handoff;
+};
+
+namespace {
+namespace Internal {
+
+// The command modifies the keyspace, it's propagated to replicas and
+// rejected on a replica
+constexpr uint32_t k_cmd_write = 1 << 0;
+// Allowed while the connection has subscriptions
+constexpr uint32_t k_cmd_pubsub = 1 << 1;
+// Reads the values of its keys, those in the tier are loaded first
+constexpr uint32_t k_cmd_loads = 1 << 2;
+
+} // namespace Internal
+} // namespace
+
+using CommandProc = void (ServerImpl::*)(ConnectionPtr, Args &);
+struct CommandSpec {
+  const char *name;
+  // Number of arguments including the command name, negative means at least
+  int arity;
+  uint32_t flags;
+  CommandProc proc;
+  // Position of the keys in the arguments, 0 if the command has none. A
+  // negative last key counts from the end.
+  int firstKey;
+  int lastKey;
+  int keyStep;
 };
 
+namespace {
+// Call fn(key) for each key argument of `cmd`
+template <typename F>
+void forEachKey(const CommandSpec &spec, const Args &cmd, F &&fn) {
+  if (spec.firstKey <= 0) {
+    return;
+  }
+  int argc = (int)cmd.size();
+  int last = spec.lastKey < 0 ? argc + spec.lastKey : spec.lastKey;
+  for (int i = spec.firstKey; i <= last && i < argc; i += spec.keyStep) {
+    fn(cmd[i]);
+  }
+}
+} // namespace
+
 ServerImpl::~ServerImpl() {
   if (_fd > 0) {
     close(_fd);
@@ -111,7 +1191,9 @@ ServerImpl::~ServerImpl() {
   }
 }
 
-Server::Server(const int port) { impl_ = std::make_unique<ServerImpl>(port); }
+Server::Server(const ServerConfig &config) {
+  impl_ = std::make_unique<ServerImpl>(config);
+}
 
 Server::~Server() {
   if (impl_) {
@@ -124,13 +1206,48 @@ bool Server::start() { return impl_->start(); }
 bool Server::stop() { return impl_->stop(); }
 bool Server::deinit() { return impl_->deinit(); }
 
-ServerImpl::ServerImpl(const int &port) : _port(port), _fd(-1) {}
+ServerImpl::ServerImpl(const ServerConfig &config)
+    : _port(config.port), _fd(-1), _bgPool(k_bg_threads),
+      _replId(newReplId()), _backlog(k_repl_backlog_size),
+      _primaryHost(config.primaryHost), _primaryPort(config.primaryPort),
+      _cluster(config.cluster), _announceIp(config.announceIp),
+      _tracking(config.trackingTableMaxKeys),
+      _hotKeys(k_hotkeys_top, k_hotkeys_sample_rate),
+      _tierDir(config.tierDir), _tierMinSize(config.tierMinSize),
+      _tierIdleSecs(config.tierIdleSecs),
+      _tierPool(config.tierDir.empty() ? 0 : k_tier_threads),
+      _compressMinSize(config.compressMinSize),
+      _defragThreshold(config.defragThreshold),
+      _defrag(k_defrag_sparse_ratio), _upgradePath(config.upgradeSocket),
+      _takeover(config.takeover) {
+  if (_takeover) {
+    // The dataset comes from the server we take over, as its replica
+    _primaryHost = "127.0.0.1";
+    _primaryPort = _port;
+  }
+  if (!_primaryHost.empty()) {
+    _replState = ReplState::CONNECT;
+  }
+  if (_cluster) {
+    _slotOwner.resize(k_cluster_slots);
+    _slotKeys.resize(k_cluster_slots);
+  }
+}
 
 bool ServerImpl::init() {
-  _fd = setUpFD();
-  if (_fd < 0) {
-    std::cout << "Error setting up fd" << std::endl;
-    return false;
+  if (_takeover) {
+    // The port is bound by the server we take over, we get its socket
+    if (!connectPredecessor()) {
+      std::cout << "Error reaching the server to take over at "
+                << _upgradePath << std::endl;
+      return false;
+    }
+  } else {
+    _fd = setUpFD();
+    if (_fd < 0) {
+      std::cout << "Error setting up fd" << std::endl;
+      return false;
+    }
   }
   _ePollFD = epoll_create1(0);
   if (_ePollFD < 0) {
@@ -140,13 +1257,39 @@ bool ServerImpl::init() {
   struct epoll_event ev;
   ev.events = EPOLLIN;
   ev.data.fd = _fd;
-  if (epoll_ctl(_ePollFD, EPOLL_CTL_ADD, _fd, &ev) < 0) {
+  if (_fd >= 0 && epoll_ctl(_ePollFD, EPOLL_CTL_ADD, _fd, &ev) < 0) {
     std::cerr << "Failed to add file descriptor to epoll: " << strerror(errno)
               << std::endl;
     close(_fd);
     close(_ePollFD);
     return 1;
   }
+  ev.events = EPOLLIN;
+  ev.data.fd = _completions.fd();
+  if (epoll_ctl(_ePollFD, EPOLL_CTL_ADD, _completions.fd(), &ev) < 0) {
+    std::cerr << "Failed to add completion fd to epoll: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  if (!_tierDir.empty()) {
+    if (!_tier.open(_tierDir, k_tier_segment_size)) {
+      std::cout << "Error opening tier directory " << _tierDir << ": "
+                << strerror(errno) << std::endl;
+      return false;
+    }
+    std::cout << "Tiered storage in " << _tierDir << std::endl;
+  }
+  if (_takeover) {
+    return watchFd(_upgradeLink);
+  }
+  if (!_upgradePath.empty()) {
+    _upgradeFd = Upgrade::listenUnix(_upgradePath);
+    if (_upgradeFd < 0 || !watchFd(_upgradeFd)) {
+      std::cout << "Error listening for upgrades at " << _upgradePath << ": "
+                << strerror(errno) << std::endl;
+      return false;
+    }
+  }
   return true;
 }
 
@@ -154,32 +1297,32 @@ bool ServerImpl::start() {
   _executor = std::thread([&]() {
     while (!_stopped) {
       // std::cout << "Waiting for events..." << std::endl;
-      int nfds = epoll_wait(_ePollFD, _events, k_max_events, 500);
+      int nfds = epoll_wait(_ePollFD, _events, k_max_events, pollTimeout());
 
-      if (nfds < 0) {
+      if (nfds < 0 && errno != EINTR) {
         std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
         break;
       }
 
-      if (nfds == 0) {
-        // std::cout << "epoll_wait timeout..." << std::endl;
-        continue;
-      }
       for (int i = 0; i < nfds; ++i) {
         if (_events[i].data.fd == _fd) {
           acceptNewConn(_fd2Conn, _fd);
-        } else if (_events[i].events & EPOLLIN) {
-          // Handle existing connection
-          auto conn = _fd2Conn[_events[i].data.fd];
-          if (conn) {
-            connectionIO(conn);
-            if (conn->type == ConnectionType::END) {
-              close(conn->fd);
-              _fd2Conn.erase(conn->fd);
-            }
+        } else if (_events[i].data.fd == _completions.fd()) {
+          _completions.run();
+        } else if (_events[i].data.fd == _upgradeFd) {
+          acceptSuccessor();
+        } else if (_events[i].data.fd == _upgradeLink) {
+          upgradeIO();
+        } else {
+          // Handle existing connection, errors are seen by read/write
+          auto it = _fd2Conn.find(_events[i].data.fd);
+          if (it != _fd2Conn.end()) {
+            wake(it->second, WaitFor::SOCKET);
           }
         }
       }
+      serverCron();
+      beforeSleep();
     }
   });
   return true;
@@ -205,27 +1348,32 @@ int ServerImpl::setUpFD() {
                   0); // SOCK_STREAM for TCP
   if (fd < 0) {
     std::cout << "Error creating socket" << std::endl;
-    return 1;
+    return -1;
   }
+  // Allow to restart the server while old connections are in TIME_WAIT
+  int val = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
 
   sockaddr_in addr;
   addr.sin_family = AF_INET; // IPv4
-  addr.sin_port = ntohs(k_port);
+  addr.sin_port = ntohs(_port);
   addr.sin_addr.s_addr = ntohl(0);
   int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
   if (rc < 0) {
-    std::cout << "Error binding to port " << k_port << std::endl;
-    return 1;
+    std::cout << "Error binding to port " << _port << std::endl;
+    close(fd);
+    return -1;
   }
 
   // Set the server fd to non-blocking mode
   setFDNonBlocking(fd);
-  std::cout << "Binding server on port " << k_port << ", fd " << fd
+  std::cout << "Binding server on port " << _port << ", fd " << fd
             << std::endl;
   if (listen(fd, SOMAXCONN) < 0) {
     // SOMAXCONN is the maximum number of pending connections
     std::cout << "Error listening on socket" << std::endl;
-    return 1;
+    close(fd);
+    return -1;
   }
   return fd;
 }
@@ -254,132 +1402,586 @@ bool ServerImpl::acceptNewConn(std::unordered_map<int, ConnectionPtr> &fd2Conn,
                                const int &fd) {
   sockaddr_in client_addr{};
   socklen_t len = sizeof(client_addr);
-  std::cout << "Waiting for new connection\n";
   int connFD = accept(fd, (sockaddr *)&client_addr, &len);
   if (connFD < 0) {
-    // std::cout << "Accept fd failed\n";
     return false;
   }
-
-  std::cout << "Accepted new connection from fd: " << connFD << std::endl;
   if (!setFDNonBlocking(connFD)) {
     std::cout << "Can not set fd to non-blocking mode\n";
     return false;
   }
+  // Pushes are small writes not preceded by a request, don't let Nagle hold
+  // them until the client acknowledges the previous reply
+  int one = 1;
+  setsockopt(connFD, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-  // Add connFD to epoll
-  struct epoll_event ev;
-  ev.events = EPOLLIN | EPOLLET; // Edge-triggered
-  ev.data.fd = connFD;
-  if (epoll_ctl(_ePollFD, EPOLL_CTL_ADD, connFD, &ev) < 0) {
-    std::cerr << "Failed to add file descriptor to epoll: " << strerror(errno)
-              << std::endl;
+  if (!addToEpoll(connFD)) {
     close(connFD);
     return false;
   }
 
   ConnectionPtr conn = std::make_shared<Connection>();
   conn->fd = connFD;
+  conn->id = _nextClientId++;
   conn->type = ConnectionType::REQUEST;
   fd2Conn[conn->fd] = conn;
+  startConn(conn);
 
   return true;
 }
 
-bool ServerImpl::connectionIO(ConnectionPtr conn) {
-  if (conn->type == ConnectionType::REQUEST) {
-    return stateRequest(conn);
-  } else if (conn->type == ConnectionType::RESPOND) {
-    return stateResponse(conn);
+bool ServerImpl::addToEpoll(const int &fd) {
+  // EPOLLOUT is needed to resume a response that hit EAGAIN, edge-triggered
+  // so it only fires when the socket becomes writable
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET; // Edge-triggered
+  ev.data.fd = fd;
+  if (epoll_ctl(_ePollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "Failed to add file descriptor to epoll: " << strerror(errno)
+              << std::endl;
+    return false;
   }
   return true;
 }
 
-bool ServerImpl::stateRequest(ConnectionPtr conn) {
-  // std::cout << "Request state from fd " << conn->fd << std::endl;
-  while (tryFillBuffer(conn)) {
+void ServerImpl::closeConn(ConnectionPtr conn) {
+  if (conn->waiting || conn->handler.done()) {
+    // Not running, otherwise it ends by itself and wake() comes back here
+    conn->waiting = nullptr;
+    conn->handler.reset();
+  }
+  auto it = _fd2Conn.find(conn->fd);
+  if (it == _fd2Conn.end() || it->second != conn) {
+    // Already closed
+    return;
+  }
+  close(conn->fd);
+  _fd2Conn.erase(conn->fd);
+  conn->type = ConnectionType::END;
+  if (conn->is_replica) {
+    std::cout << "Replica on fd " << conn->fd << " disconnected" << std::endl;
+    for (auto it = _replicas.begin(); it != _replicas.end(); ++it) {
+      if (*it == conn) {
+        _replicas.erase(it);
+        break;
+      }
+    }
+  }
+  if (Internal::isSubscriber(*conn)) {
+    unsubscribeAll(conn);
+  }
+  if (conn->tracking) {
+    disableTracking(conn);
+  }
+  if (conn == _migration.link) {
+    abortMigration("lost connection to target");
+  }
+  if (conn == _primaryConn) {
+    std::cout << "Lost connection to primary" << std::endl;
+    _primaryConn.reset();
+    if (_replState != ReplState::NONE) {
+      _replState = ReplState::CONNECT;
+    }
   }
-  return true;
 }
 
-bool ServerImpl::stateResponse(ConnectionPtr conn) {
-  // std::cout << "Response state from fd " << conn->fd << std::endl;
-  while (tryFlushBuffer(conn)) {
+void ServerImpl::flushConn(ConnectionPtr conn) {
+  if (_handedOff && !conn->is_replica && !conn->is_primary &&
+      !conn->is_migration) {
+    // The successor got the output, it's sent from here only if the
+    // upgrade fails
+    return;
+  }
+  while (conn->type != ConnectionType::END &&
+         Internal::unsentBytes(*conn) > 0 && tryFlushBuffer(conn)) {
   }
-  return true;
 }
 
-bool ServerImpl::tryFillBuffer(ConnectionPtr conn) {
-  ssize_t rv = 0;
-  do {
-    size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-    rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-  } while (rv < 0 && errno == EINTR);
-  if (rv < 0 && errno == EAGAIN) {
-    // Hit EAGAIN, stop
-    return false;
+int ServerImpl::pollTimeout() const {
+  if (_defragRunning && !_defragTrimming) {
+    return 0;
   }
-  if (rv == 0) {
-    if (conn->rbuf_size > 0) {
-      std::cout << "Unexpected EOF\n";
-    } else {
-      std::cout << "EOF\n";
+  for (const auto &replica : _replicas) {
+    if (!replica->repl_online) {
+      // A snapshot is being produced, don't sleep
+      return 0;
     }
-    conn->type = ConnectionType::END;
-    return false;
   }
+  return k_cron_interval_ms;
+}
 
-  conn->rbuf_size += (size_t)rv;
+void ServerImpl::serverCron() {
+  int64_t now = Internal::nowMs();
+  if (now - _lastCron < k_cron_interval_ms) {
+    return;
+  }
+  _lastCron = now;
 
-  // Read explanation of pipelining to understand while there is a loop
-  // Because there are many request in a connection (to save latency
-  // from client) while (try_one_req(conn)) {}
-  doRequest(conn);
-  return conn->type == ConnectionType::REQUEST;
-}
+  // Use idle time to finish a pending rehash of the keyspace
+  _db.rehashStep(k_idle_rehash_steps);
 
-bool ServerImpl::doRequest(ConnectionPtr conn) {
-  if (sizeof(conn->rbuf) < 4)
-    return false;
-  size_t len = 0;
-  memcpy(&len, &conn->rbuf[0], 4);
-  if (len > k_max_msg) {
-    std::cout << "Request too long. Length: " << len << std::endl;
-    conn->type = ConnectionType::END;
-    return false;
+  if (_replState == ReplState::CONNECT &&
+      now - _lastReconnect >= k_repl_reconnect_ms) {
+    _lastReconnect = now;
+    connectToPrimary();
   }
-  if (4 + len > conn->rbuf_size) {
-    // There is not enough data in buffer,
-    //   try to read in next iterator
-    return false;
+  if (_replState == ReplState::CONNECTED && now - _lastAck >= k_repl_ack_ms) {
+    _lastAck = now;
+    sendReplAck();
   }
-  printf("Client says: %.*s\n", (int)len, &conn->rbuf[4]);
-
-  conn->rbuf_size = 0;
-  memset(conn->rbuf, 0, sizeof(conn->rbuf));
 
-  std::string message = "Server response kaka";
-  size_t size = message.length();
+  if (now - _lastHotKeysDecay >= k_hotkeys_decay_ms) {
+    _lastHotKeysDecay = now;
+    _hotKeys.decay();
+  }
+  bigKeysStep(now);
+  memoryStep(now);
+  defragCheck(now);
+  if (_handedOff && now >= _handoffDeadline) {
+    abortUpgrade("The successor didn't take over in time");
+  }
 
-  memcpy(&conn->wbuf[0], &size, 4);
-  memcpy(&conn->wbuf[4], message.c_str(), message.length());
-  conn->type = ConnectionType::RESPOND;
-  conn->wbuf_size = size + 4;
-  conn->wbuf_sent = 0;
+  _lruClock = (uint32_t)(now / 1000);
+  tierStep();
+}
 
-  stateResponse(conn);
+void ServerImpl::bigKeysStep(int64_t now) {
+  if (!_bigKeysScanning) {
+    if (now < _nextBigKeysScan) {
+      return;
+    }
+    _bigKeysScan = BigKeysReport();
+    _bigKeysCursor = 0;
+    _bigKeysScanning = true;
+  }
+  // Same cursor as SCAN, keys added meanwhile may be missed and keys moved
+  // by a rehash seen twice, which a report can afford
+  int64_t deadline = Internal::nowUs() + k_bigkeys_budget_us;
+  do {
+    for (size_t i = 0; i < k_bigkeys_buckets_per_check; ++i) {
+      _bigKeysCursor = _db.scan(
+          _bigKeysCursor, [&](const std::string &key, EntryPtr &entry) {
+            ++_bigKeysScan.keys;
+            uint64_t size = entry->ext ? entry->ext->len : entry->str.size();
+            if (entry->type == ValueType::SET) {
+              size = entry->set->size();
+            } else if (entry->type == ValueType::HASH) {
+              size = entry->hash->size();
+            }
+            _bigKeysScan.biggest[(int)entry->type].offer(size, key);
+          });
+      if (_bigKeysCursor == 0) {
+        _bigKeysScan.finishedMs = now;
+        _bigKeys = std::move(_bigKeysScan);
+        _bigKeysScanning = false;
+        _nextBigKeysScan = now + k_bigkeys_interval_ms;
+        return;
+      }
+    }
+  } while (Internal::nowUs() < deadline);
+}
 
-  return conn->type == ConnectionType::REQUEST;
+void ServerImpl::memoryStep(int64_t now) {
+  if (!_memoryWalking) {
+    if (now < _nextMemoryWalk) {
+      return;
+    }
+    _memoryWalkBytes = 0;
+    _memoryCursor = 0;
+    _memoryWalking = true;
+  }
+  // Same cursor as SCAN, the total may be off by the keys written during
+  // the walk
+  int64_t deadline = Internal::nowUs() + k_memory_budget_us;
+  do {
+    for (size_t i = 0; i < k_memory_buckets_per_check; ++i) {
+      _memoryCursor = _db.scan(
+          _memoryCursor, [&](const std::string &key, EntryPtr &entry) {
+            _memoryWalkBytes += Internal::entryBytes(key, *entry);
+          });
+      if (_memoryCursor == 0) {
+        _usedMemory = _memoryWalkBytes + _db.allocatedBytes();
+        _memoryWalking = false;
+        _nextMemoryWalk = now + k_memory_interval_ms;
+        return;
+      }
+    }
+  } while (Internal::nowUs() < deadline);
 }
 
-bool ServerImpl::tryFlushBuffer(ConnectionPtr conn) {
-  ssize_t rv = 0;
-  auto remain = conn->wbuf_size - conn->wbuf_sent;
-  rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-  if (rv < 0 && errno == EAGAIN) {
-    std::cout << "Flush got EAGAIN\n";
-    // Got EAGAIN, stop
-    return false;
+void ServerImpl::startDefrag() {
+  if (_defragRunning) {
+    return;
+  }
+  uint64_t rss = 0;
+  Internal::residentMemory(rss);
+  _defragRatioBefore = Internal::fragRatio(rss, _usedMemory);
+  _defragRunning = true;
+  _defragScanned = false;
+  _defragCursor = 0;
+  _defrag.start(rss);
+  std::cout << "Defragmentation started, fragmentation ratio "
+            << Internal::formatRatio(_defragRatioBefore) << std::endl;
+}
+
+void ServerImpl::defragCheck(int64_t now) {
+  if (_defragRunning || _defragThreshold == 0 || now < _nextDefragCheck) {
+    return;
+  }
+  _nextDefragCheck = now + k_defrag_check_ms;
+  uint64_t rss = 0, used = _usedMemory;
+  if (!Internal::residentMemory(rss) || used == 0 ||
+      rss < used + k_defrag_ignore_bytes ||
+      rss * 100 < used * (100 + (uint64_t)_defragThreshold)) {
+    return;
+  }
+  startDefrag();
+}
+
+void ServerImpl::defragStep() {
+  if (!_defragRunning || _defragTrimming) {
+    return;
+  }
+  bool done = defragSlice();
+  _defrag.flush();
+  if (!done) {
+    return;
+  }
+  // The sparse pages emptied by the moves are returned. malloc_trim()
+  // walks the whole heap, it only needs the allocator's own locks.
+  _defragTrimming = true;
+  _bgPool.submit([this]() {
+    malloc_trim(0);
+    _completions.post([this]() { finishDefrag(); });
+  });
+}
+
+void ServerImpl::finishDefrag() {
+  uint64_t rss = 0;
+  Internal::residentMemory(rss);
+  _defragRatioAfter = Internal::fragRatio(rss, _usedMemory);
+  _defragRunning = false;
+  _defragTrimming = false;
+  ++_defragRuns;
+  _nextDefragCheck = Internal::nowMs() + k_defrag_interval_ms;
+  std::cout << "Defragmentation done, fragmentation ratio "
+            << Internal::formatRatio(_defragRatioBefore) << " -> "
+            << Internal::formatRatio(_defragRatioAfter) << std::endl;
+}
+
+bool ServerImpl::defragSlice() {
+  // The keyspace is walked for the census, then for the moves, see
+  // Defragmenter::nextWalk(). What the moves left over is freed last.
+  int64_t deadline = Internal::nowUs() + k_defrag_budget_us;
+  do {
+    if (!_defragKeys.empty()) {
+      defragCollection();
+      continue;
+    }
+    if (_defragScanned) {
+      if (!_defrag.nextWalk()) {
+        if (_defrag.release(k_defrag_frees_per_check)) {
+          return true;
+        }
+        continue;
+      }
+      _defragScanned = false;
+    }
+    for (size_t i = 0; i < k_defrag_buckets_per_check; ++i) {
+      _defragCursor = _db.defrag(
+          _defragCursor, _defrag,
+          [&](const std::string &key, EntryPtr &entry) {
+            defragEntry(key, entry);
+          });
+      if (_defragCursor == 0) {
+        _defragScanned = true;
+        break;
+      }
+    }
+  } while (Internal::nowUs() < deadline);
+  return false;
+}
+
+void ServerImpl::defragEntry(const std::string &key, EntryPtr &entry) {
+  Internal::defragOwned(_defrag, entry);
+  if (entry->type == ValueType::STRING) {
+    defragString(_defrag, entry->str);
+    return;
+  }
+  if (entry->type == ValueType::SET) {
+    Internal::defragOwned(_defrag, entry->set);
+  } else {
+    Internal::defragOwned(_defrag, entry->hash);
+  }
+  size_t size = entry->type == ValueType::SET ? entry->set->size()
+                                              : entry->hash->size();
+  if (size > k_defrag_big_collection) {
+    _defragKeys.push_back(key);
+    return;
+  }
+  uint64_t cursor = 0;
+  do {
+    cursor = Internal::defragMembers(_defrag, *entry, cursor);
+  } while (cursor != 0);
+}
+
+void ServerImpl::defragCollection() {
+  // Looked up again every step, the key may be gone or replaced meanwhile
+  EntryPtr *entry = _db.find(_defragKeys.back());
+  if (entry && (*entry)->type != ValueType::STRING) {
+    for (size_t i = 0; i < k_defrag_buckets_per_check; ++i) {
+      _defragKeyCursor =
+          Internal::defragMembers(_defrag, **entry, _defragKeyCursor);
+      if (_defragKeyCursor == 0) {
+        break;
+      }
+    }
+    if (_defragKeyCursor != 0) {
+      return;
+    }
+  }
+  _defragKeys.pop_back();
+  _defragKeyCursor = 0;
+}
+
+void ServerImpl::beforeSleep() {
+  if (_migration.slot >= 0) {
+    migrateStep();
+  }
+  defragStep();
+
+  _trackingEvictions += _tracking.evictOverLimit(
+      k_tracking_evictions_per_loop,
+      [&](const std::string &key, uint64_t id) { queueInvalidation(id, key); });
+  sendInvalidations();
+
+  for (auto &conn : _pendingWrites) {
+    conn->pending_write = false;
+    flushConn(conn);
+    if (conn->type == ConnectionType::END) {
+      closeConn(conn);
+    }
+  }
+  _pendingWrites.clear();
+
+  // Copy, closing a replica modifies the list
+  std::vector<ConnectionPtr> replicas = _replicas;
+  for (auto &replica : replicas) {
+    if (!replica->repl_online) {
+      feedSnapshot(replica);
+      if (replica->snapshot_done) {
+        // Send what was written during the snapshot, then follow the stream
+        replica->wbuf.append(replica->repl_pending);
+        replica->repl_pending.clear();
+        replica->repl_pending.shrink_to_fit();
+        replica->repl_online = true;
+        std::cout << "Replica on fd " << replica->fd << " is online"
+                  << std::endl;
+      }
+    }
+    if (Internal::unsentBytes(*replica) + replica->repl_pending.size() >
+        k_replica_output_limit) {
+      std::cout << "Replica on fd " << replica->fd
+                << " is too slow, disconnecting" << std::endl;
+      closeConn(replica);
+      continue;
+    }
+    flushConn(replica);
+    if (replica->type == ConnectionType::END) {
+      closeConn(replica);
+    }
+  }
+
+  upgradeStep();
+}
+
+Coro::Task ServerImpl::serveConn(ConnectionPtr conn) {
+  while (conn->type != ConnectionType::END) {
+    // Serve every complete request in the buffer, the responses are
+    // batched into a single flush. A request may wait for its values to
+    // be loaded in the middle.
+    co_await doRequest(conn);
+    flushConn(conn);
+    if (conn->type == ConnectionType::END) {
+      break;
+    }
+    if (Internal::unsentBytes(*conn) > 0) {
+      // Nothing more is read from a client until it took the replies
+      co_await Internal::waitFor(*conn, WaitFor::SOCKET);
+    } else if (_upgradeFrozen && !conn->is_replica && !conn->is_primary &&
+               !conn->is_migration) {
+      // Frozen for a hot upgrade, the input is left in the socket for the
+      // new process
+      co_await Internal::waitFor(*conn, WaitFor::WAKEUP);
+    } else if (!readInput(conn) && conn->type != ConnectionType::END) {
+      // Edge-triggered, the next event means there is more
+      co_await Internal::waitFor(*conn, WaitFor::SOCKET);
+    }
+  }
+}
+
+void ServerImpl::startConn(ConnectionPtr conn) {
+  // Suspended from the start, the first event on the socket runs it. A
+  // socket just added to epoll is reported writable at least.
+  conn->handler = serveConn(conn);
+  conn->waiting = conn->handler.handle();
+  conn->wait_for = WaitFor::SOCKET;
+}
+
+void ServerImpl::wake(ConnectionPtr conn, WaitFor reason) {
+  if (!conn->waiting || conn->wait_for != reason) {
+    return;
+  }
+  std::exchange(conn->waiting, nullptr).resume();
+  if (conn->type == ConnectionType::END) {
+    closeConn(conn);
+  }
+}
+
+bool ServerImpl::readInput(ConnectionPtr conn) {
+  if (conn->rbuf.size() < conn->rbuf_size + k_read_chunk) {
+    conn->rbuf.resize(conn->rbuf_size + k_read_chunk);
+  }
+  ssize_t rv = 0;
+  do {
+    size_t cap = conn->rbuf.size() - conn->rbuf_size;
+    rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+  } while (rv < 0 && errno == EINTR);
+  if (rv < 0 && errno == EAGAIN) {
+    // Hit EAGAIN, stop
+    return false;
+  }
+  if (rv < 0) {
+    std::cout << "Read error, ec: " << strerror(errno) << std::endl;
+    conn->type = ConnectionType::END;
+    return false;
+  }
+  if (rv == 0) {
+    // Closed by the client, possibly in the middle of a request
+    conn->type = ConnectionType::END;
+    return false;
+  }
+  conn->rbuf_size += (size_t)rv;
+  return true;
+}
+
+Coro::Task ServerImpl::doRequest(ConnectionPtr conn) {
+  using Internal::k_cmd_loads;
+  size_t pos = 0;
+  Args cmd;
+  while (nextRequest(conn, pos, cmd)) {
+    // Decide before executing, the command may change the replication state
+    bool fromStream = conn->is_primary && _replState == ReplState::CONNECTED;
+    bool toReplica = conn->is_replica;
+    bool asking = conn->asking;
+    size_t header = 0;
+    bool runnable = false;
+    const CommandSpec *spec = nullptr;
+    while (true) {
+      header = Protocol::beginResponse(conn->wbuf);
+      spec = checkCommand(conn, cmd, runnable);
+      if (!runnable || !(spec->flags & k_cmd_loads) || !_tier.enabled() ||
+          loadValues(conn, *spec, cmd)) {
+        break;
+      }
+      // Pushes may be queued meanwhile, the response starts after them.
+      // The keys may have moved or changed by then, checked again.
+      conn->wbuf.resize(header);
+      conn->asking = asking;
+      while (conn->pending_loads > 0) {
+        co_await Internal::waitFor(*conn, WaitFor::WAKEUP);
+      }
+    }
+    if (runnable) {
+      runCommand(conn, *spec, cmd);
+    }
+    Protocol::endResponse(conn->wbuf, header);
+
+    // rbuf wasn't touched while waiting, nothing is read meanwhile
+    const char *frame = &conn->rbuf[pos];
+    size_t frameSize = k_header_size + Protocol::readU32(frame);
+    pos += frameSize;
+    if (conn->is_primary) {
+      // Nobody reads replies on the primary link. Every byte of the stream
+      // counts toward the offset, even if the command failed here.
+      conn->wbuf.resize(header);
+      if (fromStream) {
+        propagate(frame, frameSize);
+      }
+    } else if (toReplica) {
+      // Only the stream goes to a replica
+      conn->wbuf.resize(header);
+    } else if (spec && (spec->flags & Internal::k_cmd_write) &&
+               conn->wbuf[header + k_header_size] != SER_ERR) {
+      propagate(frame, frameSize);
+    }
+    // After the reply, a client may be told about its own write
+    sendInvalidations();
+  }
+  if (pos > 0) {
+    memmove(conn->rbuf.data(), &conn->rbuf[pos], conn->rbuf_size - pos);
+    conn->rbuf_size -= pos;
+  }
+}
+
+bool ServerImpl::nextRequest(ConnectionPtr conn, size_t &pos, Args &cmd) {
+  while (true) {
+    if (conn->rbuf_size - pos < k_header_size)
+      return false;
+    size_t len = Protocol::readU32(&conn->rbuf[pos]);
+    if (len > k_max_msg) {
+      std::cout << "Request too long. Length: " << len << std::endl;
+      conn->type = ConnectionType::END;
+      return false;
+    }
+    if (k_header_size + len > conn->rbuf_size - pos) {
+      // There is not enough data in buffer,
+      //   try to read in next iterator
+      return false;
+    }
+
+    const char *frame = &conn->rbuf[pos];
+    size_t frameSize = k_header_size + len;
+    if (conn->is_primary && _replState == ReplState::HANDSHAKE) {
+      // The first frame from the primary is the reply to PSYNC
+      handlePsyncReply(conn, frame + k_header_size, len);
+    } else if (conn->is_migration) {
+      handleMigrationReply(conn, frame + k_header_size, len);
+    } else {
+      cmd.clear();
+      if (!Protocol::parseRequest(frame + k_header_size, len, cmd)) {
+        std::cout << "Bad request" << std::endl;
+        conn->type = ConnectionType::END;
+        return false;
+      }
+      return true;
+    }
+    pos += frameSize;
+    if (conn->type == ConnectionType::END) {
+      return false;
+    }
+  }
+}
+
+bool ServerImpl::tryFlushBuffer(ConnectionPtr conn) {
+  // Shared buffers first, then wbuf, in a single system call
+  iovec iov[k_max_iov];
+  int iovcnt = 0;
+  size_t offset = conn->wqueue_sent;
+  for (size_t i = conn->wqueue_head;
+       i < conn->wqueue.size() && iovcnt < (int)k_max_iov; ++i) {
+    const auto &buf = conn->wqueue[i];
+    iov[iovcnt++] = {(void *)(buf->data() + offset), buf->size() - offset};
+    offset = 0;
+  }
+  if (iovcnt < (int)k_max_iov && conn->wbuf_sent < conn->wbuf.size()) {
+    iov[iovcnt++] = {&conn->wbuf[conn->wbuf_sent],
+                     conn->wbuf.size() - conn->wbuf_sent};
+  }
+  ssize_t rv = writev(conn->fd, iov, iovcnt);
+  if (rv < 0 && errno == EAGAIN) {
+    // Got EAGAIN, stop
+    return false;
   }
   if (rv < 0) {
     std::cout << "Flush error, ec: " << rv << std::endl;
@@ -387,12 +1989,2466 @@ bool ServerImpl::tryFlushBuffer(ConnectionPtr conn) {
     return false;
   }
 
-  conn->wbuf_sent += (ssize_t)rv;
-  if (conn->wbuf_sent == conn->wbuf_size) {
+  size_t written = (size_t)rv;
+  while (written > 0 && conn->wqueue_head < conn->wqueue.size()) {
+    auto &buf = conn->wqueue[conn->wqueue_head];
+    if (written < buf->size() - conn->wqueue_sent) {
+      conn->wqueue_sent += written;
+      written = 0;
+      break;
+    }
+    // Release our reference, the last receiver frees the buffer
+    written -= buf->size() - conn->wqueue_sent;
+    conn->wqueue_bytes -= buf->size();
+    conn->wqueue_sent = 0;
+    buf.reset();
+    ++conn->wqueue_head;
+  }
+  if (conn->wqueue_head == conn->wqueue.size()) {
+    conn->wqueue.clear();
+    conn->wqueue_head = 0;
+  } else if (conn->wqueue_head >= k_max_iov &&
+             conn->wqueue_head * 2 >= conn->wqueue.size()) {
+    // Same for a subscriber that never catches up completely
+    conn->wqueue.erase(conn->wqueue.begin(),
+                       conn->wqueue.begin() + conn->wqueue_head);
+    conn->wqueue_head = 0;
+  }
+  conn->wbuf_sent += written;
+  if (Internal::unsentBytes(*conn) == 0) {
     // Send done
-    std::cout << "Send done, size " << conn->wbuf_size << std::endl;
-    conn->type = ConnectionType::REQUEST;
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+    return false;
+  }
+  if (conn->wbuf_sent >= k_read_chunk &&
+      conn->wbuf_sent * 2 >= conn->wbuf.size()) {
+    // A replica may never fully drain its buffer, drop the sent prefix
+    conn->wbuf.erase(0, conn->wbuf_sent);
+    conn->wbuf_sent = 0;
+  }
+  return true;
+}
+
+uint32_t ServerImpl::doCommand(ConnectionPtr conn, Args &cmd) {
+  bool runnable = false;
+  const CommandSpec *spec = checkCommand(conn, cmd, runnable);
+  if (runnable) {
+    runCommand(conn, *spec, cmd);
+  }
+  return spec ? spec->flags : 0;
+}
+
+const CommandSpec *ServerImpl::checkCommand(ConnectionPtr conn, Args &cmd,
+                                            bool &runnable) {
+  using Internal::k_cmd_loads;
+  using Internal::k_cmd_pubsub;
+  using Internal::k_cmd_write;
+  // clang-format off
+  static const CommandSpec k_commands[] = {
+      {"get", 2, k_cmd_loads, &ServerImpl::cmdGet, 1, 1, 1},
+      {"set", 3, k_cmd_write, &ServerImpl::cmdSet, 1, 1, 1},
+      {"mget", -2, k_cmd_loads, &ServerImpl::cmdMGet, 1, -1, 1},
+      {"mset", -3, k_cmd_write, &ServerImpl::cmdMSet, 1, -1, 2},
+      {"del", -2, k_cmd_write, &ServerImpl::cmdDel, 1, -1, 1},
+      {"unlink", -2, k_cmd_write, &ServerImpl::cmdUnlink, 1, -1, 1},
+      {"sadd", -3, k_cmd_write, &ServerImpl::cmdSAdd, 1, 1, 1},
+      {"srem", -3, k_cmd_write, &ServerImpl::cmdSRem, 1, 1, 1},
+      {"scard", 2, 0, &ServerImpl::cmdSCard, 1, 1, 1},
+      {"sismember", 3, 0, &ServerImpl::cmdSIsMember, 1, 1, 1},
+      {"smembers", 2, 0, &ServerImpl::cmdSMembers, 1, 1, 1},
+      {"hset", -4, k_cmd_write, &ServerImpl::cmdHSet, 1, 1, 1},
+      {"hget", 3, 0, &ServerImpl::cmdHGet, 1, 1, 1},
+      {"hdel", -3, k_cmd_write, &ServerImpl::cmdHDel, 1, 1, 1},
+      {"hlen", 2, 0, &ServerImpl::cmdHLen, 1, 1, 1},
+      {"hgetall", 2, 0, &ServerImpl::cmdHGetAll, 1, 1, 1},
+      {"type", 2, 0, &ServerImpl::cmdType, 1, 1, 1},
+      {"scan", -2, 0, &ServerImpl::cmdScan, 0, 0, 0},
+      {"hscan", -3, 0, &ServerImpl::cmdHScan, 1, 1, 1},
+      {"sscan", -3, 0, &ServerImpl::cmdSScan, 1, 1, 1},
+      {"dbsize", 1, 0, &ServerImpl::cmdDBSize, 0, 0, 0},
+      {"flushall", -1, k_cmd_write, &ServerImpl::cmdFlushAll, 0, 0, 0},
+      {"info", 1, 0, &ServerImpl::cmdInfo, 0, 0, 0},
+      {"psync", 3, 0, &ServerImpl::cmdPSync, 0, 0, 0},
+      {"replconf", -2, 0, &ServerImpl::cmdReplConf, 0, 0, 0},
+      {"replicaof", 3, 0, &ServerImpl::cmdReplicaOf, 0, 0, 0},
+      {"cluster", -2, 0, &ServerImpl::cmdCluster, 0, 0, 0},
+      {"asking", 1, 0, &ServerImpl::cmdAsking, 0, 0, 0},
+      {"subscribe", -2, k_cmd_pubsub, &ServerImpl::cmdSubscribe, 0, 0, 0},
+      {"unsubscribe", -1, k_cmd_pubsub, &ServerImpl::cmdUnsubscribe, 0, 0,
+       0},
+      {"psubscribe", -2, k_cmd_pubsub, &ServerImpl::cmdPSubscribe, 0, 0, 0},
+      {"punsubscribe", -1, k_cmd_pubsub, &ServerImpl::cmdPUnsubscribe, 0, 0,
+       0},
+      {"publish", 3, 0, &ServerImpl::cmdPublish, 0, 0, 0},
+      {"client", -2, 0, &ServerImpl::cmdClient, 0, 0, 0},
+      {"hotkeys", -1, 0, &ServerImpl::cmdHotKeys, 0, 0, 0},
+      {"bigkeys", -1, 0, &ServerImpl::cmdBigKeys, 0, 0, 0},
+      {"defrag", 1, 0, &ServerImpl::cmdDefrag, 0, 0, 0},
+  };
+  // clang-format on
+
+  runnable = false;
+  if (cmd.empty()) {
+    Protocol::outErr(conn->wbuf, "empty command");
+    return nullptr;
+  }
+  for (const auto &spec : k_commands) {
+    if (!Internal::equalsIgnoreCase(cmd[0], spec.name)) {
+      continue;
+    }
+    int argc = (int)cmd.size();
+    if ((spec.arity > 0 && argc != spec.arity) ||
+        (spec.arity < 0 && argc < -spec.arity)) {
+      Protocol::outErr(conn->wbuf, "wrong number of arguments for '" +
+                                       cmd[0] + "'");
+      return &spec;
+    }
+    if (!(spec.flags & k_cmd_pubsub) && Internal::isSubscriber(*conn)) {
+      // A message published meanwhile would be queued in the middle of
+      // the reply, only the subscription commands are allowed
+      Protocol::outErr(conn->wbuf, "only (P)SUBSCRIBE / (P)UNSUBSCRIBE are "
+                                   "allowed in this context");
+      return &spec;
+    }
+    if ((spec.flags & k_cmd_write) && _replState != ReplState::NONE &&
+        !conn->is_primary) {
+      Protocol::outErr(conn->wbuf,
+                       "READONLY You can't write against a read only replica");
+      return &spec;
+    }
+    bool asking = conn->asking;
+    conn->asking = false;
+    if (_cluster && spec.firstKey > 0 && !conn->is_primary) {
+      conn->asking = asking;
+      bool allowed = checkSlot(conn, spec, cmd);
+      conn->asking = false;
+      if (!allowed) {
+        return &spec;
+      }
+    }
+    runnable = true;
+    return &spec;
+  }
+  Protocol::outErr(conn->wbuf, "unknown command '" + cmd[0] + "'");
+  return nullptr;
+}
+
+void ServerImpl::runCommand(ConnectionPtr conn, const CommandSpec &spec,
+                            Args &cmd) {
+  using Internal::k_cmd_write;
+  (this->*spec.proc)(conn, cmd);
+  forEachKey(spec, cmd,
+             [&](const std::string &key) { _hotKeys.record(key); });
+  if (spec.flags & k_cmd_write) {
+    forEachKey(spec, cmd,
+               [&](const std::string &key) { invalidateKey(key); });
+  } else if (conn->tracking && !conn->tracking_bcast) {
+    forEachKey(spec, cmd, [&](const std::string &key) {
+      _tracking.track(key, conn->id);
+    });
+  }
+}
+
+Entry *ServerImpl::lookupKey(const std::string &key) {
+  EntryPtr *entry = _db.find(key);
+  if (!entry) {
+    return nullptr;
+  }
+  (*entry)->atime = _lruClock;
+  return entry->get();
+}
+
+bool ServerImpl::checkType(ConnectionPtr conn, Entry *entry, ValueType type) {
+  if (entry && entry->type != type) {
+    Protocol::outErr(conn->wbuf, "WRONGTYPE");
+    return false;
+  }
+  return true;
+}
+
+bool ServerImpl::checkSlot(ConnectionPtr conn, const CommandSpec &spec,
+                           Args &cmd) {
+  int slot = -1;
+  bool crossSlot = false;
+  size_t keys = 0;
+  size_t present = 0;
+  bool inflight = false;
+  forEachKey(spec, cmd, [&](const std::string &key) {
+    int keySlot = Cluster::keyHashSlot(key);
+    crossSlot |= slot >= 0 && keySlot != slot;
+    slot = keySlot;
+    ++keys;
+    present += _db.find(key) != nullptr;
+    inflight |= _migration.inflight.count(key) > 0;
+  });
+  if (crossSlot) {
+    Protocol::outErr(conn->wbuf, "CROSSSLOT Keys don't hash to the same slot");
+    return false;
+  }
+  if (slot < 0) {
+    return true;
+  }
+
+  const std::string &owner = _slotOwner[slot];
+  std::string self = selfAddr();
+  if (owner != self) {
+    auto importing = _importing.find(slot);
+    if (importing != _importing.end() && (conn->asking || conn->importing)) {
+      return true;
+    }
+    if (owner.empty()) {
+      Protocol::outErr(conn->wbuf, "CLUSTERDOWN Hash slot not served");
+    } else {
+      Protocol::outErr(conn->wbuf,
+                       "MOVED " + std::to_string(slot) + " " + owner);
+    }
+    return false;
+  }
+  if (_migration.slot == slot) {
+    if (inflight && (spec.flags & Internal::k_cmd_write)) {
+      // The key is being copied, a write now could be lost
+      Protocol::outErr(conn->wbuf, "TRYAGAIN Key is being migrated");
+      return false;
+    }
+    if (present == 0) {
+      // Already moved, or new keys: they belong to the target now
+      Protocol::outErr(conn->wbuf, "ASK " + std::to_string(slot) + " " +
+                                       _migration.target);
+      return false;
+    }
+    if (present < keys) {
+      // Split between the two nodes, neither can serve it until the slot
+      // moved
+      Protocol::outErr(conn->wbuf,
+                       "TRYAGAIN Multiple keys request during migration");
+      return false;
+    }
+  }
+  return true;
+}
+
+std::pair<EntryPtr *, bool>
+ServerImpl::findOrInsertKey(const std::string &key) {
+  auto result = _db.findOrInsert(key);
+  if (result.second && _cluster) {
+    _slotKeys[Cluster::keyHashSlot(key)].findOrInsert(key);
+  }
+  return result;
+}
+
+Entry *ServerImpl::lookupOrCreate(ConnectionPtr conn, const std::string &key,
+                                  ValueType type) {
+  auto [slot, inserted] = findOrInsertKey(key);
+  if (inserted) {
+    *slot = std::make_unique<Entry>();
+    (*slot)->type = type;
+    if (type == ValueType::SET) {
+      (*slot)->set = std::make_unique<StringSet>();
+    } else if (type == ValueType::HASH) {
+      (*slot)->hash = std::make_unique<StringMap>();
+    }
+  }
+  if (!checkType(conn, slot->get(), type)) {
+    return nullptr;
+  }
+  return slot->get();
+}
+
+bool ServerImpl::deleteKey(const std::string &key, bool lazy) {
+  EntryPtr entry;
+  if (!_db.erase(key, &entry)) {
+    return false;
+  }
+  if (_cluster) {
+    _slotKeys[Cluster::keyHashSlot(key)].erase(key);
+  }
+  freeEntry(std::move(entry), lazy);
+  return true;
+}
+
+void ServerImpl::countCompressed(const Entry &entry, bool add) {
+  if (!entry.compressed || entry.ext) {
+    return;
+  }
+  uint64_t raw = Lz::blobRawSize(entry.str);
+  if (add) {
+    _compressRawBytes += raw;
+    _compressStoredBytes += entry.str.size();
+  } else {
+    _compressRawBytes -= raw;
+    _compressStoredBytes -= entry.str.size();
+  }
+}
+
+void ServerImpl::freeEntry(EntryPtr entry, bool lazy) {
+  countCompressed(*entry, false);
+  if (!lazy || Internal::freeEffort(*entry) <= k_lazy_free_threshold) {
+    // Cheap enough to free inline
+    return;
+  }
+  ++_lazyFreed;
+  std::shared_ptr<Entry> owned = std::move(entry);
+  _bgPool.submit([owned = std::move(owned)]() mutable { owned.reset(); });
+}
+
+void ServerImpl::flushAll(bool lazy) {
+  invalidateAll();
+  _compressRawBytes = 0;
+  _compressStoredBytes = 0;
+  if (_cluster) {
+    for (auto &keys : _slotKeys) {
+      keys.clear();
+    }
+  }
+  if (!lazy) {
+    _db.clear();
+    return;
+  }
+  // Hand the whole table over, the loop continues with an empty one
+  auto old = std::make_shared<Keyspace>(std::move(_db));
+  ++_lazyFreed;
+  _bgPool.submit([old = std::move(old)]() mutable { old.reset(); });
+}
+
+void ServerImpl::cmdGet(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!entry) {
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  if (!checkType(conn, entry, ValueType::STRING)) {
+    return;
+  }
+  outString(conn->wbuf, *entry);
+}
+
+void ServerImpl::cmdSet(ConnectionPtr conn, Args &cmd) {
+  setString(cmd[1], cmd[2]);
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::cmdMGet(ConnectionPtr conn, Args &cmd) {
+  // Nil for a missing key or one that isn't a string
+  Protocol::outArr(conn->wbuf, (uint32_t)(cmd.size() - 1));
+  for (size_t i = 1; i < cmd.size(); ++i) {
+    Entry *entry = lookupKey(cmd[i]);
+    if (entry && entry->type == ValueType::STRING) {
+      outString(conn->wbuf, *entry);
+    } else {
+      Protocol::outNil(conn->wbuf);
+    }
+  }
+}
+
+void ServerImpl::cmdMSet(ConnectionPtr conn, Args &cmd) {
+  if (cmd.size() % 2 == 0) {
+    Protocol::outErr(conn->wbuf, "wrong number of arguments for 'mset'");
+    return;
+  }
+  for (size_t i = 1; i < cmd.size(); i += 2) {
+    setString(cmd[i], cmd[i + 1]);
+  }
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::setString(const std::string &key, std::string &value) {
+  EntryPtr &slot = *findOrInsertKey(key).first;
+  if (slot && slot->type != ValueType::STRING) {
+    // Overwriting a collection, it may be huge
+    freeEntry(std::move(slot), true);
+  }
+  if (!slot) {
+    slot = std::make_unique<Entry>();
+  }
+  countCompressed(*slot, false);
+  slot->ext.reset();
+  slot->atime = _lruClock;
+  slot->compressed = false;
+  if (_compressMinSize == 0 || value.size() < _compressMinSize) {
+    slot->str.swap(value);
+    return;
+  }
+  int64_t start = Internal::nowNs();
+  std::string blob;
+  size_t limit = (size_t)((double)value.size() * k_compress_max_ratio);
+  if (Lz::compressBlob(value, blob, limit)) {
+    slot->str.swap(blob);
+    slot->compressed = true;
+    countCompressed(*slot, true);
+    ++_compressed;
+  } else {
+    // Not worth decompressing on every read
+    slot->str.swap(value);
+    ++_compressSkipped;
+  }
+  _compressNs += Internal::nowNs() - start;
+}
+
+void ServerImpl::outString(std::string &out, const Entry &entry) {
+  if (!entry.compressed) {
+    Protocol::outStr(out, entry.str);
+    return;
+  }
+  // Decompressed straight into the reply
+  int64_t start = Internal::nowNs();
+  size_t rawSize = Lz::blobRawSize(entry.str);
+  size_t pos = out.size();
+  out.push_back(SER_STR);
+  Protocol::appendU32(out, (uint32_t)rawSize);
+  out.resize(out.size() + rawSize);
+  if (!Lz::decompressBlob(entry.str, &out[out.size() - rawSize])) {
+    out.resize(pos);
+    Protocol::outErr(out, "corrupt compressed value");
+  }
+  ++_decompressed;
+  _decompressNs += Internal::nowNs() - start;
+}
+
+bool ServerImpl::readString(const std::string &key, const Entry &entry,
+                            std::string &out) {
+  if (!entry.compressed) {
+    out = entry.str;
+    return true;
+  }
+  out.resize(Lz::blobRawSize(entry.str));
+  if (!Lz::decompressBlob(entry.str, &out[0])) {
+    std::cout << "Corrupt compressed value for " << key << std::endl;
     return false;
   }
   return true;
 }
+
+void ServerImpl::cmdDel(ConnectionPtr conn, Args &cmd) {
+  int64_t deleted = 0;
+  for (size_t i = 1; i < cmd.size(); ++i) {
+    deleted += deleteKey(cmd[i], false);
+  }
+  Protocol::outInt(conn->wbuf, deleted);
+}
+
+void ServerImpl::cmdUnlink(ConnectionPtr conn, Args &cmd) {
+  int64_t deleted = 0;
+  for (size_t i = 1; i < cmd.size(); ++i) {
+    deleted += deleteKey(cmd[i], true);
+  }
+  Protocol::outInt(conn->wbuf, deleted);
+}
+
+void ServerImpl::cmdSAdd(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupOrCreate(conn, cmd[1], ValueType::SET);
+  if (!entry) {
+    return;
+  }
+  int64_t added = 0;
+  for (size_t i = 2; i < cmd.size(); ++i) {
+    added += entry->set->findOrInsert(cmd[i]).second;
+  }
+  Protocol::outInt(conn->wbuf, added);
+}
+
+void ServerImpl::cmdSRem(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::SET)) {
+    return;
+  }
+  int64_t removed = 0;
+  for (size_t i = 2; entry && i < cmd.size(); ++i) {
+    removed += entry->set->erase(cmd[i]);
+  }
+  if (entry && entry->set->empty()) {
+    deleteKey(cmd[1], false);
+  }
+  Protocol::outInt(conn->wbuf, removed);
+}
+
+void ServerImpl::cmdSCard(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::SET)) {
+    return;
+  }
+  Protocol::outInt(conn->wbuf, entry ? (int64_t)entry->set->size() : 0);
+}
+
+void ServerImpl::cmdSIsMember(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::SET)) {
+    return;
+  }
+  Protocol::outInt(conn->wbuf, entry && entry->set->find(cmd[2]) ? 1 : 0);
+}
+
+void ServerImpl::cmdSMembers(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::SET)) {
+    return;
+  }
+  if (!entry) {
+    Protocol::outArr(conn->wbuf, 0);
+    return;
+  }
+  Protocol::outArr(conn->wbuf, (uint32_t)entry->set->size());
+  entry->set->forEach([&](const std::string &member, NoValue &) {
+    Protocol::outStr(conn->wbuf, member);
+  });
+}
+
+void ServerImpl::cmdHSet(ConnectionPtr conn, Args &cmd) {
+  if (cmd.size() % 2 != 0) {
+    Protocol::outErr(conn->wbuf, "wrong number of arguments for 'hset'");
+    return;
+  }
+  Entry *entry = lookupOrCreate(conn, cmd[1], ValueType::HASH);
+  if (!entry) {
+    return;
+  }
+  int64_t added = 0;
+  for (size_t i = 2; i < cmd.size(); i += 2) {
+    auto [value, inserted] = entry->hash->findOrInsert(cmd[i]);
+    value->swap(cmd[i + 1]);
+    added += inserted;
+  }
+  Protocol::outInt(conn->wbuf, added);
+}
+
+void ServerImpl::cmdHGet(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::HASH)) {
+    return;
+  }
+  std::string *value = entry ? entry->hash->find(cmd[2]) : nullptr;
+  if (!value) {
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  Protocol::outStr(conn->wbuf, *value);
+}
+
+void ServerImpl::cmdHDel(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::HASH)) {
+    return;
+  }
+  int64_t removed = 0;
+  for (size_t i = 2; entry && i < cmd.size(); ++i) {
+    removed += entry->hash->erase(cmd[i]);
+  }
+  if (entry && entry->hash->empty()) {
+    deleteKey(cmd[1], false);
+  }
+  Protocol::outInt(conn->wbuf, removed);
+}
+
+void ServerImpl::cmdHLen(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::HASH)) {
+    return;
+  }
+  Protocol::outInt(conn->wbuf, entry ? (int64_t)entry->hash->size() : 0);
+}
+
+void ServerImpl::cmdHGetAll(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::HASH)) {
+    return;
+  }
+  if (!entry) {
+    Protocol::outArr(conn->wbuf, 0);
+    return;
+  }
+  Protocol::outArr(conn->wbuf, (uint32_t)entry->hash->size() * 2);
+  entry->hash->forEach([&](const std::string &field, std::string &value) {
+    Protocol::outStr(conn->wbuf, field);
+    Protocol::outStr(conn->wbuf, value);
+  });
+}
+
+void ServerImpl::cmdType(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  Protocol::outStr(conn->wbuf,
+                   entry ? Internal::typeName(entry->type) : "none");
+}
+
+namespace {
+namespace Internal {
+
+struct ScanOptions {
+  uint64_t cursor = 0;
+  size_t count = k_scan_default_count;
+  std::string pattern;
+  std::string type;
+};
+
+// Parse "cursor [MATCH pattern] [COUNT count] [TYPE type]" from cmd[first]
+bool parseScanOptions(Args &cmd, size_t first, bool allowType,
+                      ScanOptions &opts, std::string &err) {
+  if (!parseUInt(cmd[first], opts.cursor)) {
+    err = "invalid cursor";
+    return false;
+  }
+  for (size_t i = first + 1; i < cmd.size(); i += 2) {
+    if (i + 1 >= cmd.size()) {
+      err = "syntax error";
+      return false;
+    }
+    if (equalsIgnoreCase(cmd[i], "match")) {
+      opts.pattern = cmd[i + 1];
+    } else if (equalsIgnoreCase(cmd[i], "count")) {
+      uint64_t count = 0;
+      if (!parseUInt(cmd[i + 1], count) || count == 0) {
+        err = "value is not an integer or out of range";
+        return false;
+      }
+      opts.count = std::min<uint64_t>(count, k_scan_max_count);
+    } else if (allowType && equalsIgnoreCase(cmd[i], "type")) {
+      opts.type = cmd[i + 1];
+    } else {
+      err = "syntax error";
+      return false;
+    }
+  }
+  return true;
+}
+
+// Run one bounded SCAN step over `dict`: visit buckets until `count`
+// elements are collected, the iteration ends or the visit budget is spent.
+// The budget keeps the work per call bounded when few elements match.
+template <typename Map, typename Collect>
+uint64_t scanDict(Map &dict, const ScanOptions &opts, Collect &&collect) {
+  uint64_t cursor = opts.cursor;
+  size_t collected = 0;
+  size_t maxVisits = opts.count > SIZE_MAX / k_scan_max_visits_factor
+                         ? SIZE_MAX
+                         : opts.count * k_scan_max_visits_factor;
+  size_t visits = 0;
+  do {
+    cursor = dict.scan(cursor, [&](const auto &key, auto &value) {
+      collected += collect(key, value);
+    });
+  } while (cursor != 0 && collected < opts.count && ++visits < maxVisits);
+  return cursor;
+}
+
+bool matchPattern(const ScanOptions &opts, const std::string &key) {
+  return opts.pattern.empty() || opts.pattern == "*" ||
+         globMatch(opts.pattern.data(), opts.pattern.size(), key.data(),
+                   key.size());
+}
+
+} // namespace Internal
+} // namespace
+
+void ServerImpl::cmdScan(ConnectionPtr conn, Args &cmd) {
+  Internal::ScanOptions opts;
+  std::string err;
+  if (!Internal::parseScanOptions(cmd, 1, true, opts, err)) {
+    Protocol::outErr(conn->wbuf, err);
+    return;
+  }
+  std::vector<const std::string *> keys;
+  uint64_t cursor = Internal::scanDict(
+      _db, opts, [&](const std::string &key, EntryPtr &entry) {
+        if (!opts.type.empty() &&
+            !Internal::equalsIgnoreCase(opts.type,
+                                        Internal::typeName(entry->type))) {
+          return 0;
+        }
+        if (!Internal::matchPattern(opts, key)) {
+          return 0;
+        }
+        keys.push_back(&key);
+        return 1;
+      });
+
+  Protocol::outArr(conn->wbuf, 2);
+  Protocol::outStr(conn->wbuf, std::to_string(cursor));
+  Protocol::outArr(conn->wbuf, (uint32_t)keys.size());
+  for (const std::string *key : keys) {
+    Protocol::outStr(conn->wbuf, *key);
+  }
+}
+
+void ServerImpl::cmdHScan(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::HASH)) {
+    return;
+  }
+  Internal::ScanOptions opts;
+  std::string err;
+  if (!Internal::parseScanOptions(cmd, 2, false, opts, err)) {
+    Protocol::outErr(conn->wbuf, err);
+    return;
+  }
+  std::vector<std::pair<const std::string *, const std::string *>> fields;
+  uint64_t cursor = 0;
+  if (entry) {
+    cursor = Internal::scanDict(
+        *entry->hash, opts,
+        [&](const std::string &field, std::string &value) {
+          if (!Internal::matchPattern(opts, field)) {
+            return 0;
+          }
+          fields.emplace_back(&field, &value);
+          return 1;
+        });
+  }
+
+  Protocol::outArr(conn->wbuf, 2);
+  Protocol::outStr(conn->wbuf, std::to_string(cursor));
+  Protocol::outArr(conn->wbuf, (uint32_t)fields.size() * 2);
+  for (const auto &[field, value] : fields) {
+    Protocol::outStr(conn->wbuf, *field);
+    Protocol::outStr(conn->wbuf, *value);
+  }
+}
+
+void ServerImpl::cmdSScan(ConnectionPtr conn, Args &cmd) {
+  Entry *entry = lookupKey(cmd[1]);
+  if (!checkType(conn, entry, ValueType::SET)) {
+    return;
+  }
+  Internal::ScanOptions opts;
+  std::string err;
+  if (!Internal::parseScanOptions(cmd, 2, false, opts, err)) {
+    Protocol::outErr(conn->wbuf, err);
+    return;
+  }
+  std::vector<const std::string *> members;
+  uint64_t cursor = 0;
+  if (entry) {
+    cursor = Internal::scanDict(
+        *entry->set, opts, [&](const std::string &member, NoValue &) {
+          if (!Internal::matchPattern(opts, member)) {
+            return 0;
+          }
+          members.push_back(&member);
+          return 1;
+        });
+  }
+
+  Protocol::outArr(conn->wbuf, 2);
+  Protocol::outStr(conn->wbuf, std::to_string(cursor));
+  Protocol::outArr(conn->wbuf, (uint32_t)members.size());
+  for (const std::string *member : members) {
+    Protocol::outStr(conn->wbuf, *member);
+  }
+}
+
+void ServerImpl::cmdDBSize(ConnectionPtr conn, Args &) {
+  Protocol::outInt(conn->wbuf, (int64_t)_db.size());
+}
+
+void ServerImpl::cmdFlushAll(ConnectionPtr conn, Args &cmd) {
+  bool lazy = false;
+  if (cmd.size() == 2 && Internal::equalsIgnoreCase(cmd[1], "async")) {
+    lazy = true;
+  } else if (cmd.size() == 2 && Internal::equalsIgnoreCase(cmd[1], "sync")) {
+    lazy = false;
+  } else if (cmd.size() != 1) {
+    Protocol::outErr(conn->wbuf, "syntax error");
+    return;
+  }
+  flushAll(lazy);
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::cmdInfo(ConnectionPtr conn, Args &) {
+  std::string info;
+  info += "keys:" + std::to_string(_db.size()) + "\n";
+  info += "connected_clients:" + std::to_string(_fd2Conn.size()) + "\n";
+  info += "coro_frame_bytes:" +
+          std::to_string(Coro::FramePool::local().reserved()) + "\n";
+  info += "lazyfree_submitted:" + std::to_string(_lazyFreed) + "\n";
+  info += "lazyfree_pending:" + std::to_string(_bgPool.pending()) + "\n";
+
+  info += "role:";
+  info += _replState == ReplState::NONE ? "primary\n" : "replica\n";
+  info += "repl_id:" + _replId + "\n";
+  info += "repl_offset:" + std::to_string(_backlog.endOffset()) + "\n";
+  info +=
+      "repl_backlog_start:" + std::to_string(_backlog.startOffset()) + "\n";
+  if (_replState != ReplState::NONE) {
+    info += "primary:" + _primaryHost + ":" + std::to_string(_primaryPort) +
+            "\n";
+    info += "primary_link:";
+    info += _replState == ReplState::CONNECTED ? "up\n"
+            : _replState == ReplState::LOADING ? "loading\n"
+                                               : "down\n";
+  }
+  info += "connected_replicas:" + std::to_string(_replicas.size()) + "\n";
+  for (size_t i = 0; i < _replicas.size(); ++i) {
+    const auto &replica = _replicas[i];
+    info += "replica" + std::to_string(i) +
+            ":fd=" + std::to_string(replica->fd) +
+            ",state=" + (replica->repl_online ? "online" : "sync") +
+            ",ack_offset=" + std::to_string(replica->repl_ack_offset) +
+            ",unsent=" + std::to_string(Internal::unsentBytes(*replica)) +
+            "\n";
+  }
+
+  if (_cluster) {
+    std::string self = selfAddr();
+    size_t owned = 0;
+    for (const auto &owner : _slotOwner) {
+      owned += owner == self;
+    }
+    info += "cluster_node:" + self + "\n";
+    info += "cluster_slots_owned:" + std::to_string(owned) + "\n";
+    info += "cluster_importing:" + std::to_string(_importing.size()) + "\n";
+    if (_migration.slot >= 0) {
+      info += "cluster_migrating:" + std::to_string(_migration.slot) + "->" +
+              _migration.target +
+              ",moved=" + std::to_string(_migration.movedKeys) +
+              ",left=" + std::to_string(_slotKeys[_migration.slot].size()) +
+              ",unsent=" +
+              std::to_string(Internal::unsentBytes(*_migration.link)) + "\n";
+    }
+  }
+
+  info += "pubsub_channels:" + std::to_string(_channels.size()) + "\n";
+  info += "pubsub_patterns:" + std::to_string(_patterns.size()) + "\n";
+  info += "pubsub_slow_subscribers_dropped:" +
+          std::to_string(_slowSubscribers) + "\n";
+  info += "tracking_clients:" + std::to_string(_trackingClients.size()) + "\n";
+  info += "tracking_keys:" + std::to_string(_tracking.keys()) + "\n";
+  info += "tracking_prefixes:" + std::to_string(_tracking.prefixes()) + "\n";
+  info += "tracking_evicted_keys:" + std::to_string(_trackingEvictions) + "\n";
+  info += "bigkeys_scan:";
+  info += _bigKeysScanning ? "running\n" : "idle\n";
+  info += "bigkeys_last_scan_keys:" + std::to_string(_bigKeys.keys) + "\n";
+  if (_tier.enabled()) {
+    info += "tier_segments:" + std::to_string(_tier.segments()) + "\n";
+    info += "tier_disk_bytes:" + std::to_string(_tier.diskBytes()) + "\n";
+    info += "tier_live_bytes:" + std::to_string(_tier.liveBytes()) + "\n";
+    info += "tier_demoted:" + std::to_string(_tierDemoted) + "\n";
+    info += "tier_loaded:" + std::to_string(_tierLoaded) + "\n";
+    info += "tier_load_errors:" + std::to_string(_tierLoadErrors) + "\n";
+    info += "tier_loads_in_flight:" + std::to_string(_tierLoads.size()) + "\n";
+    info += "tier_compactions:" + std::to_string(_tierCompactions) + "\n";
+    info += "tier_copy_reads:" + std::to_string(_tierCopyReads) + "\n";
+  }
+  uint64_t rss = 0;
+  Internal::residentMemory(rss);
+  info += "used_memory:" + std::to_string(_usedMemory) + "\n";
+  info += "used_memory_rss:" + std::to_string(rss) + "\n";
+  info += "mem_fragmentation_ratio:" +
+          Internal::formatRatio(Internal::fragRatio(rss, _usedMemory)) +
+          "\n";
+  info += "defrag_running:" + std::to_string(_defragRunning) + "\n";
+  info += "defrag_runs:" + std::to_string(_defragRuns) + "\n";
+  info += "defrag_moved:" + std::to_string(_defrag.moved()) + "\n";
+  info += "defrag_rejected:" + std::to_string(_defrag.rejected()) + "\n";
+  info += "defrag_last_ratio_before:" +
+          Internal::formatRatio(_defragRatioBefore) + "\n";
+  info += "defrag_last_ratio_after:" +
+          Internal::formatRatio(_defragRatioAfter) + "\n";
+  if (_compressMinSize > 0) {
+    double ratio = _compressStoredBytes ? (double)_compressRawBytes /
+                                              (double)_compressStoredBytes
+                                        : 1.0;
+    info += "compress_values:" + std::to_string(_compressed) + "\n";
+    info += "compress_skipped:" + std::to_string(_compressSkipped) + "\n";
+    info += "compress_raw_bytes:" + std::to_string(_compressRawBytes) + "\n";
+    info +=
+        "compress_stored_bytes:" + std::to_string(_compressStoredBytes) + "\n";
+    info += "compress_saved_bytes:" +
+            std::to_string(_compressRawBytes - _compressStoredBytes) + "\n";
+    info += "compress_ratio:" + Internal::formatRatio(ratio) + "\n";
+    info += "compress_cpu_us:" + std::to_string(_compressNs / 1000) + "\n";
+    info += "decompress_values:" + std::to_string(_decompressed) + "\n";
+    info += "decompress_cpu_us:" + std::to_string(_decompressNs / 1000) + "\n";
+  }
+  Protocol::outStr(conn->wbuf, info);
+}
+
+void ServerImpl::propagate(const char *frame, size_t size) {
+  _backlog.append(frame, size);
+  for (auto &replica : _replicas) {
+    if (replica->repl_online) {
+      replica->wbuf.append(frame, size);
+    } else {
+      replica->repl_pending.append(frame, size);
+    }
+  }
+}
+
+void ServerImpl::feedSnapshot(ConnectionPtr replica) {
+  // The snapshot is produced by scanning the live keyspace a few buckets at
+  // a time, large sets and hashes a batch of members at a time. Writes made
+  // meanwhile are held in repl_pending and sent after it. Replaying them on
+  // top of a partially newer snapshot is safe because each write sets the
+  // state of what it names: SET and DEL replace a key, SADD/SREM and
+  // HSET/HDEL add or remove the members given. None adjusts a value, a write
+  // the snapshot already reflects leaves it as it is.
+  size_t steps = k_snapshot_buckets_per_step;
+  while (!replica->snapshot_done && steps-- > 0 &&
+         Internal::unsentBytes(*replica) < k_snapshot_output_watermark) {
+    if (!replica->snapshot_keys.empty()) {
+      // Looked up again every step, the key may be gone or replaced
+      // meanwhile. What was sent of it is then fixed by the replayed writes.
+      const std::string &key = replica->snapshot_keys.back();
+      EntryPtr *entry = _db.find(key);
+      size_t frames = 0;
+      if (entry && (*entry)->type != ValueType::STRING) {
+        replica->snapshot_key_cursor = serializeMembers(
+            key, **entry, replica->snapshot_key_cursor, replica->wbuf, frames);
+        if (replica->snapshot_key_cursor != 0) {
+          continue;
+        }
+      }
+      replica->snapshot_keys.pop_back();
+      replica->snapshot_key_cursor = 0;
+    } else if (!replica->snapshot_scanned) {
+      if (replica->snapshot_reads >= k_snapshot_tier_reads) {
+        break;
+      }
+      replica->snapshot_cursor =
+          _db.scan(replica->snapshot_cursor,
+                   [&](const std::string &key, EntryPtr &entry) {
+                     if (Internal::streamed(*entry)) {
+                       replica->snapshot_keys.push_back(key);
+                     } else if (entry->ext) {
+                       snapshotTiered(replica, key, *entry);
+                     } else {
+                       serializeEntry(key, *entry, replica->wbuf);
+                     }
+                   });
+      replica->snapshot_scanned = replica->snapshot_cursor == 0;
+    } else if (replica->snapshot_reads > 0) {
+      // The end waits for the values still being read
+      break;
+    } else {
+      Protocol::encodeRequest({"replconf", "snapshot-end"}, replica->wbuf);
+      replica->snapshot_done = true;
+    }
+  }
+}
+
+void ServerImpl::snapshotTiered(ConnectionPtr replica, const std::string &key,
+                                const Entry &entry) {
+  // A write to the key meanwhile is replayed after the snapshot, the value
+  // read is sent as it is
+  ++replica->snapshot_reads;
+  readTiered(key, entry, [replica, key](std::string &value, bool ok) {
+    --replica->snapshot_reads;
+    if (ok && replica->type != ConnectionType::END) {
+      Protocol::encodeRequest({"set", key, value}, replica->wbuf);
+    }
+  });
+}
+
+size_t ServerImpl::serializeEntry(const std::string &key, Entry &entry,
+                                  std::string &out) {
+  size_t frames = 0;
+  if (entry.type != ValueType::STRING) {
+    uint64_t cursor = 0;
+    do {
+      cursor = serializeMembers(key, entry, cursor, out, frames);
+    } while (cursor != 0);
+    return frames;
+  }
+  if (entry.compressed) {
+    // Sent raw, the receiver compresses it by its own settings
+    std::string value;
+    if (!readString(key, entry, value)) {
+      return frames;
+    }
+    Protocol::encodeRequest({"set", key, value}, out);
+  } else {
+    Protocol::encodeRequest({"set", key, entry.str}, out);
+  }
+  return ++frames;
+}
+
+uint64_t ServerImpl::serializeMembers(const std::string &key, Entry &entry,
+                                      uint64_t cursor, std::string &out,
+                                      size_t &frames) {
+  Args cmd = {entry.type == ValueType::SET ? "sadd" : "hset", key};
+  do {
+    if (entry.type == ValueType::SET) {
+      cursor = entry.set->scan(
+          cursor, [&](const std::string &member, NoValue &) {
+            cmd.push_back(member);
+          });
+    } else {
+      cursor = entry.hash->scan(
+          cursor, [&](const std::string &field, std::string &value) {
+            cmd.push_back(field);
+            cmd.push_back(value);
+          });
+    }
+  } while (cursor != 0 && cmd.size() < 2 + k_snapshot_batch);
+  if (cmd.size() > 2) {
+    Protocol::encodeRequest(cmd, out);
+    ++frames;
+  }
+  return cursor;
+}
+
+ConnectionPtr ServerImpl::connectTo(const std::string &host,
+                                   const int &port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  const char *ip = host == "localhost" ? "127.0.0.1" : host.c_str();
+  if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+    std::cout << "Invalid address " << host << std::endl;
+    return nullptr;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    std::cout << "Error creating socket" << std::endl;
+    return nullptr;
+  }
+  // Non-blocking connect, what is queued in wbuf is written once the socket
+  // is writable
+  if (!setFDNonBlocking(fd) ||
+      (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0 &&
+       errno != EINPROGRESS) ||
+      !addToEpoll(fd)) {
+    std::cout << "Error connecting to " << host << ":" << port << std::endl;
+    close(fd);
+    return nullptr;
+  }
+
+  ConnectionPtr conn = std::make_shared<Connection>();
+  conn->fd = fd;
+  conn->type = ConnectionType::REQUEST;
+  _fd2Conn[fd] = conn;
+  startConn(conn);
+  return conn;
+}
+
+void ServerImpl::connectToPrimary() {
+  ConnectionPtr conn = connectTo(_primaryHost, _primaryPort);
+  if (!conn) {
+    return;
+  }
+  conn->is_primary = true;
+  _primaryConn = conn;
+  _replState = ReplState::HANDSHAKE;
+  Protocol::encodeRequest(
+      {"psync", _replId, std::to_string(_backlog.endOffset())}, conn->wbuf);
+  flushConn(conn);
+  if (conn->type == ConnectionType::END) {
+    closeConn(conn);
+  }
+}
+
+void ServerImpl::handlePsyncReply(ConnectionPtr conn, const char *data,
+                                  size_t size) {
+  std::string reply;
+  if (size >= 1 + 4 && data[0] == SER_STR) {
+    reply.assign(data + 1 + 4, size - 1 - 4);
+  }
+  std::vector<std::string> words;
+  std::istringstream in(reply);
+  for (std::string word; in >> word;) {
+    words.push_back(word);
+  }
+
+  if (words.size() == 3 && words[0] == "FULLRESYNC" &&
+      Internal::parseUInt(words[2], _syncOffset)) {
+    std::cout << "Full resync from primary, offset " << _syncOffset
+              << std::endl;
+    _syncReplId = words[1];
+    // Our history is gone, nobody can continue from it
+    _replId = newReplId();
+    std::vector<ConnectionPtr> replicas = _replicas;
+    for (auto &replica : replicas) {
+      closeConn(replica);
+    }
+    flushAll(true);
+    _replState = ReplState::LOADING;
+  } else if (words.size() == 2 && words[0] == "CONTINUE") {
+    std::cout << "Partial resync from primary, offset "
+              << _backlog.endOffset() << std::endl;
+    _replState = ReplState::CONNECTED;
+  } else {
+    std::cout << "Unexpected PSYNC reply: " << reply << std::endl;
+    conn->type = ConnectionType::END;
+  }
+}
+
+void ServerImpl::sendReplAck() {
+  if (!_primaryConn) {
+    return;
+  }
+  Protocol::encodeRequest(
+      {"replconf", "ack", std::to_string(_backlog.endOffset())},
+      _primaryConn->wbuf);
+  flushConn(_primaryConn);
+  if (_primaryConn->type == ConnectionType::END) {
+    closeConn(_primaryConn);
+  }
+}
+
+void ServerImpl::cmdPSync(ConnectionPtr conn, Args &cmd) {
+  if (conn->is_replica || conn->is_primary) {
+    Protocol::outErr(conn->wbuf, "already replicating");
+    return;
+  }
+  uint64_t offset = 0;
+  conn->is_replica = true;
+  _replicas.push_back(conn);
+  if (cmd[1] == _replId && Internal::parseUInt(cmd[2], offset) &&
+      _backlog.contains(offset)) {
+    std::cout << "Partial resync of replica on fd " << conn->fd
+              << " from offset " << offset << std::endl;
+    Protocol::outStr(conn->wbuf, "CONTINUE " + _replId);
+    _backlog.copyFrom(offset, conn->repl_pending);
+    conn->snapshot_done = true;
+    conn->repl_online = false;
+    return;
+  }
+
+  std::cout << "Full resync of replica on fd " << conn->fd << std::endl;
+  Protocol::outStr(conn->wbuf, "FULLRESYNC " + _replId + " " +
+                                   std::to_string(_backlog.endOffset()));
+  conn->snapshot_done = false;
+  conn->snapshot_cursor = 0;
+  conn->snapshot_scanned = false;
+  conn->snapshot_keys.clear();
+  conn->snapshot_key_cursor = 0;
+  conn->snapshot_reads = 0;
+  conn->repl_online = false;
+}
+
+void ServerImpl::cmdReplConf(ConnectionPtr conn, Args &cmd) {
+  if (Internal::equalsIgnoreCase(cmd[1], "ack") && cmd.size() == 3) {
+    Internal::parseUInt(cmd[2], conn->repl_ack_offset);
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  if (Internal::equalsIgnoreCase(cmd[1], "snapshot-end") &&
+      conn->is_primary && _replState == ReplState::LOADING) {
+    std::cout << "Snapshot loaded, " << _db.size() << " keys" << std::endl;
+    _replId = _syncReplId;
+    _backlog.reset(_syncOffset);
+    _replState = ReplState::CONNECTED;
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  Protocol::outErr(conn->wbuf, "syntax error");
+}
+
+void ServerImpl::cmdReplicaOf(ConnectionPtr conn, Args &cmd) {
+  if (Internal::equalsIgnoreCase(cmd[1], "no") &&
+      Internal::equalsIgnoreCase(cmd[2], "one")) {
+    if (_replState != ReplState::NONE) {
+      std::cout << "Promoted to primary" << std::endl;
+      if (_primaryConn) {
+        closeConn(_primaryConn);
+      }
+      _replState = ReplState::NONE;
+      // From now on our history diverges from the old primary
+      _replId = newReplId();
+    }
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  int port = 0;
+  if (!Internal::parsePort(cmd[2], port)) {
+    Protocol::outErr(conn->wbuf, "invalid port");
+    return;
+  }
+  if (_primaryConn) {
+    closeConn(_primaryConn);
+  }
+  _primaryHost = cmd[1];
+  _primaryPort = port;
+  _replState = ReplState::CONNECT;
+  _lastReconnect = 0;
+  Protocol::outNil(conn->wbuf);
+}
+
+std::string ServerImpl::selfAddr() const {
+  return _announceIp + ":" + std::to_string(_port);
+}
+
+void ServerImpl::cmdCluster(ConnectionPtr conn, Args &cmd) {
+  if (!_cluster) {
+    Protocol::outErr(conn->wbuf, "cluster support disabled");
+    return;
+  }
+  const std::string &sub = cmd[1];
+  int slot = 0;
+  if (Internal::equalsIgnoreCase(sub, "keyslot") && cmd.size() == 3) {
+    Protocol::outInt(conn->wbuf, Cluster::keyHashSlot(cmd[2]));
+  } else if (Internal::equalsIgnoreCase(sub, "countkeysinslot") &&
+             cmd.size() == 3) {
+    if (!Internal::parseSlot(cmd[2], slot)) {
+      Protocol::outErr(conn->wbuf, "invalid slot");
+      return;
+    }
+    Protocol::outInt(conn->wbuf, (int64_t)_slotKeys[slot].size());
+  } else if (Internal::equalsIgnoreCase(sub, "addslots") &&
+             (cmd.size() == 4 || cmd.size() == 5)) {
+    // cluster addslots <start> <end> [node], the node defaults to us
+    int start = 0, end = 0;
+    if (!Internal::parseSlot(cmd[2], start) ||
+        !Internal::parseSlot(cmd[3], end) || start > end) {
+      Protocol::outErr(conn->wbuf, "invalid slot range");
+      return;
+    }
+    std::string node = cmd.size() == 5 ? cmd[4] : selfAddr();
+    for (int i = start; i <= end; ++i) {
+      _slotOwner[i] = node;
+    }
+    Protocol::outNil(conn->wbuf);
+  } else if (Internal::equalsIgnoreCase(sub, "setslot") && cmd.size() >= 4) {
+    if (!Internal::parseSlot(cmd[2], slot)) {
+      Protocol::outErr(conn->wbuf, "invalid slot");
+      return;
+    }
+    const std::string &action = cmd[3];
+    if (Internal::equalsIgnoreCase(action, "node") && cmd.size() == 5) {
+      _slotOwner[slot] = cmd[4];
+      _importing.erase(slot);
+    } else if (Internal::equalsIgnoreCase(action, "importing") &&
+               cmd.size() == 5) {
+      if (_slotOwner[slot] == selfAddr()) {
+        Protocol::outErr(conn->wbuf, "slot already owned");
+        return;
+      }
+      _importing[slot] = cmd[4];
+      // The sender is the migration link, it may write to the slot
+      conn->importing = true;
+    } else if (Internal::equalsIgnoreCase(action, "stable") &&
+               cmd.size() == 4) {
+      _importing.erase(slot);
+      if (_migration.slot == slot) {
+        abortMigration("slot set stable");
+      }
+    } else {
+      Protocol::outErr(conn->wbuf, "syntax error");
+      return;
+    }
+    Protocol::outNil(conn->wbuf);
+  } else if (Internal::equalsIgnoreCase(sub, "slots") && cmd.size() == 2) {
+    // [[start, end, node], ...] for the ranges of consecutive slots owned
+    // by the same node
+    std::string body;
+    uint32_t ranges = 0;
+    for (int start = 0; start < k_cluster_slots;) {
+      int end = start;
+      while (end + 1 < k_cluster_slots &&
+             _slotOwner[end + 1] == _slotOwner[start]) {
+        ++end;
+      }
+      if (!_slotOwner[start].empty()) {
+        Protocol::outArr(body, 3);
+        Protocol::outInt(body, start);
+        Protocol::outInt(body, end);
+        Protocol::outStr(body, _slotOwner[start]);
+        ++ranges;
+      }
+      start = end + 1;
+    }
+    Protocol::outArr(conn->wbuf, ranges);
+    conn->wbuf.append(body);
+  } else if (Internal::equalsIgnoreCase(sub, "migrate") && cmd.size() == 4) {
+    // cluster migrate <slot> <host:port>
+    std::string host;
+    int port = 0;
+    if (!Internal::parseSlot(cmd[2], slot)) {
+      Protocol::outErr(conn->wbuf, "invalid slot");
+      return;
+    }
+    if (!Internal::parseAddr(cmd[3], host, port)) {
+      Protocol::outErr(conn->wbuf, "invalid address");
+      return;
+    }
+    if (_slotOwner[slot] != selfAddr()) {
+      Protocol::outErr(conn->wbuf, "slot not owned by this node");
+      return;
+    }
+    if (_migration.slot >= 0) {
+      Protocol::outErr(conn->wbuf, "a migration is already running");
+      return;
+    }
+    ConnectionPtr link = connectTo(host, port);
+    if (!link) {
+      Protocol::outErr(conn->wbuf, "can't connect to target");
+      return;
+    }
+    link->is_migration = true;
+    _migration = Migration();
+    _migration.slot = slot;
+    _migration.target = cmd[3];
+    _migration.link = link;
+    std::cout << "Migrating slot " << slot << " (" << _slotKeys[slot].size()
+              << " keys) to " << cmd[3] << std::endl;
+    Protocol::encodeRequest({"cluster", "setslot", std::to_string(slot),
+                             "importing", selfAddr()},
+                            link->wbuf);
+    _migration.pendingReplies = 1;
+    flushConn(link);
+    Protocol::outNil(conn->wbuf);
+  } else {
+    Protocol::outErr(conn->wbuf, "unknown cluster subcommand");
+  }
+}
+
+void ServerImpl::cmdAsking(ConnectionPtr conn, Args &) {
+  // Cleared once the next command ran
+  conn->asking = true;
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::migrateStep() {
+  ConnectionPtr link = _migration.link;
+  if (_migration.pendingReplies == 0 && _migration.unsent.empty() &&
+      _migration.reads == 0 && !_migration.finishing) {
+    // The previous batch is acknowledged, send the next one. The target
+    // deletes each key first so a stale copy left by an aborted attempt is
+    // replaced rather than merged.
+    StringSet &keys = _slotKeys[_migration.slot];
+    do {
+      _migration.cursor = keys.scan(
+          _migration.cursor, [&](const std::string &key, NoValue &) {
+            _migration.inflight.insert(key);
+          });
+    } while (_migration.cursor != 0 &&
+             _migration.inflight.size() < k_migrate_batch);
+
+    for (auto it = _migration.inflight.begin();
+         it != _migration.inflight.end();) {
+      EntryPtr *entry = _db.find(*it);
+      if (!entry) {
+        // Not in the keyspace anymore, nothing to move
+        _slotKeys[_migration.slot].erase(*it);
+        it = _migration.inflight.erase(it);
+        continue;
+      }
+      Protocol::encodeRequest({"del", *it}, link->wbuf);
+      ++_migration.pendingReplies;
+      if (Internal::streamed(**entry)) {
+        _migration.unsent.push_back(*it);
+      } else if ((*entry)->ext) {
+        migrateTiered(*it, **entry);
+      } else {
+        _migration.pendingReplies += serializeEntry(*it, **entry, link->wbuf);
+      }
+      ++it;
+    }
+    if (_migration.inflight.empty() && _migration.cursor == 0) {
+      // Every key moved, hand the slot over
+      std::string slot = std::to_string(_migration.slot);
+      Protocol::encodeRequest(
+          {"cluster", "setslot", slot, "node", _migration.target},
+          link->wbuf);
+      _migration.pendingReplies = 1;
+      _migration.finishing = true;
+    }
+  }
+  // Writes to these keys get TRYAGAIN until the batch is acknowledged, but
+  // FLUSHALL may still delete them
+  while (!_migration.unsent.empty() &&
+         Internal::unsentBytes(*link) < k_snapshot_output_watermark) {
+    const std::string &key = _migration.unsent.back();
+    EntryPtr *entry = _db.find(key);
+    size_t frames = 0;
+    if (entry) {
+      _migration.keyCursor = serializeMembers(key, **entry,
+                                              _migration.keyCursor,
+                                              link->wbuf, frames);
+    } else {
+      // Don't leave a part of it on the target
+      Protocol::encodeRequest({"del", key}, link->wbuf);
+      frames = 1;
+      _migration.keyCursor = 0;
+    }
+    _migration.pendingReplies += frames;
+    if (_migration.keyCursor == 0) {
+      _migration.unsent.pop_back();
+    }
+  }
+  if (_migration.pendingReplies == 0 && _migration.unsent.empty() &&
+      _migration.reads == 0 && !_migration.inflight.empty()) {
+    // The last steps sent nothing more, the target has it all already
+    endMigrationBatch();
+  }
+  flushConn(link);
+  if (link->type == ConnectionType::END) {
+    closeConn(link);
+  }
+}
+
+void ServerImpl::migrateTiered(const std::string &key, const Entry &entry) {
+  ConnectionPtr link = _migration.link;
+  ++_migration.reads;
+  readTiered(key, entry, [this, link, key](std::string &value, bool ok) {
+    if (_migration.link != link) {
+      // Aborted meanwhile
+      return;
+    }
+    --_migration.reads;
+    // Unless flushed meanwhile, the target already deleted it
+    if (ok && _db.find(key)) {
+      Protocol::encodeRequest({"set", key, value}, link->wbuf);
+      ++_migration.pendingReplies;
+    }
+  });
+}
+
+void ServerImpl::handleMigrationReply(ConnectionPtr conn, const char *data,
+                                      size_t size) {
+  Protocol::Value reply;
+  if (Protocol::decodeValue(data, size, reply) != size || reply.isErr()) {
+    abortMigration("target replied " +
+                   (reply.isErr() ? reply.str : std::string("garbage")));
+    return;
+  }
+  if (_migration.slot < 0 || --_migration.pendingReplies > 0 ||
+      !_migration.unsent.empty() || _migration.reads > 0) {
+    return;
+  }
+
+  if (_migration.finishing) {
+    std::cout << "Slot " << _migration.slot << " migrated to "
+              << _migration.target << ", " << _migration.movedKeys
+              << " keys" << std::endl;
+    _slotOwner[_migration.slot] = _migration.target;
+    _migration = Migration();
+    conn->type = ConnectionType::END;
+    return;
+  }
+  endMigrationBatch();
+}
+
+void ServerImpl::endMigrationBatch() {
+  // The target has the batch, drop our copies
+  for (const auto &key : _migration.inflight) {
+    deleteKey(key, true);
+    invalidateKey(key);
+    std::string frame;
+    Protocol::encodeRequest({"del", key}, frame);
+    propagate(frame.data(), frame.size());
+  }
+  _migration.movedKeys += _migration.inflight.size();
+  _migration.inflight.clear();
+}
+
+void ServerImpl::abortMigration(const std::string &reason) {
+  if (_migration.slot < 0) {
+    return;
+  }
+  std::cout << "Migration of slot " << _migration.slot << " aborted: "
+            << reason << std::endl;
+  // The keys of the batch in flight are still here, the copies the target
+  // may have are replaced if the migration is retried
+  ConnectionPtr link = _migration.link;
+  _migration = Migration();
+  if (link) {
+    closeConn(link);
+  }
+}
+
+void ServerImpl::enqueueShared(
+    const ConnectionPtr &conn,
+    const std::shared_ptr<const std::string> &frame) {
+  if (conn->type == ConnectionType::END) {
+    return;
+  }
+  if (Internal::unsentBytes(*conn) + frame->size() > k_pubsub_output_limit) {
+    // Counted in INFO, no log line: a burst of them would slow the loop
+    // further
+    ++_slowSubscribers;
+    // Closed before sleeping, the caller is iterating the subscribers
+    conn->type = ConnectionType::END;
+  } else {
+    if (conn->wbuf_sent < conn->wbuf.size()) {
+      // What is already in wbuf goes out first, moved rather than copied.
+      // Part of it was sent only if the queue is empty, it then becomes the
+      // head of the queue.
+      if (conn->wbuf_sent > 0) {
+        conn->wqueue_sent = conn->wbuf_sent;
+      }
+      conn->wqueue_bytes += conn->wbuf.size();
+      conn->wqueue.push_back(
+          std::make_shared<const std::string>(std::move(conn->wbuf)));
+    }
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+    conn->wqueue.push_back(frame);
+    conn->wqueue_bytes += frame->size();
+  }
+  if (!conn->pending_write) {
+    conn->pending_write = true;
+    _pendingWrites.push_back(conn);
+  }
+}
+
+void ServerImpl::unsubscribeAll(ConnectionPtr conn) {
+  for (const auto &[channel, pos] : conn->channels) {
+    removeSubscriber(channel, pos, false);
+  }
+  for (const auto &[pattern, pos] : conn->patterns) {
+    removeSubscriber(pattern, pos, true);
+  }
+  conn->channels.clear();
+  conn->patterns.clear();
+}
+
+void ServerImpl::removeSubscriber(const std::string &name, size_t pos,
+                                  bool patterns) {
+  auto &index = patterns ? _patterns : _channels;
+  auto it = index.find(name);
+  auto &subscribers = it->second;
+  if (pos + 1 != subscribers.size()) {
+    // Move the last subscriber into the hole
+    ConnectionPtr &moved = subscribers[pos];
+    moved = std::move(subscribers.back());
+    (patterns ? moved->patterns : moved->channels)[name] = pos;
+  }
+  subscribers.pop_back();
+  if (subscribers.empty()) {
+    index.erase(it);
+    if (patterns) {
+      _patternTrie.erase(name);
+    }
+  }
+}
+
+void ServerImpl::subscribe(ConnectionPtr conn, Args &cmd, bool patterns) {
+  auto &index = patterns ? _patterns : _channels;
+  auto &subscribed = patterns ? conn->patterns : conn->channels;
+  // One [kind, name, subscription count] per name
+  Protocol::outArr(conn->wbuf, (uint32_t)cmd.size() - 1);
+  for (size_t i = 1; i < cmd.size(); ++i) {
+    if (!subscribed.count(cmd[i])) {
+      auto &subscribers = index[cmd[i]];
+      if (patterns && subscribers.empty()) {
+        _patternTrie.insert(cmd[i]);
+      }
+      subscribed[cmd[i]] = subscribers.size();
+      subscribers.push_back(conn);
+    }
+    Protocol::outArr(conn->wbuf, 3);
+    Protocol::outStr(conn->wbuf, patterns ? "psubscribe" : "subscribe");
+    Protocol::outStr(conn->wbuf, cmd[i]);
+    Protocol::outInt(conn->wbuf,
+                     (int64_t)(conn->channels.size() + conn->patterns.size()));
+  }
+}
+
+void ServerImpl::unsubscribe(ConnectionPtr conn, Args &cmd, bool patterns) {
+  auto &subscribed = patterns ? conn->patterns : conn->channels;
+  const char *kind = patterns ? "punsubscribe" : "unsubscribe";
+  // Without arguments, everything
+  Args names(cmd.begin() + 1, cmd.end());
+  if (names.empty()) {
+    for (const auto &[name, pos] : subscribed) {
+      names.push_back(name);
+    }
+  }
+  if (names.empty()) {
+    Protocol::outArr(conn->wbuf, 1);
+    Protocol::outArr(conn->wbuf, 3);
+    Protocol::outStr(conn->wbuf, kind);
+    Protocol::outNil(conn->wbuf);
+    Protocol::outInt(conn->wbuf,
+                     (int64_t)(conn->channels.size() + conn->patterns.size()));
+    return;
+  }
+  Protocol::outArr(conn->wbuf, (uint32_t)names.size());
+  for (const auto &name : names) {
+    auto it = subscribed.find(name);
+    if (it != subscribed.end()) {
+      removeSubscriber(name, it->second, patterns);
+      subscribed.erase(it);
+    }
+    Protocol::outArr(conn->wbuf, 3);
+    Protocol::outStr(conn->wbuf, kind);
+    Protocol::outStr(conn->wbuf, name);
+    Protocol::outInt(conn->wbuf,
+                     (int64_t)(conn->channels.size() + conn->patterns.size()));
+  }
+}
+
+void ServerImpl::cmdSubscribe(ConnectionPtr conn, Args &cmd) {
+  subscribe(conn, cmd, false);
+}
+
+void ServerImpl::cmdUnsubscribe(ConnectionPtr conn, Args &cmd) {
+  unsubscribe(conn, cmd, false);
+}
+
+void ServerImpl::cmdPSubscribe(ConnectionPtr conn, Args &cmd) {
+  subscribe(conn, cmd, true);
+}
+
+void ServerImpl::cmdPUnsubscribe(ConnectionPtr conn, Args &cmd) {
+  unsubscribe(conn, cmd, true);
+}
+
+void ServerImpl::cmdPublish(ConnectionPtr conn, Args &cmd) {
+  static const std::string k_message = "message";
+  static const std::string k_pmessage = "pmessage";
+  const std::string &channel = cmd[1];
+  const std::string &message = cmd[2];
+  // Each frame is encoded once and shared by all its receivers
+  size_t receivers = 0;
+  auto it = _channels.find(channel);
+  if (it != _channels.end()) {
+    auto frame = Internal::makePush({&k_message, &channel, &message});
+    for (const auto &subscriber : it->second) {
+      enqueueShared(subscriber, frame);
+    }
+    receivers += it->second.size();
+  }
+  _patternTrie.forEachCandidate(channel, [&](const std::string &pattern) {
+    if (!Internal::globMatch(pattern.data(), pattern.size(), channel.data(),
+                             channel.size())) {
+      return;
+    }
+    const auto &subscribers = _patterns[pattern];
+    auto frame =
+        Internal::makePush({&k_pmessage, &pattern, &channel, &message});
+    for (const auto &subscriber : subscribers) {
+      enqueueShared(subscriber, frame);
+    }
+    receivers += subscribers.size();
+  });
+  Protocol::outInt(conn->wbuf, (int64_t)receivers);
+}
+
+void ServerImpl::cmdClient(ConnectionPtr conn, Args &cmd) {
+  if (Internal::equalsIgnoreCase(cmd[1], "id") && cmd.size() == 2) {
+    Protocol::outInt(conn->wbuf, (int64_t)conn->id);
+    return;
+  }
+  if (!Internal::equalsIgnoreCase(cmd[1], "tracking") || cmd.size() < 3) {
+    Protocol::outErr(conn->wbuf, "unknown client subcommand");
+    return;
+  }
+  if (Internal::equalsIgnoreCase(cmd[2], "off") && cmd.size() == 3) {
+    if (conn->tracking) {
+      disableTracking(conn);
+    }
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  if (!Internal::equalsIgnoreCase(cmd[2], "on")) {
+    Protocol::outErr(conn->wbuf, "syntax error");
+    return;
+  }
+
+  // client tracking on [bcast] [prefix p]...
+  bool bcast = false;
+  std::vector<std::string> prefixes;
+  for (size_t i = 3; i < cmd.size(); ++i) {
+    if (Internal::equalsIgnoreCase(cmd[i], "bcast")) {
+      bcast = true;
+    } else if (Internal::equalsIgnoreCase(cmd[i], "prefix") &&
+               i + 1 < cmd.size()) {
+      prefixes.push_back(cmd[++i]);
+    } else {
+      Protocol::outErr(conn->wbuf, "syntax error");
+      return;
+    }
+  }
+  if (!prefixes.empty() && !bcast) {
+    Protocol::outErr(conn->wbuf, "prefixes require bcast mode");
+    return;
+  }
+  if (bcast && prefixes.empty()) {
+    // Every key
+    prefixes.push_back("");
+  }
+  if (conn->tracking) {
+    disableTracking(conn);
+  }
+  conn->tracking = true;
+  conn->tracking_bcast = bcast;
+  conn->tracking_prefixes = prefixes;
+  for (const auto &prefix : prefixes) {
+    _tracking.addPrefix(prefix, conn->id);
+  }
+  _trackingClients[conn->id] = conn;
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::disableTracking(ConnectionPtr conn) {
+  // Keys it read stay in the table until they change, its id is skipped
+  for (const auto &prefix : conn->tracking_prefixes) {
+    _tracking.removePrefix(prefix, conn->id);
+  }
+  conn->tracking_prefixes.clear();
+  conn->tracking = false;
+  conn->tracking_bcast = false;
+  _trackingClients.erase(conn->id);
+}
+
+void ServerImpl::invalidateKey(const std::string &key) {
+  if (_trackingClients.empty()) {
+    return;
+  }
+  _tracking.invalidate(key, [&](uint64_t id) { queueInvalidation(id, key); });
+}
+
+void ServerImpl::invalidateAll() {
+  _tracking.clearKeys();
+  for (auto &[id, conn] : _trackingClients) {
+    if (!conn->invalidate_all && conn->invalidations.empty()) {
+      _invalidated.push_back(conn);
+    }
+    conn->invalidate_all = true;
+    conn->invalidations.clear();
+  }
+}
+
+void ServerImpl::queueInvalidation(uint64_t id, const std::string &key) {
+  auto it = _trackingClients.find(id);
+  if (it == _trackingClients.end()) {
+    // Closed or no longer tracking
+    return;
+  }
+  ConnectionPtr &conn = it->second;
+  if (conn->invalidate_all) {
+    return;
+  }
+  if (conn->invalidations.empty()) {
+    _invalidated.push_back(conn);
+  }
+  conn->invalidations.push_back(key);
+}
+
+void ServerImpl::sendInvalidations() {
+  // [invalidate, [key...]], or [invalidate, nil] to drop everything
+  static const std::string k_invalidate = "invalidate";
+  for (auto &conn : _invalidated) {
+    if (conn->type != ConnectionType::END) {
+      size_t header = Protocol::beginResponse(conn->wbuf);
+      Protocol::outPush(conn->wbuf, 2);
+      Protocol::outStr(conn->wbuf, k_invalidate);
+      if (conn->invalidate_all) {
+        Protocol::outNil(conn->wbuf);
+      } else {
+        Protocol::outArr(conn->wbuf, (uint32_t)conn->invalidations.size());
+        for (const auto &key : conn->invalidations) {
+          Protocol::outStr(conn->wbuf, key);
+        }
+      }
+      Protocol::endResponse(conn->wbuf, header);
+      if (!conn->pending_write) {
+        conn->pending_write = true;
+        _pendingWrites.push_back(conn);
+      }
+    }
+    conn->invalidations.clear();
+    conn->invalidate_all = false;
+  }
+  _invalidated.clear();
+}
+
+void ServerImpl::cmdHotKeys(ConnectionPtr conn, Args &cmd) {
+  // [[key, estimated accesses]...], hottest first
+  uint64_t count = k_hotkeys_default_count;
+  if (cmd.size() > 2 ||
+      (cmd.size() == 2 && !Internal::parseUInt(cmd[1], count))) {
+    Protocol::outErr(conn->wbuf, "usage: hotkeys [count]");
+    return;
+  }
+  auto top = _hotKeys.top((size_t)count);
+  Protocol::outArr(conn->wbuf, (uint32_t)top.size());
+  for (const auto &[key, accesses] : top) {
+    Protocol::outArr(conn->wbuf, 2);
+    Protocol::outStr(conn->wbuf, key);
+    Protocol::outInt(conn->wbuf, (int64_t)accesses);
+  }
+}
+
+void ServerImpl::cmdBigKeys(ConnectionPtr conn, Args &cmd) {
+  if (cmd.size() == 2 && Internal::equalsIgnoreCase(cmd[1], "scan")) {
+    // Start a scan at the next cron run unless one is running
+    _nextBigKeysScan = 0;
+    Protocol::outNil(conn->wbuf);
+    return;
+  }
+  if (cmd.size() != 1) {
+    Protocol::outErr(conn->wbuf, "usage: bigkeys [scan]");
+    return;
+  }
+  // [[key, type, size]...] from the last complete scan, largest first for
+  // each type
+  std::vector<std::pair<ValueType, std::pair<uint64_t, std::string>>> keys;
+  std::unordered_set<std::string> seen;
+  for (ValueType type : {ValueType::STRING, ValueType::SET, ValueType::HASH}) {
+    for (auto &item : _bigKeys.biggest[(int)type].sorted()) {
+      if (seen.insert(item.second).second) {
+        keys.emplace_back(type, std::move(item));
+      }
+    }
+  }
+  Protocol::outArr(conn->wbuf, (uint32_t)keys.size());
+  for (const auto &[type, item] : keys) {
+    Protocol::outArr(conn->wbuf, 3);
+    Protocol::outStr(conn->wbuf, item.second);
+    Protocol::outStr(conn->wbuf, Internal::typeName(type));
+    Protocol::outInt(conn->wbuf, (int64_t)item.first);
+  }
+}
+
+void ServerImpl::cmdDefrag(ConnectionPtr conn, Args &) {
+  // The pass runs in steps from the end of this loop iteration
+  startDefrag();
+  Protocol::outNil(conn->wbuf);
+}
+
+void ServerImpl::tierStep() {
+  if (!_tier.enabled() || (_upgradeLink >= 0 && !_takeover)) {
+    // A successor shares the directory, see writeTierBatch()
+    return;
+  }
+  _tier.reclaim();
+  if (!_tierCompacting) {
+    _tierCompacting = _tier.pickCompaction(k_tier_compact_ratio);
+    if (_tierCompacting) {
+      compactSegment(_tierCompacting);
+    }
+  }
+  if (_tierWrites >= k_tier_max_writes) {
+    return;
+  }
+
+  // Batch the cold values met by the scan, a full pass ends the step
+  TierBatch batch;
+  int64_t deadline = Internal::nowUs() + k_tier_budget_us;
+  do {
+    for (size_t i = 0; i < k_tier_buckets_per_check &&
+                       batch.data.size() < k_tier_batch_bytes;
+         ++i) {
+      _tierCursor = _db.scan(
+          _tierCursor, [&](const std::string &key, EntryPtr &entry) {
+            // Empty keys would read as padding to compaction
+            if (entry->type != ValueType::STRING || entry->ext ||
+                entry->str.size() < _tierMinSize || key.empty() ||
+                _lruClock - entry->atime < _tierIdleSecs) {
+              return;
+            }
+            uint32_t len = (uint32_t)entry->str.size();
+            uint64_t offset = TierStore::appendRecord(batch.data, key,
+                                                      entry->str.data(), len);
+            batch.records.push_back({key, offset, len});
+          });
+      if (_tierCursor == 0) {
+        break;
+      }
+    }
+  } while (_tierCursor != 0 && batch.data.size() < k_tier_batch_bytes &&
+           Internal::nowUs() < deadline);
+  if (!batch.records.empty()) {
+    writeTierBatch(std::move(batch));
+  }
+}
+
+void ServerImpl::writeTierBatch(TierBatch batch) {
+  if (_upgradeLink >= 0 && !_takeover) {
+    // The successor removed our segment files and creates its own under
+    // the same names, ours stay readable through their open fds. The
+    // values stay where they are.
+    if (batch.from) {
+      _tierCompacting.reset();
+    }
+    return;
+  }
+  batch.segment = _tier.reserve(batch.data.size(), batch.offset);
+  if (!batch.segment) {
+    std::cout << "Error creating a tier segment: " << strerror(errno)
+              << std::endl;
+    if (batch.from) {
+      _tierCompacting.reset();
+    }
+    return;
+  }
+  for (auto &record : batch.records) {
+    record.offset += batch.offset;
+  }
+  ++_tierWrites;
+  // The entries switch to the tier once the write is done, until then the
+  // values are still served from memory
+  auto shared = std::make_shared<TierBatch>(std::move(batch));
+  _tierPool.submit([this, shared]() {
+    bool ok = TierStore::writeAt(shared->segment->fd, shared->data,
+                                 shared->offset);
+    _completions.post(
+        [this, shared, ok]() { finishTierWrite(*shared, ok); });
+  });
+}
+
+void ServerImpl::finishTierWrite(TierBatch &batch, bool ok) {
+  --_tierWrites;
+  --batch.segment->writes;
+  if (!ok) {
+    std::cout << "Error writing to the tier, the values stay in memory"
+              << std::endl;
+  }
+  for (size_t i = 0; ok && i < batch.records.size(); ++i) {
+    const auto &record = batch.records[i];
+    EntryPtr *slot = _db.find(record.key);
+    if (!slot) {
+      continue;
+    }
+    Entry &entry = **slot;
+    if (batch.from) {
+      if (!entry.ext || entry.ext->segment != batch.from ||
+          entry.ext->offset != batch.fromOffsets[i]) {
+        continue;
+      }
+    } else {
+      // The value written must still be the current one
+      const char *written = &batch.data[record.offset - batch.offset];
+      if (entry.type != ValueType::STRING || entry.ext ||
+          entry.str.size() != record.len ||
+          memcmp(entry.str.data(), written, record.len) != 0) {
+        continue;
+      }
+      countCompressed(entry, false);
+      std::string().swap(entry.str);
+      ++_tierDemoted;
+    }
+    entry.ext =
+        std::make_unique<Extent>(batch.segment, record.offset, record.len);
+  }
+  if (batch.from) {
+    // The old segment is reclaimed once the values moved out of it
+    ++_tierCompactions;
+    _tierCompacting.reset();
+  }
+}
+
+void ServerImpl::compactSegment(const TierSegmentPtr &segment) {
+  uint64_t size = segment->size;
+  _tierPool.submit([this, segment, size]() {
+    auto data = std::make_shared<std::string>();
+    bool ok = TierStore::readAt(segment->fd, *data, 0, size);
+    _completions.post([this, segment, data, ok]() {
+      relocateSegment(segment, *data, ok);
+    });
+  });
+}
+
+void ServerImpl::relocateSegment(const TierSegmentPtr &segment,
+                                 const std::string &data, bool ok) {
+  if (!ok) {
+    std::cout << "Error reading tier segment " << segment->path << std::endl;
+    _tierCompacting.reset();
+    return;
+  }
+  // Rewrite the records still referenced by their key
+  TierBatch batch;
+  batch.from = segment;
+  for (const auto &record : TierStore::parseRecords(data)) {
+    EntryPtr *slot = _db.find(record.key);
+    if (!slot || !(*slot)->ext || (*slot)->ext->segment != segment ||
+        (*slot)->ext->offset != record.offset) {
+      continue;
+    }
+    uint64_t offset = TierStore::appendRecord(
+        batch.data, record.key, &data[record.offset], record.len);
+    batch.records.push_back({record.key, offset, record.len});
+    batch.fromOffsets.push_back(record.offset);
+  }
+  if (batch.records.empty()) {
+    _tierCompacting.reset();
+    return;
+  }
+  writeTierBatch(std::move(batch));
+}
+
+bool ServerImpl::loadValues(ConnectionPtr conn, const CommandSpec &spec,
+                            const Args &cmd) {
+  forEachKey(spec, cmd, [&](const std::string &key) {
+    EntryPtr *slot = _db.find(key);
+    if (!slot || !(*slot)->ext) {
+      return;
+    }
+    ++conn->pending_loads;
+    auto [it, inserted] = _tierLoads.try_emplace(key);
+    it->second.push_back(conn);
+    if (!inserted) {
+      // Already being loaded for another request
+      return;
+    }
+    const Extent &ext = *(*slot)->ext;
+    TierSegmentPtr segment = ext.segment;
+    uint64_t offset = ext.offset;
+    uint32_t len = ext.len;
+    _tierPool.submit([this, key, segment, offset, len]() {
+      auto value = std::make_shared<std::string>();
+      bool ok = TierStore::readAt(segment->fd, *value, offset, len);
+      _completions.post([this, key, segment, offset, value, ok]() {
+        finishLoad(key, segment, offset, *value, ok);
+      });
+    });
+  });
+  return conn->pending_loads == 0;
+}
+
+void ServerImpl::readTiered(const std::string &key, const Entry &entry,
+                            std::function<void(std::string &, bool)> done) {
+  TierSegmentPtr segment = entry.ext->segment;
+  uint64_t offset = entry.ext->offset;
+  uint32_t len = entry.ext->len;
+  bool compressed = entry.compressed;
+  ++_tierCopyReads;
+  // `done` is only carried through, the task moves it to the completion so
+  // that what it holds is released on the loop
+  _tierPool.submit([this, key, segment, offset, len, compressed,
+                    done = std::move(done)]() mutable {
+    auto value = std::make_shared<std::string>();
+    bool ok = TierStore::readAt(segment->fd, *value, offset, len);
+    if (ok && compressed) {
+      std::string raw(Lz::blobRawSize(*value), '\0');
+      ok = Lz::decompressBlob(*value, &raw[0]);
+      value->swap(raw);
+    }
+    _completions.post([this, key, segment, offset, value, ok,
+                       done = std::move(done)]() {
+      if (!ok) {
+        std::cout << "Error reading " << key << " from the tier" << std::endl;
+        ++_tierLoadErrors;
+        EntryPtr *slot = _db.find(key);
+        if (slot && (*slot)->ext && (*slot)->ext->segment == segment &&
+            (*slot)->ext->offset == offset) {
+          deleteKey(key, true);
+          invalidateKey(key);
+        }
+      }
+      done(*value, ok);
+    });
+  });
+}
+
+void ServerImpl::finishLoad(const std::string &key,
+                            const TierSegmentPtr &segment, uint64_t offset,
+                            std::string &value, bool ok) {
+  // Otherwise the value changed meanwhile, the requests run with the new one
+  EntryPtr *slot = _db.find(key);
+  if (slot && (*slot)->ext && (*slot)->ext->segment == segment &&
+      (*slot)->ext->offset == offset) {
+    Entry &entry = **slot;
+    if (ok) {
+      // Back in memory, it goes to disk again once cold
+      entry.str.swap(value);
+      entry.ext.reset();
+      entry.atime = _lruClock;
+      countCompressed(entry, true);
+      ++_tierLoaded;
+    } else {
+      // Served as a miss rather than failing every read of the key
+      std::cout << "Error loading " << key << " from the tier, dropped"
+                << std::endl;
+      ++_tierLoadErrors;
+      deleteKey(key, true);
+      invalidateKey(key);
+    }
+  }
+  auto it = _tierLoads.find(key);
+  std::vector<ConnectionPtr> waiters = std::move(it->second);
+  _tierLoads.erase(it);
+  for (auto &conn : waiters) {
+    if (--conn->pending_loads == 0) {
+      resumeConn(conn);
+    }
+  }
+}
+
+void ServerImpl::resumeConn(ConnectionPtr conn) {
+  // The request awaiting its values goes on, then those behind it. Nothing
+  // if closed meanwhile.
+  wake(conn, WaitFor::WAKEUP);
+}
+
+bool ServerImpl::connectPredecessor() {
+  _upgradeLink = Upgrade::connectUnix(_upgradePath);
+  if (_upgradeLink < 0) {
+    return false;
+  }
+  Upgrade::setTimeout(_upgradeLink);
+  // It stops writing to its tier once it answers, we can then open ours in
+  // the same directory
+  std::string body;
+  Args msg;
+  if (!Upgrade::readFrame(_upgradeLink, body) ||
+      !Protocol::parseRequest(body.data(), body.size(), msg) ||
+      msg.size() != 1 || msg[0] != "attached") {
+    close(_upgradeLink);
+    _upgradeLink = -1;
+    return false;
+  }
+  std::cout << "Attached to the server at " << _upgradePath
+            << ", loading its dataset" << std::endl;
+  return true;
+}
+
+bool ServerImpl::watchFd(int fd) {
+  // Level-triggered, for the listening sockets and the upgrade link whose
+  // messages are read whole and blocking
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  if (epoll_ctl(_ePollFD, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    std::cerr << "Failed to add file descriptor to epoll: " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void ServerImpl::acceptSuccessor() {
+  int fd = accept4(_upgradeFd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  if (_upgradeLink >= 0) {
+    std::cout << "Upgrade already in progress, successor refused"
+              << std::endl;
+    close(fd);
+    return;
+  }
+  std::string out;
+  Protocol::encodeRequest({"attached"}, out);
+  if (!Upgrade::setTimeout(fd) ||
+      !Upgrade::writeAll(fd, out.data(), out.size()) || !watchFd(fd)) {
+    close(fd);
+    return;
+  }
+  _upgradeLink = fd;
+  std::cout << "Successor attached, tiering paused" << std::endl;
+}
+
+void ServerImpl::dropUpgradeLink() {
+  epoll_ctl(_ePollFD, EPOLL_CTL_DEL, _upgradeLink, nullptr);
+  close(_upgradeLink);
+  _upgradeLink = -1;
+}
+
+void ServerImpl::upgradeIO() {
+  std::string body;
+  Args msg;
+  bool ok = Upgrade::readFrame(_upgradeLink, body) &&
+            Protocol::parseRequest(body.data(), body.size(), msg) &&
+            !msg.empty();
+  if (_takeover) {
+    if (ok && msg[0] == "handoff" && !_handoff.received) {
+      ok = receiveHandoff(msg);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      // It keeps serving the clients until we reply "done", they were
+      // never touched here
+      std::cout << "Lost the server to take over, exiting" << std::endl;
+      _exit(1);
+    }
+    return;
+  }
+
+  if (ok && msg[0] == "ready" && !_upgradeFrozen) {
+    std::cout << "Successor in sync, handing over" << std::endl;
+    freezeClients();
+    _handoffPending = true;
+  } else if (ok && msg[0] == "done" && _handedOff) {
+    std::cout << "Successor took over, exiting" << std::endl;
+    _exit(0);
+  } else {
+    abortUpgrade("Lost the successor");
+  }
+}
+
+void ServerImpl::abortUpgrade(const char *why) {
+  std::cout << why << ", upgrade aborted" << std::endl;
+  dropUpgradeLink();
+  _handoffPending = false;
+  _handedOff = false;
+  if (_upgradeFrozen) {
+    thawClients();
+  }
+}
+
+void ServerImpl::upgradeStep() {
+  if (_upgradeLink < 0) {
+    return;
+  }
+  if (_takeover) {
+    if (!_upgradeReady && _replState == ReplState::CONNECTED) {
+      // Following its stream, it can stop writing
+      std::string out;
+      Protocol::encodeRequest({"ready"}, out);
+      Upgrade::writeAll(_upgradeLink, out.data(), out.size());
+      _upgradeReady = true;
+    }
+    if (_handoff.received && _replState == ReplState::CONNECTED &&
+        _backlog.endOffset() >= _handoff.offset) {
+      finishTakeover();
+    }
+    return;
+  }
+  // Requests waiting for their values resume with them, and must have run
+  // before the clients' state is sent
+  if (_handoffPending && _tierLoads.empty()) {
+    _handoffPending = false;
+    if (!handOff()) {
+      abortUpgrade("Handoff failed");
+    }
+  }
+}
+
+void ServerImpl::freezeClients() {
+  _upgradeFrozen = true;
+  epoll_ctl(_ePollFD, EPOLL_CTL_DEL, _fd, nullptr);
+  // The target would be left importing from a node that went away
+  abortMigration("upgrading");
+}
+
+void ServerImpl::thawClients() {
+  _upgradeFrozen = false;
+  watchFd(_fd);
+  // They read what arrived meanwhile and send what was held back since a
+  // handoff, edge-triggered epoll won't tell
+  std::vector<ConnectionPtr> conns;
+  for (const auto &[fd, conn] : _fd2Conn) {
+    conns.push_back(conn);
+  }
+  for (auto &conn : conns) {
+    wake(conn, WaitFor::WAKEUP);
+    wake(conn, WaitFor::SOCKET);
+  }
+}
+
+bool ServerImpl::handOff() {
+  // Nothing is written anymore unless we're a replica, the successor
+  // serves the clients once it applied the stream up to here
+  std::string out;
+  bool replica = _replState != ReplState::NONE;
+  Protocol::encodeRequest({"handoff", std::to_string(_backlog.endOffset()),
+                           std::to_string(_nextClientId),
+                           replica ? _primaryHost : "",
+                           std::to_string(replica ? _primaryPort : 0)},
+                          out);
+  if (_cluster) {
+    for (int start = 0; start < k_cluster_slots;) {
+      int end = start;
+      while (end + 1 < k_cluster_slots &&
+             _slotOwner[end + 1] == _slotOwner[start]) {
+        ++end;
+      }
+      if (!_slotOwner[start].empty()) {
+        Protocol::encodeRequest({"slots", std::to_string(start),
+                                 std::to_string(end), _slotOwner[start]},
+                                out);
+      }
+      start = end + 1;
+    }
+    for (const auto &[slot, node] : _importing) {
+      Protocol::encodeRequest({"importing", std::to_string(slot), node},
+                              out);
+    }
+  }
+
+  // Links to other servers aren't handed over, they reconnect
+  std::vector<ConnectionPtr> clients;
+  std::vector<int> fds = {_fd};
+  for (const auto &[fd, conn] : _fd2Conn) {
+    if (conn->is_replica || conn->is_primary || conn->is_migration ||
+        conn->type == ConnectionType::END) {
+      continue;
+    }
+    clients.push_back(conn);
+    fds.push_back(fd);
+    std::string output;
+    for (size_t i = conn->wqueue_head; i < conn->wqueue.size(); ++i) {
+      size_t sent = i == conn->wqueue_head ? conn->wqueue_sent : 0;
+      output.append(*conn->wqueue[i], sent, std::string::npos);
+    }
+    output.append(conn->wbuf, conn->wbuf_sent, std::string::npos);
+    Protocol::encodeRequest(
+        {"conn", std::to_string(conn->id), conn->importing ? "importing" : "",
+         std::string(conn->rbuf.data(), conn->rbuf_size), output},
+        out);
+    // Tracking first, a subscriber can't enable it
+    if (conn->tracking) {
+      Args cmd = {"replay", "client", "tracking", "on"};
+      if (conn->tracking_bcast) {
+        cmd.push_back("bcast");
+        for (const auto &prefix : conn->tracking_prefixes) {
+          cmd.push_back("prefix");
+          cmd.push_back(prefix);
+        }
+      }
+      Protocol::encodeRequest(cmd, out);
+    }
+    for (bool patterns : {false, true}) {
+      const auto &names = patterns ? conn->patterns : conn->channels;
+      if (names.empty()) {
+        continue;
+      }
+      Args cmd = {"replay", patterns ? "psubscribe" : "subscribe"};
+      for (const auto &[name, pos] : names) {
+        cmd.push_back(name);
+      }
+      Protocol::encodeRequest(cmd, out);
+    }
+  }
+  Protocol::encodeRequest({"end"}, out);
+  if (!Upgrade::writeAll(_upgradeLink, out.data(), out.size()) ||
+      !Upgrade::sendFds(_upgradeLink, fds)) {
+    return false;
+  }
+
+  // The successor shares the sockets now, nothing is written to the
+  // clients until it replies "done" and we exit, or goes away and we
+  // serve them again
+  _handedOff = true;
+  _handoffDeadline = Internal::nowMs() + Upgrade::k_timeout_ms;
+  std::cout << "Handed " << clients.size()
+            << " clients over at offset " << _backlog.endOffset()
+            << std::endl;
+  return true;
+}
+
+bool ServerImpl::receiveHandoff(const Args &msg) {
+  Handoff &handoff = _handoff;
+  if (msg.size() != 5 || !Internal::parseUInt(msg[1], handoff.offset) ||
+      !Internal::parseUInt(msg[2], handoff.nextClientId)) {
+    return false;
+  }
+  handoff.primaryHost = msg[3];
+  if (!handoff.primaryHost.empty() &&
+      !Internal::parsePort(msg[4], handoff.primaryPort)) {
+    return false;
+  }
+  while (true) {
+    std::string body;
+    Args frame;
+    if (!Upgrade::readFrame(_upgradeLink, body) ||
+        !Protocol::parseRequest(body.data(), body.size(), frame) ||
+        frame.empty()) {
+      return false;
+    }
+    if (frame[0] == "end") {
+      break;
+    }
+    if (frame[0] == "conn" && frame.size() == 5) {
+      Handoff::Client client;
+      if (!Internal::parseUInt(frame[1], client.id)) {
+        return false;
+      }
+      client.importing = frame[2] == "importing";
+      client.input = std::move(frame[3]);
+      client.output = std::move(frame[4]);
+      handoff.clients.push_back(std::move(client));
+    } else if (frame[0] == "replay" && frame.size() > 1 &&
+               !handoff.clients.empty()) {
+      handoff.clients.back().replay.emplace_back(frame.begin() + 1,
+                                                 frame.end());
+    } else if (frame[0] == "slots" || frame[0] == "importing") {
+      handoff.cluster.push_back(std::move(frame));
+    } else {
+      return false;
+    }
+  }
+  if (!Upgrade::recvFds(_upgradeLink, 1 + handoff.clients.size(),
+                        handoff.fds)) {
+    return false;
+  }
+  handoff.received = true;
+  std::cout << "Received " << handoff.clients.size()
+            << " clients, serving them at offset " << handoff.offset
+            << std::endl;
+  return true;
+}
+
+void ServerImpl::finishTakeover() {
+  // The other process serves the clients until it reads this, we don't
+  // touch their sockets before
+  std::string out;
+  Protocol::encodeRequest({"done"}, out);
+  if (!Upgrade::writeAll(_upgradeLink, out.data(), out.size())) {
+    std::cout << "Lost the server to take over, exiting" << std::endl;
+    _exit(1);
+  }
+  dropUpgradeLink();
+  Handoff handoff = std::move(_handoff);
+  _handoff = Handoff();
+
+  // Its replication id and offset are ours now, its replicas continue
+  // from us and we from its primary
+  _replState = ReplState::NONE;
+  if (_primaryConn) {
+    closeConn(_primaryConn);
+  }
+  _primaryHost = handoff.primaryHost;
+  _primaryPort = handoff.primaryPort;
+  if (!_primaryHost.empty()) {
+    _replState = ReplState::CONNECT;
+    _lastReconnect = 0;
+  }
+  _nextClientId = std::max(_nextClientId, handoff.nextClientId);
+  for (const auto &frame : handoff.cluster) {
+    int start = 0, end = 0;
+    if (!_cluster) {
+      break;
+    } else if (frame[0] == "slots" && frame.size() == 4 &&
+               Internal::parseSlot(frame[1], start) &&
+               Internal::parseSlot(frame[2], end)) {
+      for (int i = start; i <= end; ++i) {
+        _slotOwner[i] = frame[3];
+      }
+    } else if (frame[0] == "importing" && frame.size() == 3 &&
+               Internal::parseSlot(frame[1], start)) {
+      _importing[start] = frame[2];
+    }
+  }
+
+  _fd = handoff.fds[0];
+  watchFd(_fd);
+  std::vector<ConnectionPtr> conns;
+  for (size_t i = 0; i < handoff.clients.size(); ++i) {
+    Handoff::Client &client = handoff.clients[i];
+    int fd = handoff.fds[i + 1];
+    // Non-blocking and without Nagle already, the flags belong to the
+    // socket
+    if (!addToEpoll(fd)) {
+      close(fd);
+      continue;
+    }
+    ConnectionPtr conn = std::make_shared<Connection>();
+    conn->fd = fd;
+    conn->id = client.id;
+    conn->type = ConnectionType::REQUEST;
+    conn->importing = client.importing;
+    conn->rbuf.assign(client.input.begin(), client.input.end());
+    conn->rbuf_size = client.input.size();
+    conn->wbuf = std::move(client.output);
+    _fd2Conn[fd] = conn;
+    startConn(conn);
+    for (auto &cmd : client.replay) {
+      // The client already got the replies
+      size_t mark = conn->wbuf.size();
+      doCommand(conn, cmd);
+      conn->wbuf.resize(mark);
+    }
+    if (conn->tracking && !conn->tracking_bcast) {
+      // The keys it read aren't known here, it drops them all
+      conn->invalidate_all = true;
+      _invalidated.push_back(conn);
+    }
+    conns.push_back(conn);
+  }
+  // They send the output and run the requests read before the handoff
+  // on the first event, a socket just added is reported writable
+  sendInvalidations();
+  _takeover = false;
+  std::cout << "Took over " << conns.size() << " clients on port " << _port
+            << std::endl;
+  // Ready for the next upgrade
+  _upgradeFd = Upgrade::listenUnix(_upgradePath);
+  if (_upgradeFd < 0 || !watchFd(_upgradeFd)) {
+    std::cout << "Error listening for upgrades at " << _upgradePath << ": "
+              << strerror(errno) << std::endl;
+  }
+}
@@ -0,0 +1,202 @@
+# Helpers for the scripted checks: start servers and talk to them.
+#
+# The server binary is $SERVER, which tests/run.sh builds and sets. Each
+# check uses its own ports so they can run side by side.
+
+import os
+import signal
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVER = os.environ.get('SERVER')
+if not SERVER:
+    sys.exit('SERVER is not set: run tests/run.sh, or set it to the path '
+             'of a server binary')
+
+SER_NIL, SER_ERR, SER_STR, SER_INT, SER_ARR, SER_PUSH = range(6)
+
+
+class Error(str):
+    """An error reply"""
+
+
+class Push(list):
+    """A push frame, e.g. a published message"""
+
+
+def encode(cmd):
+    args = [a if isinstance(a, bytes) else str(a).encode() for a in cmd]
+    body = struct.pack('<I', len(args))
+    body += b''.join(struct.pack('<I', len(a)) + a for a in args)
+    return struct.pack('<I', len(body)) + body
+
+
+def decode(buf, pos=0):
+    tag = buf[pos]
+    pos += 1
+    if tag == SER_NIL:
+        return None, pos
+    if tag in (SER_ERR, SER_STR):
+        n, = struct.unpack_from('<I', buf, pos)
+        s = buf[pos + 4:pos + 4 + n].decode(errors='replace')
+        return (Error(s) if tag == SER_ERR else s), pos + 4 + n
+    if tag == SER_INT:
+        return struct.unpack_from('<q', buf, pos)[0], pos + 8
+    if tag in (SER_ARR, SER_PUSH):
+        n, = struct.unpack_from('<I', buf, pos)
+        pos += 4
+        elems = []
+        for _ in range(n):
+            elem, pos = decode(buf, pos)
+            elems.append(elem)
+        return (Push(elems) if tag == SER_PUSH else elems), pos
+    raise ValueError('unknown tag %d' % tag)
+
+
+class Client:
+    def __init__(self, port, host='127.0.0.1', timeout=10):
+        self.sock = socket.create_connection((host, port), timeout=timeout)
+        self.buf = b''
+
+    def send(self, *cmd):
+        self.sock.sendall(encode(cmd))
+
+    def recv(self):
+        while True:
+            if len(self.buf) >= 4:
+                n, = struct.unpack_from('<I', self.buf)
+                if len(self.buf) >= 4 + n:
+                    value, _ = decode(self.buf[4:4 + n])
+                    self.buf = self.buf[4 + n:]
+                    return value
+            data = self.sock.recv(1 << 20)
+            if not data:
+                raise EOFError('connection closed')
+            self.buf += data
+
+    def __call__(self, *cmd):
+        self.send(*cmd)
+        return self.recv()
+
+    def pipeline(self, cmds):
+        self.sock.sendall(b''.join(encode(cmd) for cmd in cmds))
+        return [self.recv() for _ in cmds]
+
+    def info(self):
+        return dict(line.split(':', 1)
+                    for line in self('info').splitlines() if ':' in line)
+
+    def close(self):
+        self.sock.close()
+
+
+def decode_request(body):
+    n, = struct.unpack_from('<I', body)
+    pos, args = 4, []
+    for _ in range(n):
+        size, = struct.unpack_from('<I', body, pos)
+        args.append(body[pos + 4:pos + 4 + size].decode(errors='replace'))
+        pos += 4 + size
+    return args
+
+
+class Peer:
+    """The other end of a link the server opened or uses like one between
+    servers, e.g. as a migration target or a replica: it reads requests"""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.buf = b''
+
+    @staticmethod
+    def listen(port):
+        sock = socket.socket()
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind(('127.0.0.1', port))
+        sock.listen(1)
+        return sock
+
+    def frame(self, timeout=10):
+        """The next frame, None if nothing came for `timeout` seconds"""
+        self.sock.settimeout(timeout)
+        while True:
+            if len(self.buf) >= 4:
+                n, = struct.unpack_from('<I', self.buf)
+                if len(self.buf) >= 4 + n:
+                    body, self.buf = self.buf[4:4 + n], self.buf[4 + n:]
+                    return body
+            try:
+                data = self.sock.recv(1 << 20)
+            except socket.timeout:
+                return None
+            if not data:
+                raise EOFError('connection closed')
+            self.buf += data
+
+    def request(self, timeout=10):
+        body = self.frame(timeout)
+        return None if body is None else decode_request(body)
+
+    def reply_nil(self, count=1):
+        self.sock.sendall(struct.pack('<IB', 1, SER_NIL) * count)
+
+
+class Server:
+    """A server process on `port`, stopped on exit from a with block"""
+
+    def __init__(self, port, *args, wait=True):
+        self.port = port
+        self.logfile = tempfile.NamedTemporaryFile(
+            'w+', prefix='server-%d-' % port, suffix='.log', delete=False)
+        self.proc = subprocess.Popen(
+            [SERVER, '--port', str(port)] + [str(a) for a in args],
+            stdout=self.logfile, stderr=subprocess.STDOUT,
+            stdin=subprocess.DEVNULL)
+        if wait:
+            wait_until(self.accepting, what='server on port %d' % port)
+
+    def accepting(self):
+        if self.proc.poll() is not None:
+            raise AssertionError('server exited:\n' + self.log())
+        try:
+            socket.create_connection(('127.0.0.1', self.port), 1).close()
+            return True
+        except OSError:
+            return False
+
+    def log(self):
+        with open(self.logfile.name) as f:
+            return f.read()
+
+    def stop(self):
+        if self.proc.poll() is None:
+            self.proc.send_signal(signal.SIGKILL)
+            self.proc.wait()
+        self.logfile.close()
+        os.unlink(self.logfile.name)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        if exc[0] is not None:
+            print(self.log()[-4000:])
+        self.stop()
+
+
+def wait_until(cond, timeout=10, what='condition'):
+    deadline = time.time() + timeout
+    while not cond():
+        if time.time() > deadline:
+            raise AssertionError('timed out waiting for ' + what)
+        time.sleep(0.05)
+
+
+def expect(actual, expected, what=''):
+    if actual != expected:
+        raise AssertionError('%s: expected %r, got %r' %
+                             (what, expected, actual))
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Run every scripted check against $SERVER. Unless it is set, the server is
+# built first into a temporary directory, with the flags of the README, e.g.
+#   tests/run.sh
+#   SERVER=/path/to/server tests/run.sh
+cd "$(dirname "$0")" || exit 1
+if [ -z "$SERVER" ]; then
+  build=$(mktemp -d) || exit 1
+  trap 'rm -rf "$build"' EXIT
+  ${CXX:-g++} -std=c++20 -O2 -Wall -Wextra -Werror ../server.cpp \
+    -o "$build/server" -lpthread || exit 1
+  SERVER=$build/server
+  export SERVER
+fi
+failed=0
+for check in test_*.py; do
+  if python3 "$check"; then
+    echo "PASS $check"
+  else
+    echo "FAIL $check"
+    failed=1
+  fi
+done
+exit $failed
@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+# The pipelined benchmark at several depths, standalone and in cluster mode.
+# $BENCH is the benchmark binary, built from ../bench.cpp when not set.
+import os
+import subprocess
+import tempfile
+
+from common import Client, Server, expect
+
+
+def run(bench, *args):
+    return subprocess.run([bench] + [str(a) for a in args],
+                          capture_output=True, text=True, timeout=60)
+
+
+def check(bench):
+    with Server(19901) as server:
+        for depth in (1, 4, 16, 32, 64):
+            for kind in ('set', 'get'):
+                result = run(bench, '--port', server.port, '-n', 20000,
+                             '-P', depth, '-t', kind)
+                expect(result.returncode, 0, result.stdout + result.stderr)
+                expect('errors: 0' in result.stdout, True,
+                       'depth %d: %s' % (depth, result.stdout))
+        expect(Client(server.port)('dbsize') > 0, True, 'keys set')
+        result = run(bench, '--port', server.port, '-n', 0)
+        expect((result.returncode, 'Usage' in result.stdout), (1, True),
+               'no requests')
+
+    with Server(19902, '--cluster') as server:
+        Client(server.port)('cluster', 'addslots', 0, 16383)
+        result = run(bench, '--port', server.port, '--cluster', '-n', 20000,
+                     '-P', 16)
+        expect(result.returncode, 0, result.stdout + result.stderr)
+
+
+def main():
+    bench = os.environ.get('BENCH')
+    if bench:
+        check(bench)
+    else:
+        root = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+        with tempfile.TemporaryDirectory() as tmp:
+            bench = os.path.join(tmp, 'bench')
+            subprocess.run([os.environ.get('CXX', 'g++'), '-std=c++17', '-O2',
+                            'bench.cpp', '-o', bench, '-lpthread'],
+                           cwd=root, check=True)
+            check(bench)
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
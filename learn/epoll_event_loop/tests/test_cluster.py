@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+# Slot ownership and redirections while a slot is migrated. The target is
+# played by the script so that it decides when batches are acknowledged.
+from common import Client, Error, Peer, Server, expect
+
+PORT = 19301
+TARGET = '127.0.0.1:19302'
+
+
+def migrated_batch(target):
+    """Read a batch until the source waits for the replies, return the keys
+    it moved"""
+    keys, frames = [], 0
+    while True:
+        req = target.request(timeout=0.5)
+        if req is None:
+            return keys, frames
+        frames += 1
+        if req[0] == 'set':
+            keys.append(req[1])
+
+
+def main():
+    listener = Peer.listen(19302)
+    with Server(PORT, '--cluster') as server:
+        c = Client(server.port)
+        slot = c('cluster', 'keyslot', '{t}')
+        other = c('cluster', 'keyslot', 'foo')
+        expect(c('cluster', 'addslots', 0, 16383), None, 'addslots')
+        c('cluster', 'addslots', other, other, '127.0.0.1:19399')
+        expect(c('get', 'foo'), Error('MOVED %d 127.0.0.1:19399' % other),
+               'moved')
+        expect(c('asking'), None, 'asking')
+        expect(c('get', 'foo'), Error('MOVED %d 127.0.0.1:19399' % other),
+               'asking only allows a slot being imported')
+        expect(c('mget', 'a', 'b').startswith('CROSSSLOT'), True,
+               'crossslot')
+
+        keys = ['{t}%d' % i for i in range(300)]
+        c.pipeline([('set', k, 'v' + k) for k in keys])
+        expect(c('cluster', 'migrate', slot, TARGET), None, 'migrate')
+        target = Peer(listener.accept()[0])
+        expect(target.request()[:4],
+               ['cluster', 'setslot', str(slot), 'importing'], 'importing')
+        target.reply_nil()
+
+        moved, frames = migrated_batch(target)
+        expect(len(moved) > 0, True, 'first batch')
+        target.reply_nil(frames)
+        # The next batch is held in flight: not acknowledged
+        inflight, held = migrated_batch(target)
+        expect(len(inflight) > 0, True, 'second batch')
+        rest = [k for k in keys if k not in moved and k not in inflight]
+
+        ask = Error('ASK %d %s' % (slot, TARGET))
+        expect(c('get', moved[0]), ask, 'moved key')
+        expect(c('mget', moved[0], moved[1]), ask, 'all keys moved')
+        expect(c('get', '{t}new'), ask, 'new key')
+        expect(c('get', inflight[0]), 'v' + inflight[0], 'read in flight')
+        expect(c('set', inflight[0], 'x').startswith('TRYAGAIN'), True,
+               'write in flight')
+        expect(c('get', rest[0]), 'v' + rest[0], 'key not moved yet')
+        expect(c('mget', moved[0], rest[0]).startswith('TRYAGAIN'), True,
+               'keys split between the nodes')
+        expect(c('mget', '{t}new', rest[0]).startswith('TRYAGAIN'), True,
+               'new key and a key not moved yet')
+        expect(c('mget', rest[0], rest[1]), ['v' + rest[0], 'v' + rest[1]],
+               'keys not moved yet')
+
+        # Deleted under the migration: it ends with what is left
+        expect(c('flushall'), None, 'flushall')
+        target.reply_nil(held)
+        while True:
+            req = target.request()
+            target.reply_nil()
+            if req[:2] == ['cluster', 'setslot']:
+                expect(req[3:], ['node', TARGET], 'handover')
+                break
+        c.info()
+        expect([slot, slot, TARGET] in c('cluster', 'slots'), True,
+               'slot owned by the target')
+        expect(c('get', rest[0]), Error('MOVED %d %s' % (slot, TARGET)),
+               'moved after the handover')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,45 @@
+#!/usr/bin/env python3
+# The compress_*_bytes sizes follow the compressed values in memory as they
+# are replaced and freed
+import os
+
+from common import Client, Server, expect
+
+
+def sizes(c):
+    info = c.info()
+    return (int(info['compress_raw_bytes']),
+            int(info['compress_stored_bytes']),
+            int(info['compress_saved_bytes']))
+
+
+def main():
+    with Server(19951, '--compress-min-size', 64) as server:
+        c = Client(server.port)
+        c('set', 'a', 'x' * 10000)
+        raw, stored, saved = sizes(c)
+        expect(raw, 10000, 'raw bytes')
+        expect(saved > 0 and saved == raw - stored, True, 'saved bytes')
+
+        # Replaced by another compressed value, then an incompressible one
+        c('set', 'a', 'y' * 5000)
+        expect(sizes(c)[0], 5000, 'replaced by a compressed value')
+        c('set', 'a', os.urandom(500).hex())
+        expect(sizes(c), (0, 0, 0), 'replaced by an incompressible value')
+
+        c('set', 'a', 'x' * 10000)
+        c('set', 'b', 'x' * 20000)
+        c('set', 'c', 'x' * 30000)
+        expect(sizes(c)[0], 60000, 'three values')
+        c('del', 'a')
+        expect(sizes(c)[0], 50000, 'deleted')
+        c('unlink', 'b')
+        expect(sizes(c)[0], 30000, 'unlinked')
+        c('flushall')
+        expect(sizes(c), (0, 0, 0), 'flushed')
+        expect(int(c.info()['compress_values']), 5, 'values compressed')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
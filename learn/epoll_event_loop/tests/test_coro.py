@@ -0,0 +1,49 @@
+#!/usr/bin/env python3
+# Connections served by coroutines: requests split across reads, replies
+# larger than the socket buffer, and connection churn reusing the frames
+# without logging each connection
+import time
+
+from common import Client, Server, encode, expect
+
+CONNECTIONS = 2000
+
+
+def main():
+    with Server(19991) as server:
+        c = Client(server.port)
+
+        # One byte at a time, the coroutine waits for the rest
+        frame = encode(('set', 'k', 'v'))
+        for i in range(len(frame)):
+            c.sock.sendall(frame[i:i + 1])
+            time.sleep(0.001)
+        expect(c.recv(), None, 'split request')
+        expect(c('get', 'k'), 'v', 'value')
+
+        # Replies held until the reader catches up, others are served
+        big = 'x' * (1 << 20)
+        c('set', 'big', big)
+        reader = Client(server.port)
+        reader.sock.sendall(b''.join(encode(('get', 'big'))
+                                     for _ in range(50)))
+        time.sleep(0.2)
+        expect(c('get', 'k'), 'v', 'served while a reader is slow')
+        for _ in range(50):
+            expect(reader.recv() == big, True, 'big reply')
+        reader.close()
+
+        frames = c.info()['coro_frame_bytes']
+        for i in range(CONNECTIONS):
+            other = Client(server.port)
+            expect(other('set', 'c%d' % i, i), None, 'set')
+            other.close()
+        expect(c('dbsize'), CONNECTIONS + 2, 'keys')
+        expect(c.info()['coro_frame_bytes'], frames, 'frames reused')
+        lines = server.log().count('\n')
+        expect(lines < 10, True, 'quiet log:\n' + server.log()[-2000:])
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
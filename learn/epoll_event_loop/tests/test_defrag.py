@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# A defragmentation pass gives back the pages left sparse by deletions,
+# without pausing the clients
+import random
+import time
+
+from common import Client, Server, expect, wait_until
+
+KEYS = 200000
+
+
+def main():
+    with Server(19971, '--defrag-threshold', 0) as server:
+        c = Client(server.port)
+        rng = random.Random(1)
+        values = {}
+        for start in range(0, KEYS, 10000):
+            batch = {'key:%d' % i: 'v' * rng.randrange(16, 400)
+                     for i in range(start, start + 10000)}
+            c.pipeline([('set', k, v) for k, v in batch.items()])
+            values.update(batch)
+        # Collections moved a few buckets at a time
+        members = ['m%d' % i for i in range(5000)]
+        c('sadd', 'set', *members)
+        c('hset', 'hash', *sum([[m, m * 10] for m in members], []))
+        doomed = rng.sample(sorted(values), KEYS * 4 // 5)
+        for start in range(0, len(doomed), 10000):
+            c.pipeline([('del', k) for k in doomed[start:start + 10000]])
+        for k in doomed:
+            del values[k]
+        c('srem', 'set', *members[::2])
+        c('hdel', 'hash', *members[::2])
+        # The memory in use is that of the keyspace, added up by a walk
+        live = sum(len(k) + len(v) for k, v in values.items())
+        wait_until(lambda: live < int(c.info()['used_memory']) < 3 * live,
+                   what='memory used by the keys left')
+        before = c.info()
+        expect(c('defrag'), None, 'defrag')
+
+        # Requests keep being served while the pass runs
+        times = []
+        running = True
+        while running:
+            start = time.monotonic()
+            running = c.info()['defrag_running'] == '1'
+            c('dbsize')
+            times.append(time.monotonic() - start)
+        info = c.info()
+        expect(info['defrag_runs'], '1', 'pass done')
+        expect(int(info['defrag_moved']) > len(values), True, 'moved')
+        expect(int(info['used_memory_rss']) * 2 <
+               int(before['used_memory_rss']), True, 'memory returned')
+        times.sort()
+        expect(times[len(times) * 95 // 100] < 0.001, True,
+               '95th percentile of %d requests: %f s' %
+               (len(times), times[len(times) * 95 // 100]))
+
+        keys = sorted(values)
+        for start in range(0, len(keys), 10000):
+            got = c.pipeline([('get', k) for k in keys[start:start + 10000]])
+            expect(got, [values[k] for k in keys[start:start + 10000]],
+                   'values')
+        expect(sorted(c('smembers', 'set')), sorted(members[1::2]), 'set')
+        expect(c('hlen', 'hash'), len(members) // 2, 'hash')
+        expect(c('hget', 'hash', 'm1'), 'm1' * 10, 'hash value')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+# UNLINK and FLUSHALL ASYNC hand large values over to the background pool
+from common import Client, Server, expect
+
+
+def main():
+    with Server(19101) as server:
+        c = Client(server.port)
+        members = ['m%d' % i for i in range(5000)]
+        expect(c('sadd', 'big', *members), 5000, 'sadd')
+        expect(c('set', 'small', 'v'), None, 'set')
+        before = int(c.info()['lazyfree_submitted'])
+
+        expect(c('unlink', 'big', 'small', 'missing'), 2, 'unlink')
+        expect(int(c.info()['lazyfree_submitted']), before + 1,
+               'only the large value goes to the pool')
+        expect(c('scard', 'big'), 0, 'unlinked set')
+
+        c('sadd', 'big', *members)
+        c('hset', 'h', 'f', 'v')
+        expect(c('flushall', 'async'), None, 'flushall async')
+        expect(c('dbsize'), 0, 'dbsize after flushall')
+        expect(int(c.info()['lazyfree_submitted']), before + 2,
+               'the table goes to the pool')
+        # The loop serves writes while the pool frees the old table
+        expect(c('set', 'k', 'v'), None, 'set after flushall')
+        expect(c('get', 'k'), 'v', 'get after flushall')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
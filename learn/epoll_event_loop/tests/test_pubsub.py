@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# Published messages queued behind output a subscriber hasn't read yet, and
+# subscribers too slow to keep up
+
+from common import Client, Push, Server, expect, wait_until
+
+
+def main():
+    with Server(19601) as server:
+        sub = Client(server.port)
+        pub = Client(server.port)
+        # A reply larger than the socket buffers, partly sent when the
+        # messages are queued behind it
+        channels = ['c'] + ['%04d' % i + 'x' * 2000 for i in range(6000)]
+        sub.send('subscribe', *channels)
+        wait_until(lambda: pub('publish', 'c', 'first') == 1,
+                   what='subscription')
+        for i in range(100):
+            expect(pub('publish', 'c', 'msg%d' % i), 1, 'publish')
+
+        reply = sub.recv()
+        expect(len(reply), len(channels), 'subscribe reply')
+        expect(reply[-1], ['subscribe', channels[-1], len(channels)],
+               'last subscription')
+        expect(sub.recv(), Push(['message', 'c', 'first']), 'first message')
+        for i in range(100):
+            expect(sub.recv(), Push(['message', 'c', 'msg%d' % i]),
+                   'message %d' % i)
+
+        # A subscriber that doesn't read is dropped past its output limit
+        slow = Client(server.port)
+        expect(slow('subscribe', 'd'), [['subscribe', 'd', 1]], 'subscribe')
+        message = 'm' * (1 << 20)
+        for _ in range(64):
+            pub('publish', 'd', message)
+        expect(int(pub.info()['pubsub_slow_subscribers_dropped']), 1,
+               'slow subscriber dropped')
+        expect(pub('publish', 'd', 'x'), 0, 'no subscriber left')
+        expect('too slow' in server.log(), False, 'not logged')
+
+        # Unsubscribing from one channel keeps the others
+        sub = Client(server.port)
+        sub('subscribe', 'a', 'b')
+        expect(sub('unsubscribe', 'a'), [['unsubscribe', 'a', 1]],
+               'unsubscribe')
+        expect(pub('publish', 'b', 'm'), 1, 'still subscribed to b')
+        expect(pub('publish', 'a', 'm'), 0, 'unsubscribed from a')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
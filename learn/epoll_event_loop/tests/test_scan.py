@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# SCAN, HSCAN and SSCAN cursors and MATCH patterns, and the size of the
+# entries they walk
+import time
+
+from common import Client, Server, expect
+
+
+def scan_all(c, *cmd):
+    cursor, seen = '0', []
+    while True:
+        cursor, batch = c(*cmd[:-1], cursor, *cmd[-1])
+        seen += batch
+        if cursor == '0':
+            return seen
+
+
+def main():
+    with Server(19201) as server:
+        c = Client(server.port)
+        keys = ['user:%d' % i for i in range(2000)]
+        c.pipeline([('set', k, 'v') for k in keys])
+        c('sadd', 'set', *['m%d' % i for i in range(500)])
+        c('hset', 'hash', *sum([['f%d' % i, 'v'] for i in range(500)], []))
+        expect(c('dbsize'), len(keys) + 2, 'dbsize')
+        expect(c.info()['keys'], str(len(keys) + 2), 'keys in info')
+
+        found = set(scan_all(c, 'scan', ['count', '100']))
+        expect(found >= set(keys), True, 'every key returned by scan')
+        found = scan_all(c, 'scan', ['match', 'user:1[0-4]?', 'count', '50'])
+        expect(sorted(found),
+               sorted('user:%d' % i for i in range(100, 150)), 'match')
+        expect(scan_all(c, 'scan', ['type', 'hash']), ['hash'], 'type')
+        members = scan_all(c, 'sscan', 'set', ['match', 'm4?'])
+        expect(sorted(members), sorted('m4%d' % i for i in range(10)),
+               'sscan match')
+        fields = scan_all(c, 'hscan', 'hash', ['match', 'f\\1*'])
+        expect(len(fields), 2 * 111, 'hscan match with an escape')
+
+        # Patterns are matched on the whole key, NUL bytes included
+        c('set', b'bin\x00key', 'v')
+        expect(scan_all(c, 'scan', ['match', 'bin?key']), ['bin\x00key'],
+               'binary key')
+        expect(scan_all(c, 'scan', ['match', 'bin']), [], 'no prefix match')
+
+        # Many stars against a long key that almost matches: bounded time
+        c('set', 'a' * 4000, 'v')
+        start = time.time()
+        expect(scan_all(c, 'scan', ['match', 'a*' * 40 + 'b']), [],
+               'pathological pattern')
+        expect(time.time() - start < 2, True, 'pathological pattern is fast')
+        expect(len(scan_all(c, 'scan', ['match', 'a*' * 40])), 1,
+               'stars matching')
+
+        # COUNT is capped, a huge one neither walks everything nor overflows
+        for count in ('100000000', str(2 ** 64 - 1), str(2 ** 63)):
+            cursor, batch = c('scan', '0', 'count', count)
+            expect((cursor != '0', len(batch) < 1100), (True, True),
+                   'count ' + count)
+
+    # A string key doesn't carry the tables of a set and a hash
+    with Server(19202) as server:
+        c = Client(server.port)
+        before = int(c.info()['used_memory_rss'])
+        for start in range(0, 100000, 10000):
+            c.pipeline([('set', 'key:%d' % i, 'v')
+                        for i in range(start, start + 10000)])
+        per_key = (int(c.info()['used_memory_rss']) - before) / 100000
+        expect(per_key < 250, True, '%d bytes per key' % per_key)
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+# Snapshots and slot migrations send large sets and hashes a batch of members
+# at a time, as the other end reads them
+import time
+
+from common import Client, Peer, Server, expect
+
+MEMBERS = ['member:%07d' % i for i in range(1000000)]
+# Output held for a link that doesn't read: the watermark and what one
+# step adds to it
+MAX_UNSENT = 3 << 20
+
+
+def fill(c, key):
+    for i in range(0, len(MEMBERS), 10000):
+        c.send('sadd', key, *MEMBERS[i:i + 10000])
+    for i in range(0, len(MEMBERS), 10000):
+        c.recv()
+
+
+def info_field(c, name, field):
+    """A field of an info line like name:a=1,b=2"""
+    value = c.info()[name]
+    pairs = [kv.split('=', 1) for kv in value.split(',') if '=' in kv]
+    return dict(pairs)[field]
+
+
+def apply(peer, until):
+    """Apply the requests of `peer` to a dict of sets and hashes until one
+    starting with `until`"""
+    data = {}
+    while True:
+        req = peer.request()
+        if req[:len(until)] == until:
+            return data
+        if req[0] == 'sadd':
+            data.setdefault(req[1], set()).update(req[2:])
+        elif req[0] == 'srem':
+            data.setdefault(req[1], set()).difference_update(req[2:])
+        elif req[0] == 'hset':
+            fields = data.setdefault(req[1], {})
+            fields.update(zip(req[2::2], req[3::2]))
+        elif req[0] == 'set':
+            data[req[1]] = req[2]
+        elif req[0] == 'del':
+            data.pop(req[1], None)
+
+
+def check_snapshot():
+    with Server(19401) as server:
+        c = Client(server.port)
+        fill(c, 'big')
+        c('hset', 'hash', *sum([['f%d' % i, 'v%d' % i]
+                                for i in range(3000)], []))
+        c('set', 'k', 'v')
+
+        replica = Client(server.port)
+        expect(replica('psync', '?', '0').startswith('FULLRESYNC'), True,
+               'full resync')
+        # The replica doesn't read: the snapshot waits for it
+        time.sleep(0.5)
+        unsent = int(info_field(c, 'replica0', 'unsent'))
+        expect(unsent < MAX_UNSENT, True, 'unsent %d bytes' % unsent)
+        expect(c('get', 'k'), 'v', 'served during the snapshot')
+        expect(c('srem', 'big', MEMBERS[0]), 1, 'srem during the snapshot')
+        expect(c('sadd', 'big', 'new'), 1, 'sadd during the snapshot')
+
+        peer = Peer(replica.sock)
+        peer.buf = replica.buf
+        data = apply(peer, ['replconf', 'snapshot-end'])
+        expect(data['k'], 'v', 'string')
+        expect(len(data['hash']), 3000, 'hash fields')
+        expect(data['hash']['f2999'], 'v2999', 'hash value')
+        # Then the writes made meanwhile, the snapshot may reflect them
+        # already
+        big = data['big']
+        expect(peer.request(), ['srem', 'big', MEMBERS[0]], 'replayed srem')
+        big.discard(MEMBERS[0])
+        expect(peer.request(), ['sadd', 'big', 'new'], 'replayed sadd')
+        big.add('new')
+        expect(big == set(MEMBERS[1:]) | {'new'}, True, 'replica set')
+
+
+def check_migration():
+    listener = Peer.listen(19404)
+    with Server(19403, '--cluster') as server:
+        c = Client(server.port)
+        c('cluster', 'addslots', 0, 16383)
+        slot = c('cluster', 'keyslot', '{b}')
+        fill(c, '{b}big')
+        c('set', '{b}k', 'v')
+        c('cluster', 'migrate', slot, '127.0.0.1:19404')
+        target = Peer(listener.accept()[0])
+        target.request()
+        target.reply_nil()
+        # The target doesn't read the batch
+        time.sleep(0.5)
+        unsent = int(info_field(c, 'cluster_migrating', 'unsent'))
+        expect(unsent < MAX_UNSENT, True, 'unsent %d bytes' % unsent)
+        expect(c('get', '{b}k'), 'v', 'served during the migration')
+
+        members = set()
+        while True:
+            req = target.request()
+            target.reply_nil()
+            if req[:2] == ['cluster', 'setslot']:
+                break
+            if req[0] == 'sadd':
+                members.update(req[2:])
+        expect(members == set(MEMBERS), True, 'migrated set')
+        expect(c('get', '{b}k').startswith('MOVED'), True, 'slot moved')
+
+    # Deleted while it is sent: deleted on the target too
+    with Server(19403, '--cluster') as server:
+        c = Client(server.port)
+        c('cluster', 'addslots', 0, 16383)
+        fill(c, '{b}big')
+        c('cluster', 'migrate', slot, '127.0.0.1:19404')
+        target = Peer(listener.accept()[0])
+        target.request()
+        target.reply_nil()
+        expect(target.request(), ['del', '{b}big'], 'del first')
+        expect(target.request()[0], 'sadd', 'first members')
+        expect(c('flushall'), None, 'flushall')
+        while True:
+            req = target.request()
+            target.reply_nil()
+            if req[0] != 'sadd':
+                break
+        expect(req, ['del', '{b}big'], 'del after flushall')
+
+
+def main():
+    check_snapshot()
+    check_migration()
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
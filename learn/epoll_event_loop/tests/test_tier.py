@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+# Values in the tier are loaded back by the commands reading them, which
+# wait in the middle of the request, and are read off the event loop by
+# snapshots and migrations, staying in the tier
+import os
+import tempfile
+
+from common import Client, Peer, Push, Server, encode, expect, wait_until
+
+
+def tiered_server(port, tmp, *args):
+    return Server(port, '--tier-dir', tmp, '--tier-idle-secs', 0,
+                  '--tier-min-size', 64, '--compress-min-size', 1024, *args)
+
+
+def fill(c, prefix):
+    values = {}
+    for i in range(500):
+        # Half compressed, half not
+        values['%sz%d' % (prefix, i)] = os.urandom(100).hex() * 10
+        values['%sr%d' % (prefix, i)] = os.urandom(300).hex()
+    c.pipeline([('set', k, v) for k, v in values.items()])
+    wait_until(lambda: int(c.info()['tier_demoted']) >= len(values),
+               what='values moved to the tier')
+    return values
+
+
+def check_loads(tmp):
+    with tiered_server(19505, tmp) as server:
+        c = Client(server.port)
+        values = fill(c, '')
+        keys = sorted(values)
+        reader = Client(server.port)
+        reader('client', 'tracking', 'on')
+        c('set', 'small', 'v')
+        expect(reader('get', 'small'), 'v', 'tracked')
+
+        # Pipelined gets, each waiting for its value, and a push queued
+        # while they wait: the replies come in order around it
+        reader.sock.sendall(b''.join(
+            encode(('get', k)) for k in keys) + encode(('mget', *keys[:50])))
+        c('set', 'small', 'w')
+        replies, pushes = [], []
+        while len(replies) < len(keys) + 1:
+            reply = reader.recv()
+            (pushes if isinstance(reply, Push) else replies).append(reply)
+        expect(replies[:-1] == [values[k] for k in keys], True, 'gets')
+        expect(replies[-1] == [values[k] for k in keys[:50]], True, 'mget')
+        expect(pushes, [['invalidate', ['small']]], 'push')
+        # Cold again right away with an idle time of 0, loaded again then
+        expect(int(c.info()['tier_loaded']) >= len(keys), True,
+               'values loaded')
+        expect(reader('get', keys[0]), values[keys[0]], 'in memory again')
+
+
+def check_snapshot(tmp):
+    with tiered_server(19501, tmp) as server:
+        c = Client(server.port)
+        values = fill(c, '')
+        replica = Client(server.port)
+        expect(replica('psync', '?', '0').startswith('FULLRESYNC'), True,
+               'full resync')
+        peer = Peer(replica.sock)
+        peer.buf = replica.buf
+        got = {}
+        while True:
+            req = peer.request()
+            if req == ['replconf', 'snapshot-end']:
+                break
+            expect(req[0], 'set', 'snapshot command')
+            got[req[1]] = req[2]
+        expect(got == values, True, 'snapshot values')
+        info = c.info()
+        expect(int(info['tier_copy_reads']), len(values), 'tier reads')
+        expect(int(info['tier_loaded']), 0, 'values left in the tier')
+        expect(c('get', 'z7'), values['z7'], 'get after the snapshot')
+
+
+def check_migration(tmp):
+    listener = Peer.listen(19504)
+    with tiered_server(19503, tmp, '--cluster') as server:
+        c = Client(server.port)
+        c('cluster', 'addslots', 0, 16383)
+        slot = c('cluster', 'keyslot', '{t}')
+        values = fill(c, '{t}')
+        c('cluster', 'migrate', slot, '127.0.0.1:19504')
+        target = Peer(listener.accept()[0])
+        got = {}
+        while True:
+            req = target.request()
+            target.reply_nil()
+            if req[:2] == ['cluster', 'setslot'] and req[3] == 'node':
+                break
+            if req[0] == 'set':
+                got[req[1]] = req[2]
+        expect(got == values, True, 'migrated values')
+        expect(int(c.info()['tier_copy_reads']), len(values), 'tier reads')
+        expect(c('dbsize'), 0, 'keys deleted once moved')
+
+
+def main():
+    with tempfile.TemporaryDirectory() as tmp:
+        check_loads(os.path.join(tmp, 'loads'))
+        check_snapshot(os.path.join(tmp, 'snapshot'))
+        check_migration(os.path.join(tmp, 'migration'))
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
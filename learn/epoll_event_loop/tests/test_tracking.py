@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+# Client side caching: invalidations in default and broadcast mode
+import time
+
+from common import Client, Push, Server, expect
+
+
+def invalidated(c):
+    """Keys of the next invalidation push"""
+    push = c.recv()
+    expect(isinstance(push, Push) and push[0] == 'invalidate', True,
+           'invalidation push %r' % (push,))
+    return push[1]
+
+
+def main():
+    with Server(19701) as server:
+        w = Client(server.port)
+        users = Client(server.port)
+        expect(users('client', 'tracking', 'on', 'bcast', 'prefix', 'user:',
+                     'prefix', 'order:1'), None, 'tracking on')
+        every = Client(server.port)
+        every('client', 'tracking', 'on', 'bcast')
+        many = Client(server.port)
+        prefixes = ['p%d:' % i for i in range(10000)]
+        many('client', 'tracking', 'on', 'bcast',
+             *sum([['prefix', p] for p in prefixes], []))
+        reader = Client(server.port)
+        reader('client', 'tracking', 'on')
+        expect(int(w.info()['tracking_prefixes']), 10003, 'prefixes')
+
+        reader('get', 'user:1')
+        w('set', 'user:1', 'v')
+        expect(invalidated(users), ['user:1'], 'prefix')
+        expect(invalidated(every), ['user:1'], 'empty prefix')
+        expect(invalidated(reader), ['user:1'], 'key read')
+        w('set', 'order:12', 'v')
+        expect(invalidated(users), ['order:12'], 'longer key')
+        expect(invalidated(every), ['order:12'], 'every key')
+        w('set', 'p9999:x', 'v')
+        expect(invalidated(many), ['p9999:x'], 'one of many prefixes')
+        expect(invalidated(every), ['p9999:x'], 'every key')
+        # Shorter than the prefix, or diverging from it
+        w('mset', 'order:', 'v', 'use', 'v', 'p1', 'v', 'q1:', 'v')
+        expect(invalidated(every), ['order:', 'use', 'p1', 'q1:'], 'mset')
+        expect(users('dbsize'), 7, 'no invalidation for users')
+        expect(many('dbsize'), 7, 'no invalidation for many')
+
+        many('client', 'tracking', 'off')
+        expect(int(w.info()['tracking_prefixes']), 3, 'prefixes removed')
+        w('set', 'p1:x', 'v')
+        expect(invalidated(every), ['p1:x'], 'every key')
+        expect(many('dbsize'), 8, 'tracking off')
+        users('client', 'tracking', 'on', 'bcast', 'prefix', 'user:1')
+        w('set', 'user:2', 'v')
+        w('set', 'user:10', 'v')
+        expect(invalidated(users), ['user:10'], 'prefix replaced')
+
+        # A write only visits the prefixes of its key, however many there are
+        many('client', 'tracking', 'on', 'bcast',
+             *sum([['prefix', p] for p in prefixes], []))
+        start = time.time()
+        w.pipeline([('set', 'x%d' % i, 'v') for i in range(20000)])
+        expect(time.time() - start < 1, True, 'writes with many prefixes')
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,102 @@
+#!/usr/bin/env python3
+# Hot upgrade: a successor takes the clients over, and a successor that
+# goes away or stalls leaves the running server serving them
+import os
+import socket
+import tempfile
+import time
+
+from common import Client, Peer, Server, encode, expect, wait_until
+
+PORT = 19981
+
+
+def attach(path):
+    """A fake successor on the upgrade socket, attached"""
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(path)
+    peer = Peer(sock)
+    expect(peer.request(), ['attached'], 'attached')
+    return peer
+
+
+def served(c, what):
+    """Seconds for `c` to get the reply of a request sent while frozen"""
+    start = time.monotonic()
+    expect(c.recv(), 'v', what)
+    return time.monotonic() - start
+
+
+def main():
+    with tempfile.TemporaryDirectory() as tmp:
+        path = os.path.join(tmp, 'upgrade.sock')
+        with Server(PORT, '--upgrade-socket', path) as server:
+            c = Client(PORT)
+            c('set', 'k', 'v')
+            sub = Client(PORT)
+            sub('subscribe', 'ch')
+
+            # Gone after the handoff: the clients are served again at once
+            peer = attach(path)
+            peer.sock.sendall(encode(('ready',)))
+            expect(peer.request()[0], 'handoff', 'handoff')
+            c.send('get', 'k')
+            time.sleep(0.2)
+            peer.sock.close()
+            expect(served(c, 'served after the successor left') < 1, True,
+                   'resumed')
+
+            # No "done": the clients are served again after the timeout
+            peer = attach(path)
+            peer.sock.sendall(encode(('ready',)))
+            expect(peer.request()[0], 'handoff', 'handoff')
+            c.send('get', 'k')
+            elapsed = served(c, 'served after the timeout')
+            expect(1 < elapsed < 5, True, 'waited %f s' % elapsed)
+            expect('take over in time' in server.log(), True, 'timed out')
+            peer.sock.close()
+
+            # Stalled in the middle of a message
+            peer = attach(path)
+            peer.sock.sendall(encode(('ready',))[:6])
+            time.sleep(0.1)
+            start = time.monotonic()
+            expect(c('get', 'k'), 'v', 'served after a partial message')
+            expect(time.monotonic() - start < 5, True, 'bounded stall')
+            peer.sock.close()
+            wait_until(lambda: 'Lost the successor' in server.log(),
+                       what='upgrade aborted')
+            expect(c('publish', 'ch', 'm'), 1, 'still subscribed')
+            expect(sub.recv(), ['message', 'ch', 'm'], 'message')
+
+            # A real successor takes over, the connections stay open
+            with Server(PORT, '--upgrade-socket', path, '--takeover',
+                        wait=False) as successor:
+                wait_until(lambda: server.proc.poll() is not None,
+                           what='the old process to exit')
+                expect(server.proc.returncode, 0, 'exit code')
+                expect(c('get', 'k'), 'v', 'value after the upgrade')
+                expect(c('publish', 'ch', 'm2'), 1, 'subscriber handed over')
+                expect(sub.recv(), ['message', 'ch', 'm2'], 'message')
+                expect('Took over 2 clients' in successor.log(), True,
+                       successor.log())
+
+        # The successor exits if the running server goes away first
+        path = os.path.join(tmp, 'gone.sock')
+        listener = socket.socket(socket.AF_UNIX)
+        listener.bind(path)
+        listener.listen(1)
+        with Server(PORT + 1, '--upgrade-socket', path, '--takeover',
+                    wait=False) as successor:
+            link, _ = listener.accept()
+            link.sendall(encode(('attached',)))
+            link.close()
+            wait_until(lambda: successor.proc.poll() is not None,
+                       what='the successor to exit')
+            expect(successor.proc.returncode, 1, 'exit code')
+        listener.close()
+    print('ok')
+
+
+if __name__ == '__main__':
+    main()
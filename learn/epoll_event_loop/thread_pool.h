@@ -0,0 +1,153 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Small pool of background workers for work that must not run on the event
+// loop thread and doesn't need the live data: freeing huge objects,
+// returning memory to the system, disk I/O.
+//
+// Work over the live keyspace (snapshots, key statistics, defragmentation)
+// isn't done here, a task can't see it. The loop does it in bounded steps.
+//
+// Handoff rules:
+//  - A task owns everything it touches. The event loop moves objects into
+//    the task (e.g. an unlinked entry) and never looks at them again.
+//  - Tasks never read or write the live keyspace or any connection.
+//  - submit() only takes a short lock to enqueue, the event loop doesn't
+//    wait for the tasks it submitted.
+//  - A task that has a result posts it to a CompletionQueue, the event loop
+//    applies it.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  explicit ThreadPool(size_t numThreads);
+  ~ThreadPool();
+
+  void submit(Task task);
+  // Number of submitted tasks not finished yet
+  size_t pending() const { return _pending.load(std::memory_order_relaxed); }
+
+private:
+  void run();
+
+private:
+  std::mutex _mutex;
+  std::condition_variable _cond;
+  std::deque<Task> _tasks;
+  std::vector<std::thread> _workers;
+  std::atomic<size_t> _pending{0};
+  bool _stopped = false;
+};
+
+inline ThreadPool::ThreadPool(size_t numThreads) {
+  for (size_t i = 0; i < numThreads; ++i) {
+    _workers.emplace_back([this]() { run(); });
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopped = true;
+  }
+  _cond.notify_all();
+  for (auto &worker : _workers) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+}
+
+inline void ThreadPool::submit(Task task) {
+  _pending.fetch_add(1, std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _tasks.push_back(std::move(task));
+  }
+  _cond.notify_one();
+}
+
+inline void ThreadPool::run() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _cond.wait(lock, [this]() { return _stopped || !_tasks.empty(); });
+      if (_tasks.empty()) {
+        // Stopped and drained
+        return;
+      }
+      task = std::move(_tasks.front());
+      _tasks.pop_front();
+    }
+    task();
+    // Destroy the task here so that whatever it captured is released on this
+    // thread, not on the event loop
+    task = nullptr;
+    _pending.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+// Results handed back to the event loop by the workers.
+//
+// post() queues a callback and wakes the loop through an eventfd it polls
+// along with the sockets. The loop runs the callbacks with run(), they may
+// touch anything the loop owns.
+class CompletionQueue {
+public:
+  using Task = std::function<void()>;
+
+  CompletionQueue() : _fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+  ~CompletionQueue() {
+    if (_fd >= 0) {
+      close(_fd);
+    }
+  }
+
+  int fd() const { return _fd; }
+
+  void post(Task task) {
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      // The loop takes every task at once, one wakeup is enough
+      wake = _tasks.empty();
+      _tasks.push_back(std::move(task));
+    }
+    if (wake) {
+      uint64_t one = 1;
+      ssize_t rv = write(_fd, &one, sizeof(one));
+      (void)rv;
+    }
+  }
+
+  // Event loop side
+  void run() {
+    uint64_t n = 0;
+    ssize_t rv = read(_fd, &n, sizeof(n));
+    (void)rv;
+    std::vector<Task> tasks;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      tasks.swap(_tasks);
+    }
+    for (auto &task : tasks) {
+      task();
+    }
+  }
+
+private:
+  int _fd;
+  std::mutex _mutex;
+  std::vector<Task> _tasks;
+};
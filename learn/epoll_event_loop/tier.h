@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Cold values spilled to append-only segment files on local disk.
+//
+// Keys and metadata stay in memory, an entry whose value is on disk holds an
+// Extent naming its segment, offset and length. Values are written in
+// batches: the event loop reserves room at the end of the active segment and
+// a worker writes the batch there. A record is [u32 key len][u32 value len]
+// [key][value], so compaction can tell from the file alone which key a value
+// belonged to.
+//
+// A segment counts its live bytes, those still referenced by an Extent.
+// Dropping an Extent (the value was overwritten, deleted or loaded back)
+// releases them, possibly on a worker freeing the entry. A sealed segment
+// with no live bytes is deleted. One that is mostly garbage is compacted:
+// its live records are written again at the end, which empties it.
+//
+// Segments are shared with the I/O in flight, the file is closed, and
+// removed if dead, once the last user drops it.
+struct TierSegment {
+  TierSegment(uint64_t id, int fd, std::string path)
+      : id(id), fd(fd), path(std::move(path)) {}
+  ~TierSegment() {
+    close(fd);
+    if (dead) {
+      unlink(path.c_str());
+    }
+  }
+
+  const uint64_t id;
+  const int fd;
+  const std::string path;
+  // Event loop side: bytes reserved, and batch writes still in flight
+  uint64_t size = 0;
+  size_t writes = 0;
+  bool dead = false;
+  std::atomic<uint64_t> live{0};
+};
+using TierSegmentPtr = std::shared_ptr<TierSegment>;
+
+// A value stored in a segment
+struct Extent {
+  Extent(TierSegmentPtr segment, uint64_t offset, uint32_t len)
+      : segment(std::move(segment)), offset(offset), len(len) {
+    this->segment->live.fetch_add(len, std::memory_order_relaxed);
+  }
+  ~Extent() { segment->live.fetch_sub(len, std::memory_order_relaxed); }
+  Extent(const Extent &) = delete;
+  Extent &operator=(const Extent &) = delete;
+
+  TierSegmentPtr segment;
+  // Of the value, past the record header and the key
+  uint64_t offset;
+  uint32_t len;
+};
+
+class TierStore {
+public:
+  // A record written or found in a segment
+  struct Record {
+    std::string key;
+    // Of the value in the segment
+    uint64_t offset;
+    uint32_t len;
+  };
+
+  // Use `dir` for the segments, removing those left by a previous run
+  bool open(const std::string &dir, uint64_t segmentSize) {
+    if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+      return false;
+    }
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+      return false;
+    }
+    while (dirent *ent = readdir(d)) {
+      std::string name = ent->d_name;
+      if (name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0) {
+        unlink((dir + "/" + name).c_str());
+      }
+    }
+    closedir(d);
+    _dir = dir;
+    _segmentSize = segmentSize;
+    return true;
+  }
+
+  bool enabled() const { return !_dir.empty(); }
+
+  // Reserve `bytes` at the end of the active segment, starting a new one if
+  // it's full. Returns nullptr if a segment can't be created.
+  TierSegmentPtr reserve(size_t bytes, uint64_t &offset) {
+    if (_segments.empty() || (_segments.back()->size > 0 &&
+                              _segments.back()->size + bytes > _segmentSize)) {
+      std::string path = _dir + "/" + std::to_string(_nextId) + ".seg";
+      int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+      if (fd < 0) {
+        return nullptr;
+      }
+      _segments.push_back(std::make_shared<TierSegment>(_nextId++, fd, path));
+    }
+    TierSegmentPtr &segment = _segments.back();
+    offset = segment->size;
+    segment->size += bytes;
+    ++segment->writes;
+    return segment;
+  }
+
+  // Append a record to `batch`, returns the offset of the value in it
+  static uint64_t appendRecord(std::string &batch, const std::string &key,
+                               const char *value, uint32_t len) {
+    char header[8];
+    uint32_t keyLen = (uint32_t)key.size();
+    memcpy(header, &keyLen, 4);
+    memcpy(header + 4, &len, 4);
+    batch.append(header, 8);
+    batch.append(key);
+    uint64_t offset = batch.size();
+    batch.append(value, len);
+    return offset;
+  }
+
+  // Drop the sealed segments with no live bytes, returns how many
+  size_t reclaim() {
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < _segments.size();) {
+      TierSegment &segment = *_segments[i];
+      if (segment.writes == 0 &&
+          segment.live.load(std::memory_order_relaxed) == 0) {
+        segment.dead = true;
+        _segments.erase(_segments.begin() + i);
+        ++n;
+      } else {
+        ++i;
+      }
+    }
+    return n;
+  }
+
+  // The sealed segment with the least live bytes if under `ratio` of its
+  // size, nullptr if none
+  TierSegmentPtr pickCompaction(double ratio) const {
+    TierSegmentPtr best;
+    double bestRatio = ratio;
+    for (size_t i = 0; i + 1 < _segments.size(); ++i) {
+      const TierSegmentPtr &segment = _segments[i];
+      if (segment->writes > 0 || segment->size == 0) {
+        continue;
+      }
+      double r = (double)segment->live.load(std::memory_order_relaxed) /
+                 (double)segment->size;
+      if (r < bestRatio) {
+        best = segment;
+        bestRatio = r;
+      }
+    }
+    return best;
+  }
+
+  size_t segments() const { return _segments.size(); }
+
+  uint64_t diskBytes() const {
+    uint64_t n = 0;
+    for (const auto &segment : _segments) {
+      n += segment->size;
+    }
+    return n;
+  }
+
+  uint64_t liveBytes() const {
+    uint64_t n = 0;
+    for (const auto &segment : _segments) {
+      n += segment->live.load(std::memory_order_relaxed);
+    }
+    return n;
+  }
+
+  // Worker side, blocking
+  static bool writeAt(int fd, const std::string &data, uint64_t offset) {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t rv = pwrite(fd, data.data() + done, data.size() - done,
+                          (off_t)(offset + done));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        return false;
+      }
+      done += (size_t)rv;
+    }
+    return true;
+  }
+
+  static bool readAt(int fd, std::string &out, uint64_t offset, size_t len) {
+    out.resize(len);
+    size_t done = 0;
+    while (done < len) {
+      ssize_t rv = pread(fd, &out[done], len - done, (off_t)(offset + done));
+      if (rv < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rv <= 0) {
+        return false;
+      }
+      done += (size_t)rv;
+    }
+    return true;
+  }
+
+  // Records of a segment read whole, stopping at the first inconsistent one
+  static std::vector<Record> parseRecords(const std::string &data) {
+    std::vector<Record> records;
+    size_t pos = 0;
+    while (data.size() - pos >= 8) {
+      uint32_t keyLen = 0, len = 0;
+      memcpy(&keyLen, &data[pos], 4);
+      memcpy(&len, &data[pos + 4], 4);
+      if (keyLen == 0 || data.size() - pos - 8 < (uint64_t)keyLen + len) {
+        break;
+      }
+      records.push_back({data.substr(pos + 8, keyLen), pos + 8 + keyLen, len});
+      pos += 8 + keyLen + len;
+    }
+    return records;
+  }
+
+private:
+  std::string _dir;
+  uint64_t _segmentSize = 0;
+  uint64_t _nextId = 0;
+  // Oldest first, the last one is active
+  std::vector<TierSegmentPtr> _segments;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "hashtable.h"
+#include "trie.h"
+
+// Who must be told when a key changes, for client side caching.
+//
+// In the default mode the table remembers the clients that read each key.
+// An entry is dropped once invalidated, the client reads the key again if it
+// still cares. The number of keys is bounded: over the limit, keys are
+// evicted and their clients invalidated as if the keys had changed.
+//
+// In broadcast mode clients register key prefixes instead and are told about
+// every change under them, nothing is remembered per key. The prefixes are
+// stored in a trie, a change walks it along the key and only visits the
+// prefixes of that key.
+//
+// Clients are referred to by id so closing one doesn't have to walk the
+// table, ids of clients that went away are skipped when invalidating.
+class TrackingTable {
+public:
+  explicit TrackingTable(size_t maxKeys) : _maxKeys(maxKeys) {}
+
+  void track(const std::string &key, uint64_t id) {
+    std::vector<uint64_t> &ids = *_keys.findOrInsert(key).first;
+    if (std::find(ids.begin(), ids.end(), id) == ids.end()) {
+      ids.push_back(id);
+    }
+  }
+
+  // Forget `key`, calling fn(id) for each client that read it
+  template <typename F> void invalidate(const std::string &key, F &&fn) {
+    std::vector<uint64_t> ids;
+    if (_keys.erase(key, &ids)) {
+      for (uint64_t id : ids) {
+        fn(id);
+      }
+    }
+    _prefixTrie.forEachPrefixOf(key, fn);
+  }
+
+  // Evict up to `budget` keys above the limit, calling fn(key, id) for each
+  // client that read them. Returns the number of keys evicted.
+  template <typename F> size_t evictOverLimit(size_t budget, F &&fn) {
+    if (_keys.size() <= _maxKeys) {
+      return 0;
+    }
+    size_t n = std::min(budget, _keys.size() - _maxKeys);
+    // Take the keys in scan order, roughly random with respect to their age
+    std::vector<std::string> victims;
+    do {
+      _evictCursor = _keys.scan(
+          _evictCursor, [&](const std::string &key, std::vector<uint64_t> &) {
+            victims.push_back(key);
+          });
+    } while (victims.size() < n && _evictCursor != 0);
+    for (const auto &key : victims) {
+      std::vector<uint64_t> ids;
+      _keys.erase(key, &ids);
+      for (uint64_t id : ids) {
+        fn(key, id);
+      }
+    }
+    return victims.size();
+  }
+
+  void clearKeys() { _keys.clear(); }
+
+  void addPrefix(const std::string &prefix, uint64_t id) {
+    _prefixTrie.insert(prefix, id);
+  }
+
+  void removePrefix(const std::string &prefix, uint64_t id) {
+    _prefixTrie.erase(prefix, id);
+  }
+
+  size_t keys() const { return _keys.size(); }
+  size_t prefixes() const { return _prefixTrie.prefixes(); }
+
+private:
+  Dict<std::string, std::vector<uint64_t>> _keys;
+  // Broadcast mode, client ids by prefix
+  PrefixTrie<uint64_t> _prefixTrie;
+  size_t _maxKeys;
+  uint64_t _evictCursor = 0;
+};
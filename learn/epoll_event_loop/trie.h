@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Values stored under string prefixes, one node per character.
+//
+// Looking a key up visits the prefixes of that key only, whatever the
+// number of prefixes stored. Nodes have few children, kept in a vector
+// searched linearly. Nodes left without values or children are pruned.
+template <typename T> class PrefixTrie {
+public:
+  void insert(const std::string &prefix, T value) {
+    Node *node = &_root;
+    for (char c : prefix) {
+      node = node->child(c, true);
+    }
+    if (node->values.empty()) {
+      ++_prefixes;
+    }
+    node->values.push_back(std::move(value));
+    ++_size;
+  }
+
+  // Remove the copies of `value` stored under `prefix`, returns whether
+  // there were any
+  bool erase(const std::string &prefix, const T &value) {
+    // Remember the path to prune the nodes left empty
+    std::vector<Node *> path{&_root};
+    for (char c : prefix) {
+      Node *next = path.back()->child(c, false);
+      if (!next) {
+        return false;
+      }
+      path.push_back(next);
+    }
+    auto &values = path.back()->values;
+    auto it = std::remove(values.begin(), values.end(), value);
+    if (it == values.end()) {
+      return false;
+    }
+    _size -= (size_t)(values.end() - it);
+    values.erase(it, values.end());
+    if (values.empty()) {
+      --_prefixes;
+    }
+    for (size_t i = path.size() - 1; i > 0 && path[i]->empty(); --i) {
+      path[i - 1]->removeChild(path[i]);
+    }
+    return true;
+  }
+
+  // Call fn(value) for the values stored under every prefix of `key`, the
+  // empty prefix and `key` itself included
+  template <typename F>
+  void forEachPrefixOf(const std::string &key, F &&fn) const {
+    const Node *node = &_root;
+    for (size_t i = 0;; ++i) {
+      for (const auto &value : node->values) {
+        fn(value);
+      }
+      if (i == key.size() || !(node = node->find(key[i]))) {
+        return;
+      }
+    }
+  }
+
+  // Values, and prefixes holding at least one
+  size_t size() const { return _size; }
+  size_t prefixes() const { return _prefixes; }
+
+private:
+  struct Node {
+    std::vector<std::pair<char, std::unique_ptr<Node>>> children;
+    std::vector<T> values;
+
+    bool empty() const { return children.empty() && values.empty(); }
+
+    const Node *find(char c) const {
+      for (const auto &[key, node] : children) {
+        if (key == c) {
+          return node.get();
+        }
+      }
+      return nullptr;
+    }
+
+    Node *child(char c, bool create) {
+      if (const Node *node = find(c)) {
+        return const_cast<Node *>(node);
+      }
+      if (!create) {
+        return nullptr;
+      }
+      children.emplace_back(c, std::make_unique<Node>());
+      return children.back().second.get();
+    }
+
+    void removeChild(const Node *node) {
+      for (auto it = children.begin(); it != children.end(); ++it) {
+        if (it->second.get() == node) {
+          children.erase(it);
+          return;
+        }
+      }
+    }
+  };
+
+  Node _root;
+  size_t _size = 0;
+  size_t _prefixes = 0;
+};
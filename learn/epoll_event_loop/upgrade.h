@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+// Hot upgrade: a new process takes over from a running one without dropping
+// connections.
+//
+// The running server listens on a Unix socket. The successor connects to
+// it, then loads the dataset as a replica of the running server over TCP.
+// Once it follows the stream it sends "ready": the running server stops
+// reading from clients, and sends the state of every client connection
+// then the listening socket and the client sockets themselves (SCM_RIGHTS).
+// The successor serves them once it applied the stream up to the offset
+// the running server stopped at. It replies "done" before touching them,
+// and the running server exits. Clients only see the pause, their sockets
+// stay open. Until "done" the running server keeps its copies of the
+// sockets: when the successor goes away or stalls for k_timeout_ms, it
+// resumes serving them and the successor exits.
+//
+// Messages are frames of the request encoding, the file descriptors follow
+// the handoff frames in batches attached to a single byte.
+namespace Upgrade {
+
+// Descriptors per message, under the kernel limit (SCM_MAX_FD)
+constexpr size_t k_fds_per_msg = 64;
+// A stalled peer aborts the upgrade after this long
+constexpr int k_timeout_ms = 2000;
+
+inline bool unixAddr(const std::string &path, sockaddr_un &addr) {
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return false;
+  }
+  memcpy(addr.sun_path, path.data(), path.size());
+  return true;
+}
+
+// Listen at `path`, replacing a socket left there. Returns -1 on error.
+inline int listenUnix(const std::string &path) {
+  sockaddr_un addr;
+  if (!unixAddr(path, addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  unlink(path.c_str());
+  if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+inline int connectUnix(const std::string &path) {
+  sockaddr_un addr;
+  if (!unixAddr(path, addr)) {
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Bound the blocking reads and writes on `fd` to k_timeout_ms each
+inline bool setTimeout(int fd) {
+  timeval tv = {k_timeout_ms / 1000, (k_timeout_ms % 1000) * 1000};
+  return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+// Blocking, the control socket is only used at the handoff and has a
+// timeout (setTimeout)
+inline bool writeAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = send(fd, data, size, MSG_NOSIGNAL);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    data += rv;
+    size -= (size_t)rv;
+  }
+  return true;
+}
+
+inline bool readAll(int fd, char *data, size_t size) {
+  while (size > 0) {
+    ssize_t rv = read(fd, data, size);
+    if (rv < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rv <= 0) {
+      return false;
+    }
+    data += rv;
+    size -= (size_t)rv;
+  }
+  return true;
+}
+
+// Read one frame, the body is left in `body`
+inline bool readFrame(int fd, std::string &body) {
+  char header[4];
+  if (!readAll(fd, header, 4)) {
+    return false;
+  }
+  uint32_t len = 0;
+  memcpy(&len, header, 4);
+  body.resize(len);
+  return readAll(fd, &body[0], len);
+}
+
+inline bool sendFds(int sock, const std::vector<int> &fds) {
+  for (size_t i = 0; i < fds.size(); i += k_fds_per_msg) {
+    size_t n = std::min(k_fds_per_msg, fds.size() - i);
+    char byte = 0;
+    iovec iov = {&byte, 1};
+    std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fds[i], n * sizeof(int));
+    ssize_t rv = 0;
+    do {
+      rv = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (rv < 0 && errno == EINTR);
+    if (rv != 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Receive `n` descriptors sent by sendFds(), in order
+inline bool recvFds(int sock, size_t n, std::vector<int> &fds) {
+  while (fds.size() < n) {
+    size_t want = std::min(k_fds_per_msg, n - fds.size());
+    char byte = 0;
+    iovec iov = {&byte, 1};
+    std::vector<char> control(CMSG_SPACE(want * sizeof(int)));
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    ssize_t rv = 0;
+    do {
+      rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rv < 0 && errno == EINTR);
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (rv != 1 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(want * sizeof(int))) {
+      return false;
+    }
+    size_t at = fds.size();
+    fds.resize(at + want);
+    memcpy(&fds[at], CMSG_DATA(cmsg), want * sizeof(int));
+  }
+  return true;
+}
+
+} // namespace Upgrade